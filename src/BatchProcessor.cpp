@@ -0,0 +1,573 @@
+#include "BatchProcessor.h"
+#include "EditCommand.h"
+#include "HotFolder.h"
+#include "JobServer.h"
+#include "MappedImage.h"
+#include "PngWriter.h"
+#include "ProjectFile.h"
+#include "Recipe.h"
+#include "TileCache.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QFuture>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QJsonObject>
+#include <QMutex>
+#include <QSemaphore>
+#include <QTextStream>
+#include <QThread>
+#include <QThreadPool>
+#include <QtConcurrent>
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace {
+
+constexpr qsizetype MiB = 1024 * 1024;
+constexpr int DefaultMemoryMiB = 1024;
+
+// Turns one --op value into commands. Sizes depend on the document, so
+// operations are resolved against each file's canvas as it reaches
+// them; layer operations apply to every layer. Returns nothing for a
+// malformed operation.
+std::optional<std::vector<EditCommand>>
+parseOperation(const QString &operation, const QSize &canvas, int layers) {
+  const QString name = operation.section('=', 0, 0).trimmed().toLower();
+  const QString value = operation.section('=', 1).trimmed();
+  const QStringList values = value.split(',');
+  std::vector<EditCommand> commands;
+
+  auto toInts = [&values](int count) -> std::optional<std::vector<int>> {
+    if (values.size() != count) {
+      return std::nullopt;
+    }
+    std::vector<int> numbers;
+    for (const QString &text : values) {
+      bool ok = false;
+      numbers.push_back(text.trimmed().toInt(&ok));
+      if (!ok) {
+        return std::nullopt;
+      }
+    }
+    return numbers;
+  };
+
+  if (name == "resize") {
+    // WxH, Wx or xH to keep the aspect ratio, or a percentage.
+    QSize size;
+    if (value.endsWith('%')) {
+      bool ok = false;
+      const qreal scale = value.chopped(1).toDouble(&ok) / 100.0;
+      if (!ok || scale <= 0.0) {
+        return std::nullopt;
+      }
+      size = QSize(std::max(1, qRound(canvas.width() * scale)),
+                   std::max(1, qRound(canvas.height() * scale)));
+    } else {
+      const QStringList sides = value.split('x');
+      if (sides.size() != 2) {
+        return std::nullopt;
+      }
+      bool hasWidth = false;
+      bool hasHeight = false;
+      int width = sides[0].toInt(&hasWidth);
+      int height = sides[1].toInt(&hasHeight);
+      if ((hasWidth ? width <= 0 : !sides[0].isEmpty()) ||
+          (hasHeight ? height <= 0 : !sides[1].isEmpty()) ||
+          (!hasWidth && !hasHeight)) {
+        return std::nullopt;
+      }
+      if (!hasWidth) {
+        width = std::max(1, qRound(canvas.width() * qreal(height) /
+                                   std::max(1, canvas.height())));
+      } else if (!hasHeight) {
+        height = std::max(1, qRound(canvas.height() * qreal(width) /
+                                    std::max(1, canvas.width())));
+      }
+      size = QSize(width, height);
+    }
+    commands.push_back(EditCommand::resize(size, Qt::SmoothTransformation));
+  } else if (name == "crop") {
+    std::optional<std::vector<int>> rect = toInts(4);
+    if (!rect) {
+      return std::nullopt;
+    }
+    commands.push_back(EditCommand::crop(
+        QRect((*rect)[0], (*rect)[1], (*rect)[2], (*rect)[3]) &
+        QRect(QPoint(0, 0), canvas)));
+  } else if (name == "rotate") {
+    bool ok = false;
+    const qreal degrees = value.toDouble(&ok);
+    if (!ok) {
+      return std::nullopt;
+    }
+    for (int layer = 0; layer < layers; ++layer) {
+      commands.push_back(EditCommand::rotate(layer, degrees));
+    }
+  } else if (name == "flip") {
+    if (value != "h" && value != "v") {
+      return std::nullopt;
+    }
+    for (int layer = 0; layer < layers; ++layer) {
+      commands.push_back(EditCommand::flip(
+          layer, value == "v" ? Qt::Vertical : Qt::Horizontal));
+    }
+  } else if (name == "adjust") {
+    // brightness,contrast,saturation,hue as in the Adjustments panel.
+    std::optional<std::vector<int>> amounts = toInts(4);
+    if (!amounts) {
+      return std::nullopt;
+    }
+    for (int layer = 0; layer < layers; ++layer) {
+      commands.push_back(EditCommand::adjust(layer, (*amounts)[0],
+                                             (*amounts)[1], (*amounts)[2],
+                                             (*amounts)[3]));
+    }
+  } else {
+    // Filters go by the names recorded in history.
+    if (operation.contains('=')) {
+      return std::nullopt;
+    }
+    for (int layer = 0; layer < layers; ++layer) {
+      std::optional<EditCommand> command = EditCommand::fromJson(
+          {{"type", "filter"}, {"layer", layer}, {"filter", name}});
+      if (!command) {
+        return std::nullopt;
+      }
+      commands.push_back(*command);
+    }
+  }
+  return commands;
+}
+
+// Decoded pixels plus the working copy and the flattened result.
+qsizetype estimateBytes(const QString &path) {
+  QSize size;
+  int layers = 1;
+  if (ProjectFile::isProjectPath(path)) {
+    if (std::optional<DocumentState> state = ProjectFile::load(path)) {
+      size = state->canvasSize;
+      layers = static_cast<int>(state->layers.size());
+    }
+  } else if (MappedImage::canOpen(path)) {
+    // Mapped pixels are read from the page cache, so only the working
+    // copy and the result count.
+    if (std::shared_ptr<MappedImage> mapped = MappedImage::open(path)) {
+      size = mapped->size();
+      layers = 0;
+    }
+  } else {
+    QImageReader reader(path);
+    size = reader.size();
+  }
+  return qsizetype(size.width()) * size.height() * 4 * (layers + 2);
+}
+
+// A file on its way through the pipeline. Each stage fills in its part
+// and passes the job on untouched once an earlier one has failed.
+struct Job {
+  BatchProcessor::Result result;
+  int memoryUnits = 0;
+  std::optional<DocumentState> state;
+};
+
+Job decode(Job job) {
+  QElapsedTimer timer;
+  timer.start();
+  job.state = BatchProcessor::loadDocument(job.result.source);
+  if (!job.state) {
+    job.result.error = QStringLiteral("could not read the file");
+    return job;
+  }
+  job.result.pixels = qint64(job.state->canvasSize.width()) *
+                      job.state->canvasSize.height();
+  job.result.decodeMsecs = timer.elapsed();
+  return job;
+}
+
+Job edit(Job job, const BatchProcessor::Options &options) {
+  if (!job.state) {
+    return job;
+  }
+
+  QElapsedTimer timer;
+  timer.start();
+  if (!BatchProcessor::editDocument(*job.state, options.recipe,
+                                    options.operations)) {
+    job.result.error = QStringLiteral("the edits leave no image");
+    job.state.reset();
+  }
+  job.result.editMsecs = timer.elapsed();
+  return job;
+}
+
+Job encode(Job job) {
+  if (!job.state) {
+    return job;
+  }
+
+  QElapsedTimer timer;
+  timer.start();
+  if (!BatchProcessor::writeDocument(job.result.target, *job.state)) {
+    job.result.error =
+        QStringLiteral("could not write %1").arg(job.result.target);
+  }
+  job.state.reset();
+  job.result.encodeMsecs = timer.elapsed();
+  return job;
+}
+
+QString targetPath(const QString &source,
+                   const BatchProcessor::Options &options) {
+  const QFileInfo info(source);
+  const QString suffix =
+      options.format.isEmpty() ? info.suffix() : options.format;
+  return QDir(options.outputDir)
+      .filePath(info.completeBaseName() + '.' + suffix);
+}
+
+} // namespace
+
+std::optional<DocumentState>
+BatchProcessor::loadDocument(const QString &path) {
+  if (ProjectFile::isProjectPath(path)) {
+    return ProjectFile::load(path);
+  }
+
+  DocumentState state;
+  if (MappedImage::canOpen(path)) {
+    if (std::shared_ptr<MappedImage> mapped = MappedImage::open(path)) {
+      state.canvasSize = mapped->size();
+      state.layers.emplace_back(mapped->tiles(), "Background");
+      state.activeLayer = 0;
+      return state;
+    }
+  }
+
+  QImageReader reader(path);
+  reader.setAutoTransform(true);
+  QImage image = reader.read();
+  if (image.isNull()) {
+    return std::nullopt;
+  }
+
+  state.canvasSize = image.size();
+  state.layers.emplace_back(image, "Background");
+  state.activeLayer = 0;
+  return state;
+}
+
+bool BatchProcessor::editDocument(DocumentState &state, const Recipe &recipe,
+                                  const QStringList &operations) {
+  // Commands are collected and run together so that point-wise steps
+  // fuse. They only run early when the next operation sizes itself from
+  // the canvas.
+  std::vector<EditCommand> commands = recipe.steps();
+  for (const QString &operation : operations) {
+    const QString name = operation.section('=', 0, 0).trimmed().toLower();
+    if (name == "resize" || name == "crop") {
+      EditCommand::applyAll(commands, state);
+      commands.clear();
+    }
+    std::optional<std::vector<EditCommand>> resolved =
+        parseOperation(operation, state.canvasSize,
+                       static_cast<int>(state.layers.size()));
+    if (!resolved) {
+      return false;
+    }
+    commands.insert(commands.end(), resolved->begin(), resolved->end());
+  }
+  EditCommand::applyAll(commands, state);
+  return !state.canvasSize.isEmpty();
+}
+
+bool BatchProcessor::writeDocument(const QString &path,
+                                   const DocumentState &state) {
+  if (ProjectFile::isProjectPath(path)) {
+    return ProjectFile::save(path, state);
+  }
+
+  QImage flattened = flattenDocument(state);
+  if (hasDamagedTiles(state)) {
+    return false;
+  }
+  const QString suffix = QFileInfo(path).suffix().toLower();
+  if (suffix == "png") {
+    return PngWriter::write(path, flattened);
+  }
+
+  QImageWriter writer(path);
+  if (suffix == "jpg" || suffix == "jpeg") {
+    writer.setFormat("JPEG");
+    writer.setQuality(95);
+  } else if (suffix == "bmp") {
+    writer.setFormat("BMP");
+  }
+  return writer.write(flattened);
+}
+
+bool BatchProcessor::isValidOperation(const QString &operation) {
+  return parseOperation(operation, QSize(1, 1), 1).has_value();
+}
+
+BatchProcessor::BatchProcessor(const Options &options)
+    : m_options(options), m_decodePool(), m_editPool(), m_encodePool(),
+      m_slots(std::max(1, options.jobs)),
+      m_memory(std::max(1, options.memoryMiB)) {
+  // Decoding, editing and encoding each have a pool of their own, so one
+  // file's decode overlaps another's edits and a third one's encode.
+  for (QThreadPool *pool : {&m_decodePool, &m_editPool, &m_encodePool}) {
+    pool->setMaxThreadCount(std::max(1, options.jobs));
+  }
+
+  // The cache evicts tiles out from under whichever thread trims it, and
+  // every file here is edited on its own thread, so files in flight are
+  // bounded by the memory semaphore instead.
+  TileCache::instance().setBudget(0);
+}
+
+BatchProcessor::~BatchProcessor() { waitForDone(); }
+
+void BatchProcessor::submit(const QString &source,
+                            const Finished &finished) {
+  if (refuse(source, finished)) {
+    return;
+  }
+  const int units = memoryUnits(source);
+  m_slots.acquire();
+  m_memory.acquire(units);
+  start(source, units, finished);
+}
+
+bool BatchProcessor::trySubmit(const QString &source,
+                               const Finished &finished) {
+  if (refuse(source, finished)) {
+    return true;
+  }
+  const int units = memoryUnits(source);
+  if (!m_slots.tryAcquire()) {
+    return false;
+  }
+  if (!m_memory.tryAcquire(units)) {
+    m_slots.release();
+    return false;
+  }
+  start(source, units, finished);
+  return true;
+}
+
+void BatchProcessor::waitForDone() {
+  // A slot is only released once its file's callback has returned.
+  const int jobs = std::max(1, m_options.jobs);
+  m_slots.acquire(jobs);
+  m_slots.release(jobs);
+}
+
+int BatchProcessor::filesInFlight() const {
+  return std::max(1, m_options.jobs) - m_slots.available();
+}
+
+QString BatchProcessor::describe(const Result &result) {
+  return QStringLiteral("%1 ms  %2 -> %3  (decode %4, edit %5, "
+                        "encode %6 ms)")
+      .arg(QString::number(result.decodeMsecs + result.editMsecs +
+                           result.encodeMsecs),
+           result.source, result.target,
+           QString::number(result.decodeMsecs),
+           QString::number(result.editMsecs),
+           QString::number(result.encodeMsecs));
+}
+
+int BatchProcessor::memoryUnits(const QString &source) const {
+  // A file larger than the whole budget runs on its own.
+  return static_cast<int>(
+      std::clamp<qsizetype>((estimateBytes(source) + MiB - 1) / MiB, 1,
+                            std::max(1, m_options.memoryMiB)));
+}
+
+bool BatchProcessor::refuse(const QString &source,
+                            const Finished &finished) {
+  Result result;
+  result.source = source;
+  result.target = targetPath(source, m_options);
+  if (QFileInfo(result.target).absoluteFilePath() !=
+      QFileInfo(source).absoluteFilePath()) {
+    return false;
+  }
+  result.error = QStringLiteral("would overwrite itself");
+  finished(result);
+  return true;
+}
+
+void BatchProcessor::start(const QString &source, int units,
+                           const Finished &finished) {
+  Job job;
+  job.result.source = source;
+  job.result.target = targetPath(source, m_options);
+  job.memoryUnits = units;
+
+  QtConcurrent::run(&m_decodePool, decode, std::move(job))
+      .then(&m_editPool,
+            [this](Job job) { return edit(std::move(job), m_options); })
+      .then(&m_encodePool, [this, finished](Job job) {
+        job = encode(std::move(job));
+        m_memory.release(job.memoryUnits);
+        finished(job.result);
+        m_slots.release();
+      });
+}
+
+bool BatchProcessor::isRequested(int argc, char *argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--batch") == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int BatchProcessor::run(const QStringList &arguments) {
+  QCommandLineParser parser;
+  parser.setApplicationDescription(
+      "Edits images without opening a window.");
+  parser.addHelpOption();
+  parser.addOption({"batch", "Run headless."});
+  parser.addOption({{"o", "output"}, "Directory to write results to.",
+                    "directory"});
+  parser.addOption({"recipe",
+                    "Recipe exported from the editor, run before any --op.",
+                    "file"});
+  parser.addOption(
+      {"op",
+       "Operation to apply, in the order given: resize=WxH, resize=Wx, "
+       "resize=xH, resize=N%, crop=X,Y,W,H, rotate=DEGREES, flip=h|v, "
+       "adjust=B,C,S,H, grayscale, sepia, invert, blur or sharpen.",
+       "operation"});
+  parser.addOption({{"f", "format"},
+                    "Output format: png, jpg, bmp or picture. Defaults to "
+                    "the format of each input.",
+                    "format"});
+  parser.addOption({{"j", "jobs"},
+                    "Files in flight, and threads for each stage.", "count",
+                    QString::number(QThread::idealThreadCount())});
+  parser.addOption({"memory", "Pixel memory for files in flight.", "MB",
+                    QString::number(DefaultMemoryMiB)});
+  parser.addOption({"watch",
+                    "Keep running and process files as they appear in "
+                    "this directory.",
+                    "directory"});
+  parser.addOption({"server",
+                    "Keep running and take jobs from other tools on this "
+                    "local socket.",
+                    "name"});
+  parser.addOption({"log",
+                    "Log for --watch. Defaults to picture-hotfolder.log in "
+                    "the output directory.",
+                    "file"});
+  parser.addPositionalArgument("files", "Images or projects to process.",
+                               "files...");
+  parser.process(arguments);
+
+  QTextStream out(stdout);
+  QTextStream err(stderr);
+
+  Options options;
+  if (parser.isSet("recipe")) {
+    std::optional<Recipe> recipe = Recipe::load(parser.value("recipe"));
+    if (!recipe) {
+      err << "Could not read recipe " << parser.value("recipe") << Qt::endl;
+      return 2;
+    }
+    options.recipe = std::move(*recipe);
+  }
+
+  options.operations = parser.values("op");
+  for (const QString &operation : options.operations) {
+    if (!isValidOperation(operation)) {
+      err << "Unknown operation: " << operation << Qt::endl;
+      return 2;
+    }
+  }
+
+  options.outputDir = parser.value("output");
+  options.format = parser.value("format").toLower();
+  options.jobs = std::max(1, parser.value("jobs").toInt());
+  options.memoryMiB = std::max(1, parser.value("memory").toInt());
+  if (parser.isSet("server")) {
+    JobServer server;
+    if (!server.listen(parser.value("server"))) {
+      err << "Could not listen on " << parser.value("server")
+          << " (is another server using it?)" << Qt::endl;
+      return 1;
+    }
+    return QCoreApplication::exec();
+  }
+
+  const QString watchDir = parser.value("watch");
+  const QStringList files = parser.positionalArguments();
+  if (options.outputDir.isEmpty() || (files.isEmpty() && watchDir.isEmpty())) {
+    err << "Batch mode needs --output and at least one file or --watch."
+        << Qt::endl;
+    return 2;
+  }
+  if (!QDir().mkpath(options.outputDir)) {
+    err << "Could not create " << options.outputDir << Qt::endl;
+    return 1;
+  }
+
+  if (!watchDir.isEmpty()) {
+    const QString logPath =
+        parser.isSet("log")
+            ? parser.value("log")
+            : QDir(options.outputDir).filePath("picture-hotfolder.log");
+    HotFolder hotFolder(watchDir, logPath, options);
+    if (!hotFolder.start()) {
+      err << "Could not watch " << watchDir << Qt::endl;
+      return 1;
+    }
+    return QCoreApplication::exec();
+  }
+
+  QMutex outputMutex;
+  int failures = 0;
+  qint64 totalPixels = 0;
+  auto report = [&](const Result &result) {
+    QMutexLocker locker(&outputMutex);
+    if (!result.error.isEmpty()) {
+      err << result.source << ": " << result.error << Qt::endl;
+      ++failures;
+      return;
+    }
+    totalPixels += result.pixels;
+    out << describe(result) << Qt::endl;
+  };
+
+  QElapsedTimer elapsed;
+  elapsed.start();
+  {
+    BatchProcessor processor(options);
+    for (const QString &source : files) {
+      processor.submit(source, report);
+    }
+    processor.waitForDone();
+  }
+
+  const qreal seconds = std::max<qint64>(elapsed.elapsed(), 1) / 1000.0;
+  const int written = static_cast<int>(files.size()) - failures;
+  out << QStringLiteral("%1 of %2 files in %3 s: %4 files/s, %5 MP/s")
+             .arg(written)
+             .arg(files.size())
+             .arg(seconds, 0, 'f', 2)
+             .arg(written / seconds, 0, 'f', 2)
+             .arg(totalPixels / 1e6 / seconds, 0, 'f', 1)
+      << Qt::endl;
+  return failures == 0 ? 0 : 1;
+}
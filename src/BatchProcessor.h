@@ -0,0 +1,94 @@
+#ifndef BATCHPROCESSOR_H
+#define BATCHPROCESSOR_H
+
+#include "Recipe.h"
+
+#include <QSemaphore>
+#include <QStringList>
+#include <QThreadPool>
+#include <functional>
+#include <optional>
+
+// Headless editing: decodes files, applies a recipe and --op operations
+// in order, and encodes the results into an output directory. Decode,
+// edit and encode are pipelined across files, and files are only started
+// while their estimated pixels fit in the memory budget.
+//
+// Picture --batch --output DIR [--recipe FILE] [--op OP]... FILE...
+// processes the files given and prints a line per file and the
+// throughput at the end. With --watch DIR it keeps running as a hot
+// folder instead, see HotFolder, and with --server NAME it takes jobs
+// from other tools, see JobServer.
+class BatchProcessor {
+public:
+  struct Options {
+    Recipe recipe;
+    // --op values, resolved against each file's canvas.
+    QStringList operations;
+    QString outputDir;
+    // Output suffix, or empty to keep each input's format.
+    QString format;
+    int jobs = 1;
+    int memoryMiB = 1024;
+  };
+
+  struct Result {
+    QString source;
+    QString target;
+    // Empty once the file was written.
+    QString error;
+    qint64 pixels = 0;
+    qint64 decodeMsecs = 0;
+    qint64 editMsecs = 0;
+    qint64 encodeMsecs = 0;
+  };
+  // Called on a worker thread, or on the caller's for a file refused
+  // outright.
+  using Finished = std::function<void(const Result &result)>;
+
+  explicit BatchProcessor(const Options &options);
+  ~BatchProcessor();
+
+  BatchProcessor(const BatchProcessor &) = delete;
+  BatchProcessor &operator=(const BatchProcessor &) = delete;
+
+  // Starts a file through the pipeline, waiting while it is full.
+  void submit(const QString &source, const Finished &finished);
+  // Starts a file only if there is room for it now.
+  bool trySubmit(const QString &source, const Finished &finished);
+  // Waits until every file submitted so far has finished.
+  void waitForDone();
+  int filesInFlight() const;
+
+  // One report line: total and per-stage times.
+  static QString describe(const Result &result);
+
+  // The stages each file goes through, for other front ends. Safe to
+  // call off the GUI thread.
+  static bool isValidOperation(const QString &operation);
+  static std::optional<DocumentState> loadDocument(const QString &path);
+  // Returns false for an invalid operation or an empty result.
+  static bool editDocument(DocumentState &state, const Recipe &recipe,
+                           const QStringList &operations);
+  static bool writeDocument(const QString &path, const DocumentState &state);
+
+  // Checked before any application object exists, since batch runs do
+  // not need a display.
+  static bool isRequested(int argc, char *argv[]);
+  // Returns the process exit code: 0 once every file was written.
+  static int run(const QStringList &arguments);
+
+private:
+  int memoryUnits(const QString &source) const;
+  bool refuse(const QString &source, const Finished &finished);
+  void start(const QString &source, int units, const Finished &finished);
+
+  Options m_options;
+  QThreadPool m_decodePool;
+  QThreadPool m_editPool;
+  QThreadPool m_encodePool;
+  QSemaphore m_slots;
+  QSemaphore m_memory;
+};
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef BRUSHTOOL_H
 #define BRUSHTOOL_H
 
+#include "DabEngine.h"
 #include "DrawingTool.h"
 
 class BrushTool : public DrawingTool {
@@ -8,18 +9,16 @@ public:
   BrushTool();
   ~BrushTool() override = default;
 
-  void onPress(QImage &image, const QPoint &pos) override;
-  void onMove(QImage &image, const QPoint &pos) override;
-  void onRelease(QImage &image, const QPoint &pos) override;
-
-  void setHardness(qreal hardness);
-  qreal hardness() const;
+  void onPress(TiledImage &image, const QPoint &pos) override;
+  void onMove(TiledImage &image, const QPoint &pos) override;
+  void onRelease(TiledImage &image, const QPoint &pos) override;
 
 private:
-  void drawLine(QImage &image, const QPoint &from, const QPoint &to);
-  void drawBrushDab(QImage &image, const QPoint &pos);
+  void drawLine(TiledImage &image, const QPoint &from, const QPoint &to);
+  void drawBrushDab(TiledImage &image, const QPointF &pos);
 
-  qreal m_hardness;
+  DabEngine m_dabEngine;
+  std::vector<QPointF> m_dabs;
 };
 
 #endif
@@ -0,0 +1,333 @@
+#include "DabEngine.h"
+
+#include <QLineF>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+constexpr size_t MaxCachedMasks = 256;
+
+inline quint32 div255(quint32 x) { return (x + 128 + ((x + 128) >> 8)) >> 8; }
+
+// Scales all four premultiplied channels of a pixel by a / 255.
+inline quint32 byteMul(quint32 pixel, quint32 a) {
+  quint32 t = (pixel & 0xff00ff) * a;
+  t = (t + ((t >> 8) & 0xff00ff) + 0x800080) >> 8;
+  t &= 0xff00ff;
+
+  pixel = ((pixel >> 8) & 0xff00ff) * a;
+  pixel = pixel + ((pixel >> 8) & 0xff00ff) + 0x800080;
+  pixel &= 0xff00ff00;
+  return pixel | t;
+}
+
+#if defined(__SSE2__)
+inline __m128i div255Epi16(__m128i x) {
+  x = _mm_add_epi16(x, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// Widens four 16-bit per-pixel factors to per-channel lanes for two pixel
+// halves of a 4-pixel block.
+inline void spreadFactors(__m128i factors, __m128i &low, __m128i &high) {
+  __m128i pairs = _mm_unpacklo_epi16(factors, factors);
+  low = _mm_unpacklo_epi32(pairs, pairs);
+  high = _mm_unpackhi_epi32(pairs, pairs);
+}
+#endif
+
+} // namespace
+
+DabEngine::DabEngine() : m_masks(), m_spacing(0.1), m_carry(0.0) {}
+
+void DabEngine::setSpacing(qreal spacing) {
+  m_spacing = std::clamp(spacing, 0.01, 1.0);
+}
+
+qreal DabEngine::spacing() const { return m_spacing; }
+
+void DabEngine::beginStroke() { m_carry = 0.0; }
+
+void DabEngine::lineDabs(const QPointF &from, const QPointF &to,
+                         qreal diameter, std::vector<QPointF> &dabs) {
+  dabs.clear();
+
+  qreal step = std::max(1.0, diameter * m_spacing);
+  QLineF line(from, to);
+  qreal length = line.length();
+  // A repeated sample adds no distance.
+  if (length <= 0.0) {
+    return;
+  }
+
+  // The leftover distance is carried over so that dabs stay evenly spaced
+  // across segment boundaries instead of doubling up at every joint. When
+  // pressure shrinks the step below the carry, the next dab is due at the
+  // start of the segment, never behind it.
+  qreal t = std::max(0.0, step - m_carry);
+  while (t <= length) {
+    dabs.push_back(line.pointAt(t / length));
+    t += step;
+  }
+  m_carry = length - (t - step);
+}
+
+QRect DabEngine::paintDab(TiledImage &image, const QPointF &center,
+                          qreal diameter, qreal hardness, const QColor &color,
+                          qreal opacity) {
+  const Mask &dab = mask(diameter, hardness);
+  QRect rect = dabRect(center, dab);
+  QRect clipped = rect.intersected(image.rect());
+  if (clipped.isEmpty()) {
+    return QRect();
+  }
+
+  QRgb src = qPremultiply(color.rgba());
+  quint32 alpha = static_cast<quint32>(qRound(opacity * 255));
+
+  QRect span = image.tileSpan(clipped);
+  for (int row = span.top(); row <= span.bottom(); ++row) {
+    for (int column = span.left(); column <= span.right(); ++column) {
+      QRect tileArea = image.tileRect(column, row);
+      QRect part = tileArea.intersected(clipped);
+      QImage &tile = image.tileForWriting(column, row);
+
+      for (int y = part.top(); y <= part.bottom(); ++y) {
+        QRgb *line = reinterpret_cast<QRgb *>(
+                         tile.scanLine(y - tileArea.top())) +
+                     (part.left() - tileArea.left());
+        const quint8 *coverage = dab.coverage.data() +
+                                 (y - rect.top()) * dab.size +
+                                 (part.left() - rect.left());
+        paintSpan(line, coverage, part.width(), src, alpha);
+      }
+    }
+  }
+  return clipped;
+}
+
+QRect DabEngine::eraseDab(TiledImage &image, const QPointF &center,
+                          qreal diameter, qreal hardness, qreal opacity) {
+  const Mask &dab = mask(diameter, hardness);
+  QRect rect = dabRect(center, dab);
+  QRect clipped = rect.intersected(image.rect());
+  if (clipped.isEmpty()) {
+    return QRect();
+  }
+
+  quint32 alpha = static_cast<quint32>(qRound(opacity * 255));
+
+  QRect span = image.tileSpan(clipped);
+  for (int row = span.top(); row <= span.bottom(); ++row) {
+    for (int column = span.left(); column <= span.right(); ++column) {
+      // Nothing to erase in tiles that were never allocated.
+      if (!image.hasTile(column, row)) {
+        continue;
+      }
+      QRect tileArea = image.tileRect(column, row);
+      QRect part = tileArea.intersected(clipped);
+      QImage &tile = image.tileForWriting(column, row);
+
+      for (int y = part.top(); y <= part.bottom(); ++y) {
+        QRgb *line = reinterpret_cast<QRgb *>(
+                         tile.scanLine(y - tileArea.top())) +
+                     (part.left() - tileArea.left());
+        const quint8 *coverage = dab.coverage.data() +
+                                 (y - rect.top()) * dab.size +
+                                 (part.left() - rect.left());
+        eraseSpan(line, coverage, part.width(), alpha);
+      }
+    }
+  }
+  return clipped;
+}
+
+void DabEngine::paintSpan(QRgb *dst, const quint8 *coverage, int count,
+                          QRgb src, quint32 opacity) {
+  int i = 0;
+  const quint32 srcAlpha = qAlpha(src);
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i full = _mm_set1_epi16(255);
+  const __m128i opacity16 = _mm_set1_epi16(static_cast<short>(opacity));
+  const __m128i alpha16 = _mm_set1_epi16(static_cast<short>(srcAlpha));
+  const __m128i src16 =
+      _mm_unpacklo_epi8(_mm_set1_epi32(static_cast<int>(src)), zero);
+
+  for (; i + 4 <= count; i += 4) {
+    quint32 packed;
+    std::memcpy(&packed, coverage + i, sizeof(packed));
+    if (packed == 0) {
+      continue;
+    }
+
+    __m128i cov = _mm_unpacklo_epi8(
+        _mm_cvtsi32_si128(static_cast<int>(packed)), zero);
+    cov = div255Epi16(_mm_mullo_epi16(cov, opacity16));
+    __m128i inv =
+        _mm_sub_epi16(full, div255Epi16(_mm_mullo_epi16(cov, alpha16)));
+
+    __m128i covLow, covHigh, invLow, invHigh;
+    spreadFactors(cov, covLow, covHigh);
+    spreadFactors(inv, invLow, invHigh);
+
+    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+    __m128i dLow = _mm_unpacklo_epi8(d, zero);
+    __m128i dHigh = _mm_unpackhi_epi8(d, zero);
+
+    dLow = _mm_add_epi16(div255Epi16(_mm_mullo_epi16(src16, covLow)),
+                         div255Epi16(_mm_mullo_epi16(dLow, invLow)));
+    dHigh = _mm_add_epi16(div255Epi16(_mm_mullo_epi16(src16, covHigh)),
+                          div255Epi16(_mm_mullo_epi16(dHigh, invHigh)));
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                     _mm_packus_epi16(dLow, dHigh));
+  }
+#endif
+
+  for (; i < count; ++i) {
+    quint32 c = div255(coverage[i] * opacity);
+    if (c == 0) {
+      continue;
+    }
+    quint32 inv = 255 - div255(srcAlpha * c);
+    dst[i] = byteMul(src, c) + byteMul(dst[i], inv);
+  }
+}
+
+void DabEngine::eraseSpan(QRgb *dst, const quint8 *coverage, int count,
+                          quint32 opacity) {
+  int i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i full = _mm_set1_epi16(255);
+  const __m128i opacity16 = _mm_set1_epi16(static_cast<short>(opacity));
+
+  for (; i + 4 <= count; i += 4) {
+    quint32 packed;
+    std::memcpy(&packed, coverage + i, sizeof(packed));
+    if (packed == 0) {
+      continue;
+    }
+
+    __m128i cov = _mm_unpacklo_epi8(
+        _mm_cvtsi32_si128(static_cast<int>(packed)), zero);
+    __m128i keep =
+        _mm_sub_epi16(full, div255Epi16(_mm_mullo_epi16(cov, opacity16)));
+
+    __m128i keepLow, keepHigh;
+    spreadFactors(keep, keepLow, keepHigh);
+
+    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+    __m128i dLow = div255Epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero),
+                                               keepLow));
+    __m128i dHigh = div255Epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero),
+                                                keepHigh));
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                     _mm_packus_epi16(dLow, dHigh));
+  }
+#endif
+
+  for (; i < count; ++i) {
+    quint32 c = div255(coverage[i] * opacity);
+    if (c != 0) {
+      dst[i] = byteMul(dst[i], 255 - c);
+    }
+  }
+}
+
+void DabEngine::blendSpan(QRgb *dst, const QRgb *src, int count,
+                          quint32 opacity) {
+  int i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i full = _mm_set1_epi16(255);
+  const __m128i opacity16 = _mm_set1_epi16(static_cast<short>(opacity));
+
+  for (; i + 4 <= count; i += 4) {
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+
+    __m128i sLow = div255Epi16(
+        _mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), opacity16));
+    __m128i sHigh = div255Epi16(
+        _mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), opacity16));
+
+    // Broadcast each pixel's scaled alpha across its four channel lanes.
+    __m128i invLow = _mm_sub_epi16(
+        full, _mm_shufflehi_epi16(_mm_shufflelo_epi16(sLow, 0xff), 0xff));
+    __m128i invHigh = _mm_sub_epi16(
+        full, _mm_shufflehi_epi16(_mm_shufflelo_epi16(sHigh, 0xff), 0xff));
+
+    __m128i dLow = _mm_add_epi16(
+        sLow, div255Epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), invLow)));
+    __m128i dHigh = _mm_add_epi16(
+        sHigh,
+        div255Epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), invHigh)));
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                     _mm_packus_epi16(dLow, dHigh));
+  }
+#endif
+
+  for (; i < count; ++i) {
+    quint32 s = byteMul(src[i], opacity);
+    dst[i] = s + byteMul(dst[i], 255 - qAlpha(s));
+  }
+}
+
+const DabEngine::Mask &DabEngine::mask(qreal diameter, qreal hardness) {
+  // Masks are cached per quarter-pixel diameter and 1/255 hardness step, so
+  // pressure changes reuse a handful of masks instead of re-rasterizing.
+  quint32 diameterKey = static_cast<quint32>(qRound(diameter * 4));
+  quint32 hardnessKey = static_cast<quint32>(qRound(hardness * 255));
+  quint32 key = (diameterKey << 8) | hardnessKey;
+
+  auto it = m_masks.find(key);
+  if (it != m_masks.end()) {
+    return it->second;
+  }
+
+  if (m_masks.size() >= MaxCachedMasks) {
+    m_masks.clear();
+  }
+
+  qreal radius = std::max(0.5, diameterKey / 8.0);
+  qreal inner = radius * (hardnessKey / 255.0);
+
+  Mask dab;
+  dab.size = static_cast<int>(std::ceil(radius * 2)) + 2;
+  dab.coverage.resize(static_cast<size_t>(dab.size) * dab.size);
+
+  qreal centre = dab.size / 2.0;
+  for (int y = 0; y < dab.size; ++y) {
+    for (int x = 0; x < dab.size; ++x) {
+      qreal distance = std::hypot(x + 0.5 - centre, y + 0.5 - centre);
+      qreal edge = std::clamp(radius - distance + 0.5, 0.0, 1.0);
+      qreal falloff = 1.0;
+      if (distance > inner && radius > inner) {
+        falloff = std::clamp((radius - distance) / (radius - inner), 0.0, 1.0);
+      }
+      dab.coverage[y * dab.size + x] =
+          static_cast<quint8>(qRound(std::min(edge, falloff) * 255));
+    }
+  }
+
+  return m_masks.emplace(key, std::move(dab)).first->second;
+}
+
+QRect DabEngine::dabRect(const QPointF &center, const Mask &mask) const {
+  int left = qRound(center.x() - mask.size / 2.0);
+  int top = qRound(center.y() - mask.size / 2.0);
+  return QRect(left, top, mask.size, mask.size);
+}
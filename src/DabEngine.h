@@ -0,0 +1,49 @@
+#ifndef DABENGINE_H
+#define DABENGINE_H
+
+#include "TiledImage.h"
+
+#include <QColor>
+#include <QPointF>
+#include <unordered_map>
+#include <vector>
+
+class DabEngine {
+public:
+  DabEngine();
+
+  void setSpacing(qreal spacing);
+  qreal spacing() const;
+
+  void beginStroke();
+  void lineDabs(const QPointF &from, const QPointF &to, qreal diameter,
+                std::vector<QPointF> &dabs);
+
+  QRect paintDab(TiledImage &image, const QPointF &center, qreal diameter,
+                 qreal hardness, const QColor &color, qreal opacity);
+  QRect eraseDab(TiledImage &image, const QPointF &center, qreal diameter,
+                 qreal hardness, qreal opacity);
+
+  // Premultiplied span kernels; coverage and opacity are 0-255.
+  static void paintSpan(QRgb *dst, const quint8 *coverage, int count,
+                        QRgb src, quint32 opacity);
+  static void eraseSpan(QRgb *dst, const quint8 *coverage, int count,
+                        quint32 opacity);
+  static void blendSpan(QRgb *dst, const QRgb *src, int count,
+                        quint32 opacity);
+
+private:
+  struct Mask {
+    int size = 0;
+    std::vector<quint8> coverage;
+  };
+
+  const Mask &mask(qreal diameter, qreal hardness);
+  QRect dabRect(const QPointF &center, const Mask &mask) const;
+
+  std::unordered_map<quint32, Mask> m_masks;
+  qreal m_spacing;
+  qreal m_carry;
+};
+
+#endif
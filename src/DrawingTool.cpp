@@ -1,7 +1,16 @@
 #include "DrawingTool.h"
 
 DrawingTool::DrawingTool()
-    : m_color(Qt::black), m_size(10), m_opacity(1.0), m_lastPos() {}
+    : m_color(Qt::black), m_size(10), m_opacity(1.0), m_hardness(0.5),
+      m_pressure(1.0), m_lastPos(), m_dirtyRect() {}
+
+void DrawingTool::onSamples(TiledImage &image,
+                            const std::vector<StrokeSample> &samples) {
+  for (const auto &sample : samples) {
+    setPressure(sample.pressure);
+    onMove(image, sample.pos.toPoint());
+  }
+}
 
 void DrawingTool::setColor(const QColor &color) { m_color = color; }
 
@@ -16,3 +25,23 @@ void DrawingTool::setOpacity(qreal opacity) {
 }
 
 qreal DrawingTool::opacity() const { return m_opacity; }
+
+void DrawingTool::setHardness(qreal hardness) {
+  m_hardness = std::clamp(hardness, 0.0, 1.0);
+}
+
+qreal DrawingTool::hardness() const { return m_hardness; }
+
+void DrawingTool::setPressure(qreal pressure) {
+  m_pressure = std::clamp(pressure, 0.0, 1.0);
+}
+
+qreal DrawingTool::pressure() const { return m_pressure; }
+
+QRect DrawingTool::takeDirtyRect() {
+  QRect rect = m_dirtyRect;
+  m_dirtyRect = QRect();
+  return rect;
+}
+
+void DrawingTool::markDirty(const QRect &rect) { m_dirtyRect |= rect; }
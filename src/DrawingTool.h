@@ -1,18 +1,35 @@
 #ifndef DRAWINGTOOL_H
 #define DRAWINGTOOL_H
 
+#include "TiledImage.h"
+
 #include <QColor>
-#include <QImage>
 #include <QPoint>
+#include <QPointF>
+#include <QRect>
+#include <vector>
+
+struct StrokeSample {
+  QPointF pos;
+  qreal pressure = 1.0;
+  qreal xTilt = 0.0;
+  qreal yTilt = 0.0;
+  quint64 timestamp = 0;
+};
 
 class DrawingTool {
 public:
   DrawingTool();
   virtual ~DrawingTool() = default;
 
-  virtual void onPress(QImage &image, const QPoint &pos) = 0;
-  virtual void onMove(QImage &image, const QPoint &pos) = 0;
-  virtual void onRelease(QImage &image, const QPoint &pos) = 0;
+  virtual void onPress(TiledImage &image, const QPoint &pos) = 0;
+  virtual void onMove(TiledImage &image, const QPoint &pos) = 0;
+  virtual void onRelease(TiledImage &image, const QPoint &pos) = 0;
+
+  // Replays a batch of queued input samples in order. The default
+  // forwards each sample to onMove() with its pressure applied.
+  virtual void onSamples(TiledImage &image,
+                         const std::vector<StrokeSample> &samples);
 
   void setColor(const QColor &color);
   QColor color() const;
@@ -23,11 +40,25 @@ public:
   void setOpacity(qreal opacity);
   qreal opacity() const;
 
+  void setHardness(qreal hardness);
+  qreal hardness() const;
+
+  void setPressure(qreal pressure);
+  qreal pressure() const;
+
+  // Returns the image area modified since the last call and resets it.
+  QRect takeDirtyRect();
+
 protected:
+  void markDirty(const QRect &rect);
+
   QColor m_color;
   int m_size;
   qreal m_opacity;
+  qreal m_hardness;
+  qreal m_pressure;
   QPoint m_lastPos;
+  QRect m_dirtyRect;
 };
 
 #endif
@@ -0,0 +1,385 @@
+#include "EditCommand.h"
+#include "ImageProcessor.h"
+
+#include <QJsonArray>
+#include <QPainter>
+#include <QTransform>
+#include <algorithm>
+
+namespace {
+
+const char *const TypeNames[] = {"resize", "crop",   "rotate",
+                                 "flip",   "filter", "adjust"};
+const char *const FilterNames[] = {"grayscale", "sepia", "invert", "blur",
+                                   "sharpen"};
+
+template <typename Enum, size_t Count>
+std::optional<Enum> enumFromName(const char *const (&names)[Count],
+                                 const QString &name) {
+  for (size_t i = 0; i < Count; ++i) {
+    if (name == QLatin1String(names[i])) {
+      return static_cast<Enum>(i);
+    }
+  }
+  return std::nullopt;
+}
+
+void setTransformedImage(DocumentState &state, Layer &layer,
+                         const QImage &image) {
+  // A bottom layer that spans the canvas still defines its size, as before
+  // layers had their own extent; other layers turn about their centre.
+  if (&layer == &state.layers.front() &&
+      layer.rect() == QRect(QPoint(0, 0), state.canvasSize)) {
+    layer.setImage(image);
+    state.canvasSize = image.size();
+    return;
+  }
+
+  QPoint center = layer.rect().center();
+  layer.setImage(image);
+  layer.setOffset(center - QRect(QPoint(0, 0), image.size()).center());
+}
+
+void resizeLayers(DocumentState &state, const QSize &size,
+                  Qt::TransformationMode mode) {
+  const qreal scaleX = size.width() / qreal(state.canvasSize.width());
+  const qreal scaleY = size.height() / qreal(state.canvasSize.height());
+
+  for (Layer &layer : state.layers) {
+    QRect rect = layer.rect();
+    QRect scaled(qRound(rect.x() * scaleX), qRound(rect.y() * scaleY),
+                 std::max(1, qRound(rect.width() * scaleX)),
+                 std::max(1, qRound(rect.height() * scaleY)));
+    layer.setImage(
+        layer.image().scaled(scaled.size(), Qt::IgnoreAspectRatio, mode));
+    layer.setOffset(scaled.topLeft());
+  }
+  state.canvasSize = size;
+}
+
+void cropLayers(DocumentState &state, const QRect &cropRect) {
+  for (Layer &layer : state.layers) {
+    // Layers keep only the part inside the crop, so a patch stays small.
+    QRect kept = layer.rect().intersected(cropRect);
+    if (kept.isEmpty()) {
+      layer.setImage(QImage());
+      layer.setOffset(QPoint());
+      continue;
+    }
+    layer.setImage(layer.tiles().copy(kept.translated(-layer.offset())));
+    layer.setOffset(kept.topLeft() - cropRect.topLeft());
+  }
+  state.canvasSize = cropRect.size();
+}
+
+void rotateLayer(DocumentState &state, Layer &layer, qreal degrees,
+                 const QColor &background) {
+  QTransform transform;
+  transform.rotate(degrees);
+  QImage rotated =
+      layer.image().transformed(transform, Qt::SmoothTransformation);
+
+  if (background.alpha() > 0) {
+    QImage result(rotated.size(), QImage::Format_ARGB32_Premultiplied);
+    result.fill(background);
+    QPainter painter(&result);
+    painter.drawImage(0, 0, rotated);
+    painter.end();
+    setTransformedImage(state, layer, result);
+  } else {
+    setTransformedImage(state, layer, rotated);
+  }
+}
+
+void filterLayer(Layer &layer, EditCommand::Filter filter) {
+  // Point filters run tile by tile; the neighbourhood filters get an
+  // apron wide enough to read across tile edges.
+  TiledImage &tiles = layer.tiles();
+  switch (filter) {
+  case EditCommand::Filter::Grayscale:
+    tiles = tiles.transformed(&ImageProcessor::applyGrayscale);
+    break;
+  case EditCommand::Filter::Sepia:
+    tiles = tiles.transformed(&ImageProcessor::applySepia);
+    break;
+  case EditCommand::Filter::Invert:
+    tiles = tiles.transformed(&ImageProcessor::applyInvert);
+    break;
+  case EditCommand::Filter::Blur:
+    tiles = tiles.transformed(
+        [](const QImage &tile) { return ImageProcessor::applyBlur(tile); }, 2);
+    break;
+  case EditCommand::Filter::Sharpen:
+    tiles = tiles.transformed(&ImageProcessor::applySharpen, 1);
+    break;
+  }
+}
+
+QImage applyPointwise(const EditCommand &command, const QImage &tile) {
+  if (command.type == EditCommand::Type::Adjust) {
+    return ImageProcessor::applyAdjustments(tile, command.brightness,
+                                            command.contrast,
+                                            command.saturation, command.hue);
+  }
+
+  switch (command.filterType) {
+  case EditCommand::Filter::Grayscale:
+    return ImageProcessor::applyGrayscale(tile);
+  case EditCommand::Filter::Sepia:
+    return ImageProcessor::applySepia(tile);
+  case EditCommand::Filter::Invert:
+    return ImageProcessor::applyInvert(tile);
+  default:
+    return tile;
+  }
+}
+
+} // namespace
+
+QImage flattenDocument(const DocumentState &state,
+                       const std::function<void(int)> &progress) {
+  if (state.layers.empty()) {
+    return QImage();
+  }
+
+  QImage result(state.canvasSize, QImage::Format_ARGB32_Premultiplied);
+  result.fill(Qt::transparent);
+
+  QPainter painter(&result);
+  const int height = state.canvasSize.height();
+  for (int y = 0; y < height; y += TiledImage::TileSize) {
+    QRect band(0, y, state.canvasSize.width(),
+               std::min(TiledImage::TileSize, height - y));
+    for (const Layer &layer : state.layers) {
+      layer.render(painter, band, band);
+    }
+    if (progress) {
+      progress(100 * band.bottom() / std::max(1, height - 1));
+    }
+  }
+
+  return result;
+}
+
+bool hasDamagedTiles(const DocumentState &state) {
+  return std::any_of(
+      state.layers.begin(), state.layers.end(),
+      [](const Layer &layer) { return layer.tiles().isDamaged(); });
+}
+
+EditCommand EditCommand::resize(const QSize &size,
+                                Qt::TransformationMode mode) {
+  EditCommand command;
+  command.type = Type::Resize;
+  command.size = size;
+  command.transformMode = mode;
+  return command;
+}
+
+EditCommand EditCommand::crop(const QRect &rect) {
+  EditCommand command;
+  command.type = Type::Crop;
+  command.rect = rect;
+  return command;
+}
+
+EditCommand EditCommand::rotate(int layer, qreal degrees,
+                                const QColor &background) {
+  EditCommand command;
+  command.type = Type::Rotate;
+  command.layer = layer;
+  command.degrees = degrees;
+  command.background = background;
+  return command;
+}
+
+EditCommand EditCommand::flip(int layer, Qt::Orientation orientation) {
+  EditCommand command;
+  command.type = Type::Flip;
+  command.layer = layer;
+  command.orientation = orientation;
+  return command;
+}
+
+EditCommand EditCommand::filter(int layer, Filter filter) {
+  EditCommand command;
+  command.type = Type::Filter;
+  command.layer = layer;
+  command.filterType = filter;
+  return command;
+}
+
+EditCommand EditCommand::adjust(int layer, int brightness, int contrast,
+                                int saturation, int hue) {
+  EditCommand command;
+  command.type = Type::Adjust;
+  command.layer = layer;
+  command.brightness = brightness;
+  command.contrast = contrast;
+  command.saturation = saturation;
+  command.hue = hue;
+  return command;
+}
+
+void EditCommand::apply(DocumentState &state) const {
+  if (type == Type::Resize) {
+    resizeLayers(state, size, transformMode);
+    return;
+  }
+  if (type == Type::Crop) {
+    cropLayers(state, rect);
+    return;
+  }
+
+  if (layer < 0 || layer >= static_cast<int>(state.layers.size())) {
+    return;
+  }
+
+  Layer &target = state.layers[layer];
+  switch (type) {
+  case Type::Rotate:
+    rotateLayer(state, target, degrees, background);
+    break;
+  case Type::Flip:
+    target.setImage(target.image().flipped(orientation));
+    break;
+  case Type::Filter:
+    filterLayer(target, filterType);
+    break;
+  case Type::Adjust:
+    target.tiles() = target.tiles().transformed([this](const QImage &tile) {
+      return ImageProcessor::applyAdjustments(tile, brightness, contrast,
+                                              saturation, hue);
+    });
+    break;
+  default:
+    break;
+  }
+}
+
+void EditCommand::applyAll(const std::vector<EditCommand> &commands,
+                           DocumentState &state) {
+  for (size_t first = 0; first < commands.size();) {
+    size_t end = first;
+    while (end < commands.size() && commands[end].isPointwise()) {
+      ++end;
+    }
+    if (end == first) {
+      commands[first].apply(state);
+      ++first;
+      continue;
+    }
+
+    // Point-wise commands on different layers commute, so a run of them
+    // becomes one pass per layer even when the layers are interleaved, as
+    // in a batch operation expanded over every layer.
+    const int layers = static_cast<int>(state.layers.size());
+    std::vector<EditCommand> run;
+    for (int layer = 0; layer < layers; ++layer) {
+      run.clear();
+      for (size_t i = first; i < end; ++i) {
+        if (commands[i].layer == layer) {
+          run.push_back(commands[i]);
+        }
+      }
+
+      if (run.size() == 1) {
+        run.front().apply(state);
+      } else if (run.size() > 1) {
+        TiledImage &tiles = state.layers[layer].tiles();
+        tiles = tiles.transformed([&run](const QImage &tile) {
+          QImage result = tile;
+          for (const EditCommand &step : run) {
+            result = applyPointwise(step, result);
+          }
+          return result;
+        });
+      }
+    }
+    first = end;
+  }
+}
+
+bool EditCommand::isPointwise() const {
+  return type == Type::Adjust ||
+         (type == Type::Filter && filterType != Filter::Blur &&
+          filterType != Filter::Sharpen);
+}
+
+QJsonObject EditCommand::toJson() const {
+  QJsonObject object;
+  object["type"] = TypeNames[static_cast<int>(type)];
+
+  switch (type) {
+  case Type::Resize:
+    object["width"] = size.width();
+    object["height"] = size.height();
+    object["smooth"] = transformMode == Qt::SmoothTransformation;
+    break;
+  case Type::Crop:
+    object["rect"] =
+        QJsonArray{rect.x(), rect.y(), rect.width(), rect.height()};
+    break;
+  case Type::Rotate:
+    object["layer"] = layer;
+    object["degrees"] = degrees;
+    object["background"] = background.name(QColor::HexArgb);
+    break;
+  case Type::Flip:
+    object["layer"] = layer;
+    object["vertical"] = orientation == Qt::Vertical;
+    break;
+  case Type::Filter:
+    object["layer"] = layer;
+    object["filter"] = FilterNames[static_cast<int>(filterType)];
+    break;
+  case Type::Adjust:
+    object["layer"] = layer;
+    object["brightness"] = brightness;
+    object["contrast"] = contrast;
+    object["saturation"] = saturation;
+    object["hue"] = hue;
+    break;
+  }
+  return object;
+}
+
+std::optional<EditCommand> EditCommand::fromJson(const QJsonObject &object) {
+  std::optional<Type> type =
+      enumFromName<Type>(TypeNames, object["type"].toString());
+  if (!type) {
+    return std::nullopt;
+  }
+
+  const int layer = object["layer"].toInt(-1);
+  switch (*type) {
+  case Type::Resize:
+    return resize(QSize(object["width"].toInt(), object["height"].toInt()),
+                  object["smooth"].toBool(true) ? Qt::SmoothTransformation
+                                                : Qt::FastTransformation);
+  case Type::Crop: {
+    QJsonArray rect = object["rect"].toArray();
+    return crop(QRect(rect.at(0).toInt(), rect.at(1).toInt(),
+                      rect.at(2).toInt(), rect.at(3).toInt()));
+  }
+  case Type::Rotate:
+    return rotate(layer, object["degrees"].toDouble(),
+                  QColor(object["background"].toString("#00000000")));
+  case Type::Flip:
+    return flip(layer, object["vertical"].toBool() ? Qt::Vertical
+                                                   : Qt::Horizontal);
+  case Type::Filter: {
+    std::optional<Filter> filterType =
+        enumFromName<Filter>(FilterNames, object["filter"].toString());
+    if (!filterType) {
+      return std::nullopt;
+    }
+    return filter(layer, *filterType);
+  }
+  case Type::Adjust:
+    return adjust(layer, object["brightness"].toInt(),
+                  object["contrast"].toInt(), object["saturation"].toInt(),
+                  object["hue"].toInt());
+  }
+  return std::nullopt;
+}
@@ -0,0 +1,77 @@
+#ifndef EDITCOMMAND_H
+#define EDITCOMMAND_H
+
+#include "Layer.h"
+
+#include <QColor>
+#include <QJsonObject>
+#include <QRect>
+#include <QSize>
+#include <functional>
+#include <optional>
+#include <vector>
+
+struct DocumentState {
+  std::vector<Layer> layers;
+  int activeLayer = -1;
+  QSize canvasSize;
+};
+
+// Composites a document into one canvas-sized image a band of tile rows
+// at a time, reporting the share done. Safe to call off the GUI thread.
+QImage flattenDocument(const DocumentState &state,
+                       const std::function<void(int)> &progress = {});
+// Whether pixels of the document were lost on the way back from swap or
+// a file. Such a document must not be saved; check after flattening,
+// which is when unread tiles get read.
+bool hasDamagedTiles(const DocumentState &state);
+
+// A whole-image operation and its parameters. History stores these
+// instead of the tiles they produce, and rebuilds a state by replaying
+// them on top of an earlier one.
+struct EditCommand {
+  enum class Type { Resize, Crop, Rotate, Flip, Filter, Adjust };
+  enum class Filter { Grayscale, Sepia, Invert, Blur, Sharpen };
+
+  static EditCommand resize(const QSize &size, Qt::TransformationMode mode);
+  static EditCommand crop(const QRect &rect);
+  static EditCommand rotate(int layer, qreal degrees,
+                            const QColor &background = Qt::transparent);
+  static EditCommand flip(int layer, Qt::Orientation orientation);
+  static EditCommand filter(int layer, Filter filter);
+  static EditCommand adjust(int layer, int brightness, int contrast,
+                            int saturation, int hue);
+
+  // Runs the operation on a state. Safe to call off the GUI thread.
+  void apply(DocumentState &state) const;
+  // Runs commands in order. Consecutive point-wise commands share one
+  // pass over each layer's tiles, so each tile is read and written once
+  // while it is still in cache.
+  static void applyAll(const std::vector<EditCommand> &commands,
+                       DocumentState &state);
+
+  // Whether the command maps each pixel on its own, without neighbours.
+  bool isPointwise() const;
+
+  // Only the parameters the type uses are written. fromJson() returns
+  // nothing for an unknown type.
+  QJsonObject toJson() const;
+  static std::optional<EditCommand> fromJson(const QJsonObject &object);
+
+  Type type = Type::Filter;
+  // Target layer; resize and crop apply to every layer.
+  int layer = -1;
+  QSize size;
+  Qt::TransformationMode transformMode = Qt::SmoothTransformation;
+  QRect rect;
+  qreal degrees = 0.0;
+  QColor background = Qt::transparent;
+  Qt::Orientation orientation = Qt::Horizontal;
+  Filter filterType = Filter::Grayscale;
+  int brightness = 0;
+  int contrast = 0;
+  int saturation = 0;
+  int hue = 0;
+};
+
+#endif
@@ -1,50 +1,32 @@
 #include "EraserTool.h"
-#include <QPainter>
 
-EraserTool::EraserTool() : DrawingTool() {}
+EraserTool::EraserTool() : DrawingTool(), m_dabEngine(), m_dabs() {}
 
-void EraserTool::onPress(QImage &image, const QPoint &pos) {
+void EraserTool::onPress(TiledImage &image, const QPoint &pos) {
   m_lastPos = pos;
+  m_dabEngine.beginStroke();
   eraseDab(image, pos);
 }
 
-void EraserTool::onMove(QImage &image, const QPoint &pos) {
+void EraserTool::onMove(TiledImage &image, const QPoint &pos) {
   drawLine(image, m_lastPos, pos);
   m_lastPos = pos;
 }
 
-void EraserTool::onRelease(QImage &image, const QPoint &pos) {
+void EraserTool::onRelease(TiledImage &image, const QPoint &pos) {
   Q_UNUSED(image);
   Q_UNUSED(pos);
 }
 
-void EraserTool::drawLine(QImage &image, const QPoint &from, const QPoint &to) {
-  int dx = to.x() - from.x();
-  int dy = to.y() - from.y();
-  int steps = std::max(std::abs(dx), std::abs(dy));
-
-  if (steps == 0) {
-    eraseDab(image, to);
-    return;
-  }
-
-  for (int i = 0; i <= steps; ++i) {
-    qreal t = static_cast<qreal>(i) / steps;
-    int x = from.x() + t * dx;
-    int y = from.y() + t * dy;
-    eraseDab(image, QPoint(x, y));
+void EraserTool::drawLine(TiledImage &image, const QPoint &from,
+                          const QPoint &to) {
+  m_dabEngine.lineDabs(from, to, m_size * m_pressure, m_dabs);
+  for (const QPointF &pos : m_dabs) {
+    eraseDab(image, pos);
   }
 }
 
-void EraserTool::eraseDab(QImage &image, const QPoint &pos) {
-  if (image.isNull())
-    return;
-
-  QPainter painter(&image);
-  painter.setRenderHint(QPainter::Antialiasing);
-  painter.setCompositionMode(QPainter::CompositionMode_Clear);
-
-  painter.setBrush(Qt::transparent);
-  painter.setPen(Qt::NoPen);
-  painter.drawEllipse(pos, m_size / 2, m_size / 2);
+void EraserTool::eraseDab(TiledImage &image, const QPointF &pos) {
+  markDirty(m_dabEngine.eraseDab(image, pos, m_size * m_pressure, m_hardness,
+                                 m_opacity));
 }
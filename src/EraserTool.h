@@ -1,6 +1,7 @@
 #ifndef ERASERTOOL_H
 #define ERASERTOOL_H
 
+#include "DabEngine.h"
 #include "DrawingTool.h"
 
 class EraserTool : public DrawingTool {
@@ -8,13 +9,16 @@ public:
   EraserTool();
   ~EraserTool() override = default;
 
-  void onPress(QImage &image, const QPoint &pos) override;
-  void onMove(QImage &image, const QPoint &pos) override;
-  void onRelease(QImage &image, const QPoint &pos) override;
+  void onPress(TiledImage &image, const QPoint &pos) override;
+  void onMove(TiledImage &image, const QPoint &pos) override;
+  void onRelease(TiledImage &image, const QPoint &pos) override;
 
 private:
-  void drawLine(QImage &image, const QPoint &from, const QPoint &to);
-  void eraseDab(QImage &image, const QPoint &pos);
+  void drawLine(TiledImage &image, const QPoint &from, const QPoint &to);
+  void eraseDab(TiledImage &image, const QPointF &pos);
+
+  DabEngine m_dabEngine;
+  std::vector<QPointF> m_dabs;
 };
 
 #endif
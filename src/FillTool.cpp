@@ -0,0 +1,275 @@
+#include "FillTool.h"
+#include "DabEngine.h"
+
+#include <QtConcurrent>
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+constexpr int EdgeRamp = 32;
+
+// Distances are clamped below this value, which marks pixels already filled.
+constexpr quint8 Filled = 255;
+
+// Largest per-channel difference between each pixel and the seed colour.
+void distanceRun(const QRgb *pixels, quint8 *distance, int count, QRgb seed) {
+  int x = 0;
+
+#if defined(__SSE2__)
+  const __m128i seed8 = _mm_set1_epi32(static_cast<int>(seed));
+  const __m128i lowByte = _mm_set1_epi32(0xff);
+  const __m128i ceiling = _mm_set1_epi8(static_cast<char>(Filled - 1));
+
+  auto blockDistance = [&](const QRgb *p) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    __m128i d = _mm_or_si128(_mm_subs_epu8(v, seed8), _mm_subs_epu8(seed8, v));
+    d = _mm_max_epu8(d, _mm_srli_epi32(d, 8));
+    d = _mm_max_epu8(d, _mm_srli_epi32(d, 16));
+    return _mm_and_si128(d, lowByte);
+  };
+
+  for (; x + 16 <= count; x += 16) {
+    __m128i a = _mm_packs_epi32(blockDistance(pixels + x),
+                                blockDistance(pixels + x + 4));
+    __m128i b = _mm_packs_epi32(blockDistance(pixels + x + 8),
+                                blockDistance(pixels + x + 12));
+    __m128i packed = _mm_min_epu8(_mm_packus_epi16(a, b), ceiling);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(distance + x), packed);
+  }
+#endif
+
+  for (; x < count; ++x) {
+    QRgb p = pixels[x];
+    int d = std::max({std::abs(qAlpha(p) - qAlpha(seed)),
+                      std::abs(qRed(p) - qRed(seed)),
+                      std::abs(qGreen(p) - qGreen(seed)),
+                      std::abs(qBlue(p) - qBlue(seed))});
+    distance[x] = static_cast<quint8>(std::min<int>(d, Filled - 1));
+  }
+}
+
+std::vector<int> tileRows(const TiledImage &image) {
+  std::vector<int> rows(image.rows());
+  std::iota(rows.begin(), rows.end(), 0);
+  return rows;
+}
+
+} // namespace
+
+FillTool::FillTool()
+    : DrawingTool(), m_tolerance(32), m_contiguous(true), m_antialiased(true),
+      m_distance() {}
+
+void FillTool::onPress(TiledImage &image, const QPoint &pos) {
+  m_lastPos = pos;
+  if (image.isNull() || !image.rect().contains(pos)) {
+    return;
+  }
+
+  const int width = image.width();
+  const int height = image.height();
+  const int column = pos.x() / TiledImage::TileSize;
+  const int row = pos.y() / TiledImage::TileSize;
+
+  QRgb seed = 0;
+  if (image.hasTile(column, row)) {
+    QRect tileArea = image.tileRect(column, row);
+    seed = reinterpret_cast<const QRgb *>(image.tile(column, row).constScanLine(
+        pos.y() - tileArea.top()))[pos.x() - tileArea.left()];
+  }
+
+  m_distance.resize(static_cast<size_t>(width) * height);
+  computeDistances(image, seed);
+
+  if (m_contiguous) {
+    floodFill(pos, width, height);
+  } else {
+    selectGlobal();
+  }
+
+  markDirty(composite(image));
+
+  m_distance.clear();
+  m_distance.shrink_to_fit();
+}
+
+void FillTool::onMove(TiledImage &image, const QPoint &pos) {
+  Q_UNUSED(image);
+  Q_UNUSED(pos);
+}
+
+void FillTool::onRelease(TiledImage &image, const QPoint &pos) {
+  Q_UNUSED(image);
+  Q_UNUSED(pos);
+}
+
+void FillTool::setTolerance(int tolerance) {
+  m_tolerance = std::clamp(tolerance, 0, Filled - 1);
+}
+
+int FillTool::tolerance() const { return m_tolerance; }
+
+void FillTool::setContiguous(bool contiguous) { m_contiguous = contiguous; }
+
+bool FillTool::isContiguous() const { return m_contiguous; }
+
+void FillTool::setAntialiased(bool antialiased) { m_antialiased = antialiased; }
+
+bool FillTool::isAntialiased() const { return m_antialiased; }
+
+void FillTool::computeDistances(const TiledImage &image, QRgb seed) {
+  const int width = image.width();
+
+  // Absent tiles are fully transparent, so their distance is a constant.
+  const quint8 emptyDistance = static_cast<quint8>(std::min<int>(
+      std::max({qAlpha(seed), qRed(seed), qGreen(seed), qBlue(seed)}),
+      Filled - 1));
+
+  QtConcurrent::blockingMap(tileRows(image), [&](int row) {
+    for (int column = 0; column < image.columns(); ++column) {
+      QRect area = image.tileRect(column, row);
+      const QImage &tile = image.tile(column, row);
+
+      for (int y = area.top(); y <= area.bottom(); ++y) {
+        quint8 *distance =
+            m_distance.data() + static_cast<size_t>(y) * width + area.left();
+        if (tile.isNull()) {
+          std::memset(distance, emptyDistance, area.width());
+        } else {
+          distanceRun(reinterpret_cast<const QRgb *>(
+                          tile.constScanLine(y - area.top())),
+                      distance, area.width(), seed);
+        }
+      }
+    }
+  });
+}
+
+void FillTool::floodFill(const QPoint &seed, int width, int height) {
+  const quint8 tolerance = static_cast<quint8>(m_tolerance);
+  quint8 *distance = m_distance.data();
+
+  std::vector<QPoint> stack;
+  stack.push_back(seed);
+
+  while (!stack.empty()) {
+    QPoint p = stack.back();
+    stack.pop_back();
+
+    quint8 *row = distance + static_cast<size_t>(p.y()) * width;
+    if (row[p.x()] > tolerance) {
+      continue;
+    }
+
+    int left = p.x();
+    while (left > 0 && row[left - 1] <= tolerance) {
+      --left;
+    }
+    int right = p.x();
+    while (right < width - 1 && row[right + 1] <= tolerance) {
+      ++right;
+    }
+    std::memset(row + left, Filled, right - left + 1);
+
+    // Queue one seed per matching run in the rows above and below.
+    for (int ny : {p.y() - 1, p.y() + 1}) {
+      if (ny < 0 || ny >= height) {
+        continue;
+      }
+      const quint8 *next = distance + static_cast<size_t>(ny) * width;
+      int x = left;
+      while (x <= right) {
+        if (next[x] > tolerance) {
+          ++x;
+          continue;
+        }
+        stack.emplace_back(x, ny);
+        while (x <= right && next[x] <= tolerance) {
+          ++x;
+        }
+      }
+    }
+  }
+}
+
+void FillTool::selectGlobal() {
+  const quint8 tolerance = static_cast<quint8>(m_tolerance);
+  for (quint8 &d : m_distance) {
+    d = d <= tolerance ? Filled : d;
+  }
+}
+
+QRect FillTool::composite(TiledImage &image) const {
+  const int width = image.width();
+  const int height = image.height();
+  const quint8 tolerance = static_cast<quint8>(m_tolerance);
+  const quint8 *distance = m_distance.data();
+  QRgb src = qPremultiply(m_color.rgba());
+  quint32 alpha = static_cast<quint32>(qRound(m_opacity * 255));
+
+  std::vector<int> tiles(static_cast<size_t>(image.columns()) * image.rows());
+  std::iota(tiles.begin(), tiles.end(), 0);
+  std::vector<QRect> tileDirty(tiles.size());
+
+  // Every task owns a distinct tile, so tiles can be allocated in parallel.
+  QtConcurrent::blockingMap(tiles, [&](int index) {
+    const int column = index % image.columns();
+    const int row = index / image.columns();
+    QRect area = image.tileRect(column, row);
+    std::vector<quint8> coverage(area.width());
+    QRect &dirty = tileDirty[index];
+
+    for (int y = area.top(); y <= area.bottom(); ++y) {
+      const quint8 *line = distance + static_cast<size_t>(y) * width;
+      const quint8 *above = y > 0 ? line - width : nullptr;
+      const quint8 *below = y < height - 1 ? line + width : nullptr;
+
+      int first = area.width();
+      int last = -1;
+      for (int i = 0; i < area.width(); ++i) {
+        const int x = area.left() + i;
+        quint8 c = 0;
+        if (line[x] == Filled) {
+          c = 255;
+        } else if (m_antialiased && line[x] - tolerance <= EdgeRamp &&
+                   ((x > 0 && line[x - 1] == Filled) ||
+                    (x < width - 1 && line[x + 1] == Filled) ||
+                    (above && above[x] == Filled) ||
+                    (below && below[x] == Filled))) {
+          // Edge pixels just outside the tolerance get partial coverage,
+          // fading out as their colour drifts further from the seed.
+          c = static_cast<quint8>(128 *
+                                  (EdgeRamp + 1 - (line[x] - tolerance)) /
+                                  (EdgeRamp + 1));
+        }
+        coverage[i] = c;
+        if (c) {
+          first = std::min(first, i);
+          last = i;
+        }
+      }
+
+      if (last < first) {
+        continue;
+      }
+      QImage &tile = image.tileForWriting(column, row);
+      QRgb *pixels =
+          reinterpret_cast<QRgb *>(tile.scanLine(y - area.top()));
+      DabEngine::paintSpan(pixels + first, coverage.data() + first,
+                           last - first + 1, src, alpha);
+      dirty |= QRect(area.left() + first, y, last - first + 1, 1);
+    }
+  });
+
+  QRect dirty;
+  for (const QRect &rect : tileDirty) {
+    dirty |= rect;
+  }
+  return dirty;
+}
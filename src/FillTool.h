@@ -0,0 +1,36 @@
+#ifndef FILLTOOL_H
+#define FILLTOOL_H
+
+#include "DrawingTool.h"
+
+class FillTool : public DrawingTool {
+public:
+  FillTool();
+  ~FillTool() override = default;
+
+  void onPress(TiledImage &image, const QPoint &pos) override;
+  void onMove(TiledImage &image, const QPoint &pos) override;
+  void onRelease(TiledImage &image, const QPoint &pos) override;
+
+  void setTolerance(int tolerance);
+  int tolerance() const;
+
+  void setContiguous(bool contiguous);
+  bool isContiguous() const;
+
+  void setAntialiased(bool antialiased);
+  bool isAntialiased() const;
+
+private:
+  void computeDistances(const TiledImage &image, QRgb seed);
+  void floodFill(const QPoint &seed, int width, int height);
+  void selectGlobal();
+  QRect composite(TiledImage &image) const;
+
+  int m_tolerance;
+  bool m_contiguous;
+  bool m_antialiased;
+  std::vector<quint8> m_distance;
+};
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef GRADIENTTOOL_H
+#define GRADIENTTOOL_H
+
+#include "DrawingTool.h"
+
+#include <array>
+
+class GradientTool : public DrawingTool {
+public:
+  enum class Shape { Linear, Radial, Angular };
+
+  GradientTool();
+  ~GradientTool() override = default;
+
+  void onPress(TiledImage &image, const QPoint &pos) override;
+  void onMove(TiledImage &image, const QPoint &pos) override;
+  void onRelease(TiledImage &image, const QPoint &pos) override;
+  void onSamples(TiledImage &image,
+                 const std::vector<StrokeSample> &samples) override;
+
+  void setShape(Shape shape);
+  Shape shape() const;
+
+  void setEndColor(const QColor &color);
+  QColor endColor() const;
+
+  void setDithered(bool dithered);
+  bool isDithered() const;
+
+  // Confines the renders made while dragging to area, in layer
+  // coordinates, evaluating one pixel in step across and down; a null area
+  // previews the whole layer. The release always renders the whole layer
+  // at full resolution.
+  void setPreview(const QRect &area, int step);
+
+private:
+  static constexpr int LutSize = 1024;
+
+  void buildLut();
+  void render(TiledImage &image, const QRect &region, int step);
+  void evaluateRow(int y, int left, int count, int stride,
+                   quint16 *index) const;
+  void shadeRow(int y, int left, int width, const quint16 *index,
+                QRgb *colors) const;
+
+  Shape m_shape;
+  QColor m_endColor;
+  bool m_dithered;
+  QPoint m_start;
+  QPoint m_end;
+  QRect m_previewArea;
+  int m_previewStep;
+  TiledImage m_original;
+  std::array<std::array<quint16, 4>, LutSize + 1> m_lut;
+};
+
+#endif
@@ -0,0 +1,261 @@
+#include "HotFolder.h"
+
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QFileSystemWatcher>
+#include <QImageReader>
+#include <QSaveFile>
+#include <QTextStream>
+#include <QTimer>
+#include <vector>
+
+namespace {
+
+constexpr int SettleIntervalMsecs = 1000;
+constexpr int RetryIntervalMsecs = 200;
+constexpr int StatusIntervalMsecs = 60000;
+const char *const StateFileName = ".picture-hotfolder";
+
+// State file records, one per line: a tag and a file key.
+constexpr char Queued = 'Q';
+constexpr char Done = 'D';
+constexpr char Failed = 'F';
+
+bool isSupported(const QFileInfo &info) {
+  static const QSet<QString> suffixes = []() {
+    QSet<QString> result{QStringLiteral("picture"), QStringLiteral("pam"),
+                         QStringLiteral("ppm"), QStringLiteral("pgm"),
+                         QStringLiteral("pnm"), QStringLiteral("rgba")};
+    for (const QByteArray &format : QImageReader::supportedImageFormats()) {
+      result.insert(QString::fromLatin1(format).toLower());
+    }
+    return result;
+  }();
+  return !info.fileName().startsWith('.') &&
+         suffixes.contains(info.suffix().toLower());
+}
+
+} // namespace
+
+HotFolder::HotFolder(const QString &inputDir, const QString &logPath,
+                     const BatchProcessor::Options &options,
+                     QObject *parent)
+    : QObject(parent), m_inputDir(QDir(inputDir).absolutePath()),
+      m_statePath(QDir(options.outputDir).filePath(StateFileName)),
+      m_stateFile(), m_logFile(logPath),
+      m_processor(std::make_unique<BatchProcessor>(options)),
+      m_watcher(new QFileSystemWatcher(this)),
+      m_settleTimer(new QTimer(this)), m_retryTimer(new QTimer(this)),
+      m_statusTimer(new QTimer(this)), m_settling(), m_queue(), m_queued(),
+      m_done(), m_finished(0), m_failed(0), m_intervalFiles(0),
+      m_intervalPixels(0), m_interval() {
+  m_settleTimer->setSingleShot(true);
+  m_settleTimer->setInterval(SettleIntervalMsecs);
+  m_retryTimer->setSingleShot(true);
+  m_retryTimer->setInterval(RetryIntervalMsecs);
+  m_statusTimer->setInterval(StatusIntervalMsecs);
+
+  connect(m_watcher, &QFileSystemWatcher::directoryChanged, this,
+          &HotFolder::scan);
+  connect(m_settleTimer, &QTimer::timeout, this, &HotFolder::scan);
+  connect(m_retryTimer, &QTimer::timeout, this, &HotFolder::submitQueued);
+  connect(m_statusTimer, &QTimer::timeout, this, &HotFolder::logStatus);
+}
+
+HotFolder::~HotFolder() {
+  // Results still arriving post back to this object, so the pipeline has
+  // to drain before the members go.
+  m_processor.reset();
+}
+
+bool HotFolder::start() {
+  if (!QFileInfo(m_inputDir).isDir() ||
+      !m_logFile.open(QIODevice::WriteOnly | QIODevice::Append |
+                      QIODevice::Text) ||
+      !readState() || !m_watcher->addPath(m_inputDir)) {
+    return false;
+  }
+
+  log(QStringLiteral("Watching %1, %2 files queued from the last run")
+          .arg(m_inputDir, QString::number(m_queue.size())));
+  m_interval.start();
+  m_statusTimer->start();
+  // Files dropped while the watcher was not running.
+  scan();
+  return true;
+}
+
+void HotFolder::scan() {
+  const QFileInfoList entries = QDir(m_inputDir).entryInfoList(
+      QDir::Files | QDir::Readable, QDir::Time | QDir::Reversed);
+
+  const qint64 now = QDateTime::currentMSecsSinceEpoch();
+  std::unordered_map<QString, Snapshot> settling;
+  for (const QFileInfo &info : entries) {
+    if (!isSupported(info)) {
+      continue;
+    }
+
+    Snapshot snapshot{info.size(), info.lastModified().toMSecsSinceEpoch(),
+                      now};
+    const QString key = keyFor(info.fileName(), snapshot);
+    if (m_done.contains(key) || m_queued.contains(key)) {
+      continue;
+    }
+
+    // A file is still being written until its size and time have held
+    // for a settle interval.
+    auto previous = m_settling.find(info.fileName());
+    if (previous != m_settling.end() &&
+        previous->second.size == snapshot.size &&
+        previous->second.modified == snapshot.modified) {
+      snapshot.seen = previous->second.seen;
+    }
+    if (now - snapshot.seen >= SettleIntervalMsecs) {
+      appendState(Queued, key);
+      m_queued.insert(key);
+      m_queue.push_back(key);
+    } else {
+      settling[info.fileName()] = snapshot;
+    }
+  }
+
+  m_settling = std::move(settling);
+  if (!m_settling.empty()) {
+    m_settleTimer->start();
+  }
+  submitQueued();
+}
+
+void HotFolder::submitQueued() {
+  while (!m_queue.empty()) {
+    const QString key = m_queue.front();
+    const QString path =
+        QDir(m_inputDir).filePath(key.section('\t', 0, 0));
+    bool submitted = m_processor->trySubmit(
+        path, [this, key](const BatchProcessor::Result &result) {
+          QMetaObject::invokeMethod(
+              this, [this, key, result]() { finishFile(key, result); },
+              Qt::QueuedConnection);
+        });
+    if (!submitted) {
+      // The pipeline is full. Slots free up on worker threads, so poll
+      // rather than rely on the next result arriving after its slot.
+      m_retryTimer->start();
+      return;
+    }
+    m_queue.pop_front();
+  }
+}
+
+void HotFolder::finishFile(const QString &key,
+                           const BatchProcessor::Result &result) {
+  m_queued.remove(key);
+  m_done.insert(key);
+  if (result.error.isEmpty()) {
+    appendState(Done, key);
+    ++m_finished;
+    ++m_intervalFiles;
+    m_intervalPixels += result.pixels;
+    log(BatchProcessor::describe(result));
+  } else {
+    // Failed files are not retried until they are replaced.
+    appendState(Failed, key);
+    ++m_failed;
+    log(QStringLiteral("%1: %2").arg(result.source, result.error));
+  }
+  submitQueued();
+}
+
+void HotFolder::logStatus() {
+  const qreal seconds = std::max<qint64>(m_interval.restart(), 1) / 1000.0;
+  log(QStringLiteral("%1 queued, %2 in flight, %3 done, %4 failed; "
+                     "%5 files/min, %6 MP/s")
+          .arg(m_queue.size())
+          .arg(m_processor->filesInFlight())
+          .arg(m_finished)
+          .arg(m_failed)
+          .arg(m_intervalFiles * 60 / seconds, 0, 'f', 1)
+          .arg(m_intervalPixels / 1e6 / seconds, 0, 'f', 1));
+  m_intervalFiles = 0;
+  m_intervalPixels = 0;
+}
+
+bool HotFolder::readState() {
+  QFile file(m_statePath);
+  std::vector<QString> queued;
+  if (file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+    QTextStream in(&file);
+    QString line;
+    while (in.readLineInto(&line)) {
+      if (line.size() < 3 || line[1] != '\t') {
+        continue;
+      }
+      const QString key = line.mid(2);
+      if (line[0] == Queued) {
+        if (!m_queued.contains(key)) {
+          m_queued.insert(key);
+          queued.push_back(key);
+        }
+      } else if (line[0] == Done || line[0] == Failed) {
+        m_queued.remove(key);
+        m_done.insert(key);
+      }
+    }
+    file.close();
+  }
+
+  // The log is compacted on every start. Finished files, written or
+  // failed, only matter while they are still in the folder unchanged.
+  QSaveFile compacted(m_statePath);
+  if (!compacted.open(QIODevice::WriteOnly | QIODevice::Text)) {
+    return false;
+  }
+  QTextStream out(&compacted);
+  for (const QString &key : QSet<QString>(m_done)) {
+    const QFileInfo info(QDir(m_inputDir).filePath(key.section('\t', 0, 0)));
+    const Snapshot snapshot{info.size(),
+                            info.lastModified().toMSecsSinceEpoch()};
+    if (info.exists() && keyFor(info.fileName(), snapshot) == key) {
+      out << Done << '\t' << key << '\n';
+    } else {
+      m_done.remove(key);
+    }
+  }
+  for (const QString &key : queued) {
+    if (m_queued.contains(key)) {
+      out << Queued << '\t' << key << '\n';
+      m_queue.push_back(key);
+    }
+  }
+  out.flush();
+  if (!compacted.commit()) {
+    return false;
+  }
+
+  m_stateFile.setFileName(m_statePath);
+  return m_stateFile.open(QIODevice::WriteOnly | QIODevice::Append |
+                          QIODevice::Text);
+}
+
+void HotFolder::appendState(char record, const QString &key) {
+  m_stateFile.write(
+      QStringLiteral("%1\t%2\n").arg(QChar(record), key).toUtf8());
+  m_stateFile.flush();
+}
+
+void HotFolder::log(const QString &message) {
+  m_logFile.write(
+      QStringLiteral("%1  %2\n")
+          .arg(QDateTime::currentDateTime().toString(Qt::ISODate), message)
+          .toUtf8());
+  m_logFile.flush();
+}
+
+QString HotFolder::keyFor(const QString &name, const Snapshot &snapshot) {
+  // One arg() call, so a %N in the file name is never expanded.
+  return QStringLiteral("%1\t%2\t%3")
+      .arg(name, QString::number(snapshot.size),
+           QString::number(snapshot.modified));
+}
@@ -0,0 +1,76 @@
+#ifndef HOTFOLDER_H
+#define HOTFOLDER_H
+
+#include "BatchProcessor.h"
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QObject>
+#include <QSet>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+
+class QFileSystemWatcher;
+class QTimer;
+
+// Long-running batch mode: watches a folder and sends each new image
+// through a BatchProcessor once it has stopped growing. Files wait in a
+// queue while the pipeline is full. The queue and the finished files are
+// kept in an append-only state file in the output folder, so a restart
+// resumes the queue and skips what is done. A file that is replaced
+// counts as new. Results and periodic throughput go to a log file.
+class HotFolder : public QObject {
+  Q_OBJECT
+
+public:
+  HotFolder(const QString &inputDir, const QString &logPath,
+            const BatchProcessor::Options &options,
+            QObject *parent = nullptr);
+  ~HotFolder() override;
+
+  bool start();
+
+private:
+  struct Snapshot {
+    qint64 size = -1;
+    qint64 modified = -1;
+    // When a scan first saw this size and time.
+    qint64 seen = 0;
+  };
+
+  void scan();
+  void submitQueued();
+  void finishFile(const QString &key, const BatchProcessor::Result &result);
+  void logStatus();
+
+  bool readState();
+  void appendState(char record, const QString &key);
+  void log(const QString &message);
+
+  static QString keyFor(const QString &name, const Snapshot &snapshot);
+
+  QString m_inputDir;
+  QString m_statePath;
+  QFile m_stateFile;
+  QFile m_logFile;
+  std::unique_ptr<BatchProcessor> m_processor;
+  QFileSystemWatcher *m_watcher;
+  QTimer *m_settleTimer;
+  QTimer *m_retryTimer;
+  QTimer *m_statusTimer;
+
+  // Files seen growing, by name, with their size and time at last scan.
+  std::unordered_map<QString, Snapshot> m_settling;
+  std::deque<QString> m_queue;
+  QSet<QString> m_queued;
+  QSet<QString> m_done;
+
+  int m_finished;
+  int m_failed;
+  qint64 m_intervalFiles;
+  qint64 m_intervalPixels;
+  QElapsedTimer m_interval;
+};
+
+#endif
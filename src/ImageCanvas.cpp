@@ -1,38 +1,136 @@
 #include "ImageCanvas.h"
 #include "BrushTool.h"
 #include "CropOverlay.h"
+#include "EditCommand.h"
 #include "EraserTool.h"
+#include "FillTool.h"
 #include "ImageProcessor.h"
+#include "Journal.h"
 #include "Layer.h"
+#include "MappedImage.h"
+#include "PngWriter.h"
+#include "ProjectFile.h"
+#include "TileCache.h"
+#include "UndoStack.h"
 
 #include <QFileInfo>
+#include <QImageIOHandler>
 #include <QImageReader>
 #include <QImageWriter>
 #include <QMouseEvent>
 #include <QPainter>
+#include <QPromise>
+#include <QTabletEvent>
+#include <QTimer>
 #include <QWheelEvent>
+#include <QtConcurrent>
 #include <algorithm>
+#include <functional>
+#include <utility>
+
+namespace {
+
+constexpr int AutosaveIntervalMsecs = 30000;
+
+} // namespace
 
 const qreal ImageCanvas::MinZoom;
 const qreal ImageCanvas::MaxZoom;
 const qreal ImageCanvas::ZoomStep;
 
 ImageCanvas::ImageCanvas(QWidget *parent)
-    : QWidget(parent), m_layers(), m_activeLayerIndex(-1),
-      m_originalLayerImage(), m_displayPixmap(), m_zoomLevel(1.0),
-      m_panOffset(0, 0), m_lastMousePos(), m_isPanning(false),
+    : QWidget(parent), m_layers(), m_activeLayerIndex(-1), m_canvasSize(),
+      m_originalLayerImage(), m_displayPixmap(), m_displayRect(),
+      m_displayImageRect(), m_zoomLevel(1.0), m_panOffset(0, 0),
+      m_lastMousePos(), m_isPanning(false),
       m_isAdjusting(false), m_cropOverlay(nullptr), m_toolMode(ToolMode::None),
-      m_activeTool(nullptr), m_isDrawing(false) {
+      m_activeTool(nullptr), m_isDrawing(false), m_isTabletStroke(false),
+      m_pendingSamples(), m_lastStrokePos(), m_strokeDirtyRect(),
+      m_strokeFlushTimer(new QTimer(this)), m_stabilizer(),
+      m_stabilizedSamples(), m_layerSamples(), m_predictedSegment(),
+      m_fillTolerance(32), m_fillContiguous(true),
+      m_gradientShape(GradientTool::Shape::Linear),
+      m_toolBackgroundColor(Qt::white), m_adjustment(), m_undoStack(),
+      m_replayWatcher(new QFutureWatcher<DocumentState>(this)),
+      m_replayIndex(-1), m_isReplaying(false), m_historyStepText(),
+      m_journal(), m_autosaveTimer(new QTimer(this)), m_revision(0),
+      m_previewImage(), m_loadPath(),
+      m_loadWatcher(new QFutureWatcher<TiledImage>(this)),
+      m_saveWatcher(new QFutureWatcher<bool>(this)), m_isSaving(false),
+      m_savePath(), m_saveState(), m_saveRevision(0) {
   setMinimumSize(200, 200);
   setAutoFillBackground(true);
   setMouseTracking(true);
 
+  // Input events are queued and handed to the tool once the event queue
+  // has drained, so a slow dab pass never drops intermediate positions.
+  m_strokeFlushTimer->setSingleShot(true);
+  m_strokeFlushTimer->setInterval(0);
+  connect(m_strokeFlushTimer, &QTimer::timeout, this,
+          &ImageCanvas::flushStrokeSamples);
+
+  connect(m_replayWatcher, &QFutureWatcher<DocumentState>::finished, this,
+          &ImageCanvas::finishReplay);
+  connect(m_loadWatcher, &QFutureWatcher<TiledImage>::finished, this,
+          &ImageCanvas::finishLoad);
+  connect(m_saveWatcher, &QFutureWatcher<bool>::progressValueChanged, this,
+          &ImageCanvas::saveProgress);
+  connect(m_saveWatcher, &QFutureWatcher<bool>::finished, this,
+          &ImageCanvas::finishSave);
+
+  // The first edit after an autosave arms the timer and later ones leave
+  // it running, so steady editing cannot put the autosave off.
+  m_autosaveTimer->setSingleShot(true);
+  m_autosaveTimer->setInterval(AutosaveIntervalMsecs);
+  connect(this, &ImageCanvas::imageModified, m_autosaveTimer, [this]() {
+    if (!m_autosaveTimer->isActive()) {
+      m_autosaveTimer->start();
+    }
+  });
+  connect(m_autosaveTimer, &QTimer::timeout, this,
+          [this]() { m_journal.checkpoint(); });
+
   QPalette pal = palette();
   pal.setColor(QPalette::Window, QColor(45, 45, 45));
   setPalette(pal);
 }
 
 bool ImageCanvas::loadProject(const QString &path) {
+  if (ProjectFile::isProjectPath(path)) {
+    std::optional<DocumentState> state = ProjectFile::load(path);
+    if (!state) {
+      return false;
+    }
+
+    clearProject();
+    m_journal.start(path);
+    restoreDocumentState(*state);
+    recordHistory(tr("Open Project"));
+
+    emit imageLoaded(path);
+    emit zoomChanged(m_zoomLevel);
+    return true;
+  }
+
+  // Uncompressed files are mapped rather than decoded; tiles convert
+  // their part of the file as they are first drawn.
+  if (MappedImage::canOpen(path)) {
+    if (std::shared_ptr<MappedImage> mapped = MappedImage::open(path)) {
+      clearProject();
+      m_canvasSize = mapped->size();
+      m_journal.start(path);
+      appendLayer(std::make_shared<Layer>(mapped->tiles(), "Background"));
+
+      emit imageLoaded(path);
+      emit zoomChanged(m_zoomLevel);
+      return true;
+    }
+  }
+
+  if (loadInBackground(path)) {
+    return true;
+  }
+
   QImageReader reader(path);
   reader.setAutoTransform(true);
 
@@ -42,6 +140,7 @@ bool ImageCanvas::loadProject(const QString &path) {
   }
 
   clearProject();
+  m_journal.start(path);
   addLayer(image, "Background");
 
   emit imageLoaded(path);
@@ -49,48 +148,267 @@ bool ImageCanvas::loadProject(const QString &path) {
   return true;
 }
 
+bool ImageCanvas::loadInBackground(const QString &path) {
+  QImageReader reader(path);
+  reader.setAutoTransform(true);
+
+  // Images that fit the window decode quickly enough to load in place.
+  const QSize fileSize = reader.size();
+  const int edge = std::max(width(), height()) * devicePixelRatioF();
+  if (!fileSize.isValid() ||
+      std::max(fileSize.width(), fileSize.height()) <= 2 * edge) {
+    return false;
+  }
+
+  QSize canvasSize = fileSize;
+  if (reader.transformation() & QImageIOHandler::TransformationRotate90) {
+    canvasSize.transpose();
+  }
+
+  // Decoders that can downscale while decoding, as JPEG does through DCT
+  // scaling, give a real preview at once. Otherwise the preview stays
+  // empty until the decode finishes.
+  QImage preview;
+  if (reader.supportsOption(QImageIOHandler::ScaledSize)) {
+    reader.setScaledSize(fileSize.scaled(edge, edge, Qt::KeepAspectRatio));
+    preview = reader.read();
+  }
+  if (preview.isNull()) {
+    preview = QImage(canvasSize.scaled(edge, edge, Qt::KeepAspectRatio),
+                     QImage::Format_ARGB32_Premultiplied);
+    preview.fill(Qt::transparent);
+  }
+
+  clearProject();
+  m_canvasSize = canvasSize;
+  m_previewImage = preview;
+  m_loadPath = path;
+  // The preview is only sharp when the whole image fits the window.
+  fitToWindow();
+
+  // The image is decoded in a single pass: Qt's decoders cannot hand out
+  // rows as they go, and reading clipped bands makes sequential decoders
+  // such as JPEG decode every row above each band again.
+  m_loadWatcher->setFuture(QtConcurrent::run(
+      [path, canvasSize](QPromise<TiledImage> &promise) {
+        QImageReader reader(path);
+        reader.setAutoTransform(true);
+        QImage image = reader.read();
+        if (image.size() != canvasSize || promise.isCanceled()) {
+          return;
+        }
+        image.convertTo(QImage::Format_ARGB32_Premultiplied);
+
+        // Past the cache budget, tiles are compressed as soon as they are
+        // cut, so the decoded image is the only full copy held. They
+        // belong to no document yet, which makes evicting them here safe
+        // where a trim() would not be.
+        TileCache &cache = TileCache::instance();
+        TiledImage tiles(canvasSize);
+        for (int row = 0; row < tiles.rows(); ++row) {
+          if (promise.isCanceled()) {
+            return;
+          }
+          for (int column = 0; column < tiles.columns(); ++column) {
+            const QRect area = tiles.tileRect(column, row);
+            if (TiledImage::isTransparent(image, area)) {
+              continue;
+            }
+            tiles.setTile(column, row, image.copy(area));
+            if (cache.budget() > 0 && cache.residentBytes() > cache.budget()) {
+              cache.evict(
+                  tiles.tileStorage()[row * tiles.columns() + column].get(),
+                  false);
+            }
+          }
+        }
+        promise.addResult(tiles);
+      }));
+  return true;
+}
+
+void ImageCanvas::finishLoad() {
+  // A load replaced or closed before it finished has no path left.
+  if (m_loadPath.isEmpty()) {
+    return;
+  }
+
+  QString path = std::exchange(m_loadPath, QString());
+  m_previewImage = QImage();
+  TiledImage tiles;
+  if (m_loadWatcher->future().resultCount() > 0) {
+    tiles = m_loadWatcher->future().result();
+  }
+  // The stored result shares the tiles, which would make the first edit
+  // of each one copy it.
+  m_loadWatcher->setFuture(QFuture<TiledImage>());
+
+  if (tiles.isNull()) {
+    clearProject();
+    emit loadFailed(path);
+    return;
+  }
+
+  m_journal.start(path);
+  appendLayer(std::make_shared<Layer>(tiles, "Background"));
+
+  emit imageLoaded(path);
+}
+
 bool ImageCanvas::saveProject(const QString &path) {
   if (!hasImage()) {
     return false;
   }
+  // Saves to the same project file must not interleave.
+  waitForSave();
+
+  // The snapshot shares its tiles with the document, so edits made while
+  // the save runs copy the tiles they touch instead of changing these.
+  m_isSaving = true;
+  m_savePath = path;
+  m_saveState = documentState();
+  m_saveRevision = m_revision;
+
+  m_saveWatcher->setFuture(QtConcurrent::run(
+      [path, state = m_saveState](QPromise<bool> &promise) {
+        promise.setProgressRange(0, 100);
+        auto progress = [&promise](int percent) {
+          promise.setProgressValue(percent);
+        };
+
+        if (ProjectFile::isProjectPath(path)) {
+          promise.addResult(ProjectFile::save(path, state, progress));
+          return;
+        }
+
+        // Flattening covers the first half of the bar; of the encoders,
+        // only the PNG one reports progress.
+        QImage flattened = flattenDocument(
+            state, [&progress](int percent) { progress(percent / 2); });
+        if (hasDamagedTiles(state)) {
+          promise.addResult(false);
+          return;
+        }
+        QFileInfo info(path);
+        QString suffix = info.suffix().toLower();
+
+        if (suffix == "png") {
+          promise.addResult(PngWriter::write(
+              path, flattened, 9,
+              [&progress](int percent) { progress(50 + percent / 2); }));
+          return;
+        }
+
+        QImageWriter writer(path);
+        if (suffix == "jpg" || suffix == "jpeg") {
+          writer.setFormat("JPEG");
+          writer.setQuality(95);
+        } else if (suffix == "bmp") {
+          writer.setFormat("BMP");
+        }
+
+        bool saved = writer.write(flattened);
+        progress(100);
+        promise.addResult(saved);
+      }));
+  return true;
+}
 
-  QImage flattened = getFlattenedImage();
-  QImageWriter writer(path);
+bool ImageCanvas::isSaving() const { return m_isSaving; }
 
-  QFileInfo info(path);
-  QString suffix = info.suffix().toLower();
+bool ImageCanvas::isLoading() const { return !m_loadPath.isEmpty(); }
 
-  if (suffix == "jpg" || suffix == "jpeg") {
-    writer.setFormat("JPEG");
-    writer.setQuality(95);
-  } else if (suffix == "png") {
-    writer.setFormat("PNG");
-    writer.setCompression(9);
-  } else if (suffix == "bmp") {
-    writer.setFormat("BMP");
+void ImageCanvas::waitForSave() {
+  if (m_isSaving) {
+    m_saveWatcher->waitForFinished();
+    finishSave();
   }
+}
 
-  if (!writer.write(flattened)) {
-    return false;
+void ImageCanvas::finishSave() {
+  // Runs once per save: either from waitForSave() or from the watcher.
+  if (!m_isSaving) {
+    return;
   }
+  m_isSaving = false;
 
-  emit imageSaved(path);
-  return true;
+  DocumentState state = std::move(m_saveState);
+  m_saveState = DocumentState();
+  QFuture<bool> future = m_saveWatcher->future();
+  if (future.resultCount() == 0 || !future.result()) {
+    emit saveFailed(m_savePath);
+    return;
+  }
+
+  // The saved project is the new base for crash recovery, so the journal
+  // no longer needs the steps that led to it. A flattened save over the
+  // image the journal started from replaces that base, so the journal
+  // starts over with the saved state written in full. Either way, edits
+  // made while the save ran go on top of it.
+  const bool isProject = ProjectFile::isProjectPath(m_savePath);
+  if (isProject || m_journal.readsFrom(m_savePath)) {
+    m_journal.start(isProject ? m_savePath : QString());
+    m_journal.record(QString(), state);
+    if (m_revision != m_saveRevision) {
+      m_journal.record(undoText(), documentState());
+    }
+  }
+
+  emit imageSaved(m_savePath);
 }
 
 void ImageCanvas::clearProject() {
+  // A running save finishes against the document it snapshotted.
+  waitForSave();
   cancelCrop();
   m_layers.clear();
   m_activeLayerIndex = -1;
+  m_canvasSize = QSize();
+  if (!m_loadPath.isEmpty()) {
+    m_loadWatcher->cancel();
+    m_loadPath.clear();
+  }
+  m_previewImage = QImage();
+  cancelReplay();
+  m_undoStack.clear();
+  m_autosaveTimer->stop();
+  m_journal.discard();
   m_displayPixmap = QPixmap();
+  updateDisplayPixmap();
   m_zoomLevel = 1.0;
   m_panOffset = QPoint(0, 0);
   update();
   emit zoomChanged(m_zoomLevel);
+  emit historyChanged();
+}
+
+void ImageCanvas::moveToBackground() {
+  // The next paint composites the view again once the tab is shown.
+  m_displayPixmap = QPixmap();
+  m_displayRect = QRect();
+  for (const auto &layer : m_layers) {
+    for (const std::shared_ptr<Tile> &tile : layer->tiles().tileStorage()) {
+      if (tile) {
+        TileCache::instance().demote(tile.get());
+      }
+    }
+  }
+  TileCache::instance().trim();
 }
 
-void ImageCanvas::addLayer(const QImage &image, const QString &name) {
+void ImageCanvas::addLayer(const QImage &image, const QString &name,
+                           const QPoint &offset) {
+  // The first layer defines the canvas; later ones keep their own extent.
+  if (m_layers.empty()) {
+    m_canvasSize = image.size();
+  }
+
   auto layer = std::make_shared<Layer>(image, name);
+  layer->setOffset(offset);
+  appendLayer(layer);
+}
+
+void ImageCanvas::appendLayer(std::shared_ptr<Layer> layer) {
   m_layers.push_back(layer);
 
   int newIndex = static_cast<int>(m_layers.size()) - 1;
@@ -99,11 +417,25 @@ void ImageCanvas::addLayer(const QImage &image, const QString &name) {
   updateDisplayPixmap();
   update();
 
-  emit layerAdded(name, true);
+  emit layerAdded(layer->name(), true);
   emit activeLayerChanged(newIndex);
+  recordHistory(tr("Add Layer"));
   emit imageModified();
 }
 
+void ImageCanvas::pasteAsNewLayer(const QImage &image) {
+  if (image.isNull()) {
+    return;
+  }
+
+  QPoint offset;
+  if (hasImage()) {
+    QSize margin = (m_canvasSize - image.size()) / 2;
+    offset = QPoint(margin.width(), margin.height());
+  }
+  addLayer(image, tr("Pasted Layer"), offset);
+}
+
 void ImageCanvas::removeLayer(int index) {
   if (index < 0 || index >= static_cast<int>(m_layers.size()))
     return;
@@ -121,6 +453,7 @@ void ImageCanvas::removeLayer(int index) {
 
   emit layerRemoved(index);
   emit activeLayerChanged(m_activeLayerIndex);
+  recordHistory(tr("Remove Layer"));
   emit imageModified();
 }
 
@@ -141,6 +474,7 @@ void ImageCanvas::moveLayerUp(int index) {
 
   emit layerMoved(index, index + 1);
   emit activeLayerChanged(m_activeLayerIndex);
+  recordHistory(tr("Move Layer"));
   emit imageModified();
 }
 
@@ -161,6 +495,7 @@ void ImageCanvas::moveLayerDown(int index) {
 
   emit layerMoved(index, index - 1);
   emit activeLayerChanged(m_activeLayerIndex);
+  recordHistory(tr("Move Layer"));
   emit imageModified();
 }
 
@@ -169,11 +504,13 @@ void ImageCanvas::duplicateLayer(int index) {
     return;
 
   auto source = m_layers[index];
+  // The copy shares every tile with its source until one side edits it.
   auto copy =
-      std::make_shared<Layer>(source->image(), source->name() + " Copy");
+      std::make_shared<Layer>(source->tiles(), source->name() + " Copy");
   copy->setOpacity(source->opacity());
   copy->setVisible(source->isVisible());
   copy->setBlendMode(source->blendMode());
+  copy->setOffset(source->offset());
 
   m_layers.insert(m_layers.begin() + index + 1, copy);
 
@@ -184,6 +521,7 @@ void ImageCanvas::duplicateLayer(int index) {
   setActiveLayer(index + 1);
 
   emit activeLayerChanged(m_activeLayerIndex);
+  recordHistory(tr("Duplicate Layer"));
   emit imageModified();
 }
 
@@ -202,6 +540,7 @@ void ImageCanvas::setLayerVisibility(int index, bool visible) {
     m_layers[index]->setVisible(visible);
     updateDisplayPixmap();
     update();
+    recordHistory(tr("Layer Visibility"));
     emit imageModified();
   }
 }
@@ -211,6 +550,7 @@ void ImageCanvas::setLayerOpacity(int index, qreal opacity) {
     m_layers[index]->setOpacity(opacity);
     updateDisplayPixmap();
     update();
+    recordHistory(tr("Layer Opacity"), true);
     emit imageModified();
   }
 }
@@ -220,6 +560,7 @@ void ImageCanvas::setLayerBlendMode(int index, int mode) {
     m_layers[index]->setBlendMode(static_cast<QPainter::CompositionMode>(mode));
     updateDisplayPixmap();
     update();
+    recordHistory(tr("Blend Mode"));
     emit imageModified();
   }
 }
@@ -237,22 +578,7 @@ const std::vector<std::shared_ptr<Layer>> &ImageCanvas::layers() const {
 }
 
 QImage ImageCanvas::getFlattenedImage() const {
-  if (m_layers.empty())
-    return QImage();
-
-  QSize size = m_layers[0]->image().size();
-
-  QImage result(size, QImage::Format_ARGB32_Premultiplied);
-  result.fill(Qt::transparent);
-
-  QPainter painter(&result);
-  QRect rect(QPoint(0, 0), size);
-
-  for (const auto &layer : m_layers) {
-    layer->render(painter, rect);
-  }
-
-  return result;
+  return flattenDocument(documentState());
 }
 
 bool ImageCanvas::hasImage() const { return !m_layers.empty(); }
@@ -260,7 +586,7 @@ bool ImageCanvas::hasImage() const { return !m_layers.empty(); }
 QSize ImageCanvas::imageSize() const {
   if (m_layers.empty())
     return QSize(0, 0);
-  return m_layers[0]->image().size();
+  return m_canvasSize;
 }
 
 void ImageCanvas::setZoomLevel(qreal level) {
@@ -284,11 +610,11 @@ void ImageCanvas::zoomIn() { setZoomLevel(m_zoomLevel * ZoomStep); }
 void ImageCanvas::zoomOut() { setZoomLevel(m_zoomLevel / ZoomStep); }
 
 void ImageCanvas::fitToWindow() {
-  if (!hasImage()) {
+  if (!hasImage() && m_previewImage.isNull()) {
     return;
   }
 
-  QSize size = imageSize();
+  QSize size = m_canvasSize;
   qreal scaleX = static_cast<qreal>(width()) / size.width();
   qreal scaleY = static_cast<qreal>(height()) / size.height();
   qreal scale = std::min(scaleX, scaleY) * 0.95;
@@ -313,18 +639,10 @@ void ImageCanvas::resizeImage(const QSize &newSize,
     return;
   }
 
-  for (auto &layer : m_layers) {
-    layer->setImage(
-        layer->image().scaled(newSize, Qt::IgnoreAspectRatio, mode));
-  }
-
   m_zoomLevel = 1.0;
   m_panOffset = QPoint(0, 0);
 
-  updateDisplayPixmap();
-  update();
-
-  emit imageModified();
+  runCommand(tr("Resize Image"), EditCommand::resize(newSize, mode));
   emit zoomChanged(m_zoomLevel);
 }
 
@@ -361,19 +679,13 @@ void ImageCanvas::applyCrop() {
   srcW = std::clamp(srcW, 1, size.width() - srcX);
   srcH = std::clamp(srcH, 1, size.height() - srcY);
 
-  for (auto &layer : m_layers) {
-    layer->setImage(layer->image().copy(srcX, srcY, srcW, srcH));
-  }
-
   m_panOffset = QPoint(0, 0);
 
   delete m_cropOverlay;
   m_cropOverlay = nullptr;
 
-  updateDisplayPixmap();
-  update();
-
-  emit imageModified();
+  runCommand(tr("Crop"),
+             EditCommand::crop(QRect(srcX, srcY, srcW, srcH)));
   emit cropModeChanged(false);
 }
 
@@ -388,96 +700,48 @@ void ImageCanvas::cancelCrop() {
 bool ImageCanvas::isCropping() const { return m_cropOverlay != nullptr; }
 
 void ImageCanvas::rotate90CW() {
-  auto layer = activeLayer();
-  if (!layer)
+  if (!activeLayer())
     return;
 
-  QTransform transform;
-  transform.rotate(90);
-  layer->setImage(
-      layer->image().transformed(transform, Qt::SmoothTransformation));
-
-  updateDisplayPixmap();
-  update();
-  emit imageModified();
+  runCommand(tr("Rotate"), EditCommand::rotate(m_activeLayerIndex, 90));
 }
 
 void ImageCanvas::rotate90CCW() {
-  auto layer = activeLayer();
-  if (!layer)
+  if (!activeLayer())
     return;
 
-  QTransform transform;
-  transform.rotate(-90);
-  layer->setImage(
-      layer->image().transformed(transform, Qt::SmoothTransformation));
-
-  updateDisplayPixmap();
-  update();
-  emit imageModified();
+  runCommand(tr("Rotate"), EditCommand::rotate(m_activeLayerIndex, -90));
 }
 
 void ImageCanvas::rotate180() {
-  auto layer = activeLayer();
-  if (!layer)
+  if (!activeLayer())
     return;
 
-  QTransform transform;
-  transform.rotate(180);
-  layer->setImage(
-      layer->image().transformed(transform, Qt::SmoothTransformation));
-
-  updateDisplayPixmap();
-  update();
-  emit imageModified();
+  runCommand(tr("Rotate"), EditCommand::rotate(m_activeLayerIndex, 180));
 }
 
 void ImageCanvas::rotateByAngle(qreal degrees, const QColor &background) {
-  auto layer = activeLayer();
-  if (!layer || qFuzzyIsNull(degrees))
+  if (!activeLayer() || qFuzzyIsNull(degrees))
     return;
 
-  QTransform transform;
-  transform.rotate(degrees);
-  QImage rotated =
-      layer->image().transformed(transform, Qt::SmoothTransformation);
-
-  if (background.alpha() > 0) {
-    QImage result(rotated.size(), QImage::Format_ARGB32_Premultiplied);
-    result.fill(background);
-    QPainter painter(&result);
-    painter.drawImage(0, 0, rotated);
-    painter.end();
-    layer->setImage(result);
-  } else {
-    layer->setImage(rotated);
-  }
-
-  updateDisplayPixmap();
-  update();
-  emit imageModified();
+  runCommand(tr("Rotate"),
+             EditCommand::rotate(m_activeLayerIndex, degrees, background));
 }
 
 void ImageCanvas::flipHorizontal() {
-  auto layer = activeLayer();
-  if (!layer)
+  if (!activeLayer())
     return;
 
-  layer->setImage(layer->image().flipped(Qt::Horizontal));
-  updateDisplayPixmap();
-  update();
-  emit imageModified();
+  runCommand(tr("Flip Horizontal"),
+             EditCommand::flip(m_activeLayerIndex, Qt::Horizontal));
 }
 
 void ImageCanvas::flipVertical() {
-  auto layer = activeLayer();
-  if (!layer)
+  if (!activeLayer())
     return;
 
-  layer->setImage(layer->image().flipped(Qt::Vertical));
-  updateDisplayPixmap();
-  update();
-  emit imageModified();
+  runCommand(tr("Flip Vertical"),
+             EditCommand::flip(m_activeLayerIndex, Qt::Vertical));
 }
 
 void ImageCanvas::startAdjustmentMode() {
@@ -486,7 +750,8 @@ void ImageCanvas::startAdjustmentMode() {
     return;
   }
 
-  m_originalLayerImage = layer->image();
+  m_originalLayerImage = layer->tiles();
+  m_adjustment = EditCommand::adjust(m_activeLayerIndex, 0, 0, 0, 0);
   m_isAdjusting = true;
   emit adjustmentModeChanged(true);
 }
@@ -498,8 +763,12 @@ void ImageCanvas::setPreviewAdjustments(int brightness, int contrast,
     return;
   }
 
-  layer->setImage(ImageProcessor::applyAdjustments(
-      m_originalLayerImage, brightness, contrast, saturation, hue));
+  layer->tiles() = m_originalLayerImage.transformed([=](const QImage &tile) {
+    return ImageProcessor::applyAdjustments(tile, brightness, contrast,
+                                            saturation, hue);
+  });
+  m_adjustment = EditCommand::adjust(m_activeLayerIndex, brightness, contrast,
+                                     saturation, hue);
   updateDisplayPixmap();
   update();
 }
@@ -509,8 +778,10 @@ void ImageCanvas::applyAdjustments() {
     return;
   }
 
-  m_originalLayerImage = QImage();
+  m_originalLayerImage = TiledImage();
   m_isAdjusting = false;
+  // The preview already holds the result, so only the command is logged.
+  recordHistory(tr("Adjustments"), m_adjustment);
   emit imageModified();
   emit adjustmentModeChanged(false);
 }
@@ -521,8 +792,8 @@ void ImageCanvas::cancelAdjustments() {
     return;
   }
 
-  layer->setImage(m_originalLayerImage);
-  m_originalLayerImage = QImage();
+  layer->tiles() = m_originalLayerImage;
+  m_originalLayerImage = TiledImage();
   m_isAdjusting = false;
 
   updateDisplayPixmap();
@@ -533,33 +804,10 @@ void ImageCanvas::cancelAdjustments() {
 bool ImageCanvas::isAdjusting() const { return m_isAdjusting; }
 
 void ImageCanvas::applyFilter(FilterType type) {
-  auto layer = activeLayer();
-  if (!layer)
+  if (!activeLayer())
     return;
 
-  QImage img = layer->image();
-  switch (type) {
-  case FilterType::Grayscale:
-    img = ImageProcessor::applyGrayscale(img);
-    break;
-  case FilterType::Sepia:
-    img = ImageProcessor::applySepia(img);
-    break;
-  case FilterType::Invert:
-    img = ImageProcessor::applyInvert(img);
-    break;
-  case FilterType::Blur:
-    img = ImageProcessor::applyBlur(img);
-    break;
-  case FilterType::Sharpen:
-    img = ImageProcessor::applySharpen(img);
-    break;
-  }
-
-  layer->setImage(img);
-  updateDisplayPixmap();
-  update();
-  emit imageModified();
+  runCommand(tr("Filter"), EditCommand::filter(m_activeLayerIndex, type));
 }
 
 void ImageCanvas::paintEvent(QPaintEvent *event) {
@@ -570,6 +818,11 @@ void ImageCanvas::paintEvent(QPaintEvent *event) {
 
   if (!hasImage()) {
     painter.fillRect(rect(), palette().color(QPalette::Window));
+    if (!m_previewImage.isNull()) {
+      QRect imageRect = currentImageRect();
+      drawCheckerboard(painter, imageRect);
+      painter.drawImage(imageRect, m_previewImage);
+    }
     return;
   }
 
@@ -578,8 +831,23 @@ void ImageCanvas::paintEvent(QPaintEvent *event) {
   painter.fillRect(rect(), palette().color(QPalette::Window));
   drawCheckerboard(painter, imageRect);
 
+  if (!isDisplayCurrent()) {
+    rebuildDisplayPixmap();
+  }
   if (!m_displayPixmap.isNull()) {
-    painter.drawPixmap(imageRect, m_displayPixmap);
+    painter.drawPixmap(m_displayRect.topLeft(), m_displayPixmap);
+  }
+
+  if (!m_predictedSegment.isNull() && m_activeTool) {
+    QColor color = m_activeTool->color();
+    color.setAlphaF(m_activeTool->opacity() * 0.5);
+    QPen pen(color, std::max(1.0, m_activeTool->size() * m_zoomLevel),
+             Qt::SolidLine, Qt::RoundCap);
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.setPen(pen);
+    painter.drawLine(QLineF(
+        imageRect.topLeft() + m_predictedSegment.p1() * m_zoomLevel,
+        imageRect.topLeft() + m_predictedSegment.p2() * m_zoomLevel));
   }
 }
 
@@ -612,29 +880,19 @@ void ImageCanvas::mousePressEvent(QMouseEvent *event) {
     return;
   }
 
-  if (m_activeTool && event->button() == Qt::LeftButton) {
-    auto layer = activeLayer();
-    if (layer) {
-      QRect imageRect = currentImageRect();
-      QPoint canvasPos = event->pos();
-
-      int imgX =
-          static_cast<int>((canvasPos.x() - imageRect.x()) / m_zoomLevel);
-      int imgY =
-          static_cast<int>((canvasPos.y() - imageRect.y()) / m_zoomLevel);
-      QPoint imagePos(imgX, imgY);
-
-      if (imageRect.contains(canvasPos)) {
-        QImage img = layer->image();
-        m_activeTool->onPress(img, imagePos);
-        layer->setImage(img);
-        m_isDrawing = true;
-        updateDisplayPixmap();
-        update();
-        emit imageModified();
-        event->accept();
-        return;
-      }
+  if (m_isTabletStroke) {
+    event->accept();
+    return;
+  }
+
+  if (m_activeTool && event->button() == Qt::LeftButton &&
+      currentImageRect().contains(event->position().toPoint())) {
+    StrokeSample sample;
+    sample.pos = mapToImage(event->position());
+    sample.timestamp = event->timestamp();
+    if (beginStroke(sample)) {
+      event->accept();
+      return;
     }
   }
 
@@ -650,26 +908,18 @@ void ImageCanvas::mousePressEvent(QMouseEvent *event) {
 }
 
 void ImageCanvas::mouseMoveEvent(QMouseEvent *event) {
-  if (m_isDrawing && m_activeTool) {
-    auto layer = activeLayer();
-    if (layer) {
-      QRect imageRect = currentImageRect();
-      QPoint canvasPos = event->pos();
-
-      int imgX =
-          static_cast<int>((canvasPos.x() - imageRect.x()) / m_zoomLevel);
-      int imgY =
-          static_cast<int>((canvasPos.y() - imageRect.y()) / m_zoomLevel);
-      QPoint imagePos(imgX, imgY);
-
-      QImage img = layer->image();
-      m_activeTool->onMove(img, imagePos);
-      layer->setImage(img);
-      updateDisplayPixmap();
-      update();
-      event->accept();
-      return;
-    }
+  if (m_isTabletStroke) {
+    event->accept();
+    return;
+  }
+
+  if (m_isDrawing) {
+    StrokeSample sample;
+    sample.pos = mapToImage(event->position());
+    sample.timestamp = event->timestamp();
+    queueStrokeSample(sample);
+    event->accept();
+    return;
   }
 
   if (m_isPanning) {
@@ -685,27 +935,16 @@ void ImageCanvas::mouseMoveEvent(QMouseEvent *event) {
 }
 
 void ImageCanvas::mouseReleaseEvent(QMouseEvent *event) {
+  if (m_isTabletStroke) {
+    event->accept();
+    return;
+  }
+
   if (m_isDrawing && event->button() == Qt::LeftButton) {
-    if (m_activeTool) {
-      auto layer = activeLayer();
-      if (layer) {
-        QRect imageRect = currentImageRect();
-        QPoint canvasPos = event->pos();
-
-        int imgX =
-            static_cast<int>((canvasPos.x() - imageRect.x()) / m_zoomLevel);
-        int imgY =
-            static_cast<int>((canvasPos.y() - imageRect.y()) / m_zoomLevel);
-        QPoint imagePos(imgX, imgY);
-
-        QImage img = layer->image();
-        m_activeTool->onRelease(img, imagePos);
-        layer->setImage(img);
-        updateDisplayPixmap();
-        update();
-      }
-    }
-    m_isDrawing = false;
+    StrokeSample sample;
+    sample.pos = mapToImage(event->position());
+    sample.timestamp = event->timestamp();
+    endStroke(sample);
     event->accept();
     return;
   }
@@ -720,17 +959,278 @@ void ImageCanvas::mouseReleaseEvent(QMouseEvent *event) {
   }
 }
 
+void ImageCanvas::tabletEvent(QTabletEvent *event) {
+  if (!hasImage() || m_cropOverlay || !m_activeTool) {
+    event->ignore();
+    return;
+  }
+
+  StrokeSample sample;
+  sample.pos = mapToImage(event->position());
+  sample.pressure = event->pressure();
+  sample.xTilt = event->xTilt();
+  sample.yTilt = event->yTilt();
+  sample.timestamp = event->timestamp();
+
+  switch (event->type()) {
+  case QEvent::TabletPress:
+    if (event->button() == Qt::LeftButton &&
+        currentImageRect().contains(event->position().toPoint()) &&
+        beginStroke(sample)) {
+      m_isTabletStroke = true;
+      event->accept();
+      return;
+    }
+    break;
+  case QEvent::TabletMove:
+    if (m_isDrawing && m_isTabletStroke) {
+      queueStrokeSample(sample);
+      event->accept();
+      return;
+    }
+    break;
+  case QEvent::TabletRelease:
+    if (m_isDrawing && m_isTabletStroke) {
+      endStroke(sample);
+      m_isTabletStroke = false;
+      event->accept();
+      return;
+    }
+    break;
+  default:
+    break;
+  }
+
+  // Unhandled tablet input falls back to the synthesized mouse events.
+  event->ignore();
+}
+
+QPointF ImageCanvas::mapToImage(const QPointF &widgetPos) const {
+  QRect imageRect = currentImageRect();
+  return QPointF((widgetPos.x() - imageRect.x()) / m_zoomLevel,
+                 (widgetPos.y() - imageRect.y()) / m_zoomLevel);
+}
+
+bool ImageCanvas::beginStroke(const StrokeSample &sample) {
+  auto layer = activeLayer();
+  if (!m_activeTool || !layer || m_isReplaying) {
+    return false;
+  }
+
+  m_pendingSamples.clear();
+  StrokeSample first = m_stabilizer.begin(sample);
+  m_activeTool->setPressure(first.pressure);
+  m_activeTool->onPress(layer->tiles(),
+                        first.pos.toPoint() - layer->offset());
+  m_lastStrokePos = first.pos;
+  m_isDrawing = true;
+
+  m_strokeDirtyRect = m_activeTool->takeDirtyRect();
+  updateDisplayRegion(m_strokeDirtyRect.translated(layer->offset()));
+  emit imageModified();
+  return true;
+}
+
+void ImageCanvas::queueStrokeSample(const StrokeSample &sample) {
+  m_pendingSamples.push_back(sample);
+  if (!m_strokeFlushTimer->isActive()) {
+    m_strokeFlushTimer->start();
+  }
+}
+
+void ImageCanvas::flushStrokeSamples() {
+  m_strokeFlushTimer->stop();
+  if (m_pendingSamples.empty()) {
+    return;
+  }
+
+  std::vector<StrokeSample> batch;
+  batch.swap(m_pendingSamples);
+
+  if (!m_isDrawing) {
+    return;
+  }
+
+  m_stabilizer.filter(batch, m_stabilizedSamples);
+  applyStrokeSamples(m_stabilizedSamples);
+  updatePredictedSegment();
+}
+
+void ImageCanvas::endStroke(const StrokeSample &sample) {
+  flushStrokeSamples();
+  applyStrokeSamples(m_stabilizer.finish(sample));
+  updatePredictedSegment();
+
+  auto layer = activeLayer();
+  if (m_activeTool && layer) {
+    m_activeTool->setPressure(sample.pressure);
+    m_activeTool->onRelease(layer->tiles(),
+                            m_lastStrokePos.toPoint() - layer->offset());
+    QRect dirty = m_activeTool->takeDirtyRect();
+    m_strokeDirtyRect |= dirty;
+    updateDisplayRegion(dirty.translated(layer->offset()));
+
+    // Erased or faded-out tiles are released once the stroke is done.
+    layer->tiles().optimize(m_strokeDirtyRect);
+    TileCache::instance().trim();
+    recordHistory(strokeHistoryText());
+  }
+
+  m_strokeDirtyRect = QRect();
+
+  m_isDrawing = false;
+}
+
+void ImageCanvas::applyStrokeSamples(const std::vector<StrokeSample> &samples) {
+  auto layer = activeLayer();
+  if (samples.empty() || !m_activeTool || !layer) {
+    return;
+  }
+
+  // Tools work in layer coordinates; the dirty rect comes back the same way.
+  const QPoint offset = layer->offset();
+  m_layerSamples.assign(samples.begin(), samples.end());
+  for (StrokeSample &sample : m_layerSamples) {
+    sample.pos -= offset;
+  }
+
+  if (m_toolMode == ToolMode::Gradient) {
+    // Drags only redraw what is on screen, at screen resolution; the
+    // release renders the whole layer.
+    static_cast<GradientTool *>(m_activeTool.get())
+        ->setPreview(visibleImageRect().translated(-offset),
+                     std::max(1, int(1.0 / m_zoomLevel)));
+  }
+  m_activeTool->onSamples(layer->tiles(), m_layerSamples);
+  m_lastStrokePos = samples.back().pos;
+
+  QRect dirty = m_activeTool->takeDirtyRect();
+  m_strokeDirtyRect |= dirty;
+  updateDisplayRegion(dirty.translated(offset));
+}
+
+void ImageCanvas::updatePredictedSegment() {
+  // The predicted tail is only an overlay; it is replaced as soon as the
+  // real samples arrive and never touches the layer pixels.
+  QRect oldRect = predictedSegmentRect();
+
+  if (m_isDrawing && m_stabilizer.hasPrediction()) {
+    m_predictedSegment =
+        QLineF(m_lastStrokePos, m_stabilizer.predictedPosition());
+  } else {
+    m_predictedSegment = QLineF();
+  }
+
+  update(oldRect | predictedSegmentRect());
+}
+
+QRect ImageCanvas::predictedSegmentRect() const {
+  if (m_predictedSegment.isNull()) {
+    return QRect();
+  }
+
+  QRect rect = strokeRect(m_predictedSegment.p1(), m_predictedSegment.p2());
+  QRect imageRect = currentImageRect();
+  return QRectF(imageRect.x() + rect.x() * m_zoomLevel,
+                imageRect.y() + rect.y() * m_zoomLevel,
+                rect.width() * m_zoomLevel, rect.height() * m_zoomLevel)
+      .toAlignedRect()
+      .adjusted(-1, -1, 1, 1);
+}
+
+QRect ImageCanvas::visibleImageRect() const {
+  QRect imageRect = currentImageRect();
+  QRect visible =
+      imageRect.intersected(rect()).translated(-imageRect.topLeft());
+  return QRectF(visible.x() / m_zoomLevel, visible.y() / m_zoomLevel,
+                visible.width() / m_zoomLevel, visible.height() / m_zoomLevel)
+      .toAlignedRect();
+}
+
+QRect ImageCanvas::strokeRect(const QPointF &from, const QPointF &to) const {
+  int margin = (m_activeTool ? m_activeTool->size() / 2 : 0) + 2;
+  QRect rect = QRectF(from, to).normalized().toAlignedRect();
+  return rect.adjusted(-margin, -margin, margin, margin);
+}
+
 void ImageCanvas::updateDisplayPixmap() {
-  if (!hasImage()) {
+  // The pixmap is rebuilt on the next paint, which also picks up any pan
+  // or zoom change made in the meantime.
+  m_displayImageRect = QRect();
+}
+
+bool ImageCanvas::isDisplayCurrent() const {
+  QRect imageRect = currentImageRect();
+  return m_displayImageRect == imageRect &&
+         m_displayRect == imageRect.intersected(rect());
+}
+
+void ImageCanvas::rebuildDisplayPixmap() {
+  // Only the visible part of the canvas is composited, at screen scale,
+  // so the cost follows the viewport rather than the document size.
+  m_displayImageRect = currentImageRect();
+  m_displayRect = m_displayImageRect.intersected(rect());
+  if (!hasImage() || m_displayRect.isEmpty()) {
     m_displayPixmap = QPixmap();
     return;
   }
 
-  QImage flattened = getFlattenedImage();
+  m_displayPixmap = QPixmap(m_displayRect.size());
+  compositeDisplay(m_displayRect);
+
+  // Every edit ends up here, which makes it a safe point to compress
+  // tiles that have gone cold.
+  TileCache::instance().trim();
+}
+
+void ImageCanvas::compositeDisplay(const QRect &widgetArea) {
+  QRect area = widgetArea.intersected(m_displayRect);
+  if (area.isEmpty()) {
+    return;
+  }
+
+  QPoint origin = area.topLeft() - m_displayImageRect.topLeft();
+  QRect source =
+      QRectF(origin.x() / m_zoomLevel, origin.y() / m_zoomLevel,
+             area.width() / m_zoomLevel, area.height() / m_zoomLevel)
+          .toAlignedRect()
+          .intersected(QRect(QPoint(0, 0), imageSize()));
+
+  QImage patch(area.size(), QImage::Format_ARGB32_Premultiplied);
+  patch.fill(Qt::transparent);
+
+  QPainter patchPainter(&patch);
+  patchPainter.setRenderHint(QPainter::SmoothPixmapTransform);
+  patchPainter.translate(-origin);
+  patchPainter.scale(m_zoomLevel, m_zoomLevel);
+  for (const auto &layer : m_layers) {
+    layer->render(patchPainter, source, source);
+  }
+  patchPainter.end();
+
+  QPainter pixmapPainter(&m_displayPixmap);
+  pixmapPainter.setCompositionMode(QPainter::CompositionMode_Source);
+  pixmapPainter.drawImage(area.topLeft() - m_displayRect.topLeft(), patch);
+}
+
+void ImageCanvas::updateDisplayRegion(const QRect &region) {
+  QRect area = region.intersected(QRect(QPoint(0, 0), imageSize()));
+  if (area.isEmpty()) {
+    return;
+  }
+
+  if (m_displayPixmap.isNull() || !isDisplayCurrent()) {
+    update();
+    return;
+  }
+
+  QRectF target(m_displayImageRect.x() + area.x() * m_zoomLevel,
+                m_displayImageRect.y() + area.y() * m_zoomLevel,
+                area.width() * m_zoomLevel, area.height() * m_zoomLevel);
+  QRect widgetArea = target.toAlignedRect().adjusted(-1, -1, 1, 1);
 
-  QSize targetSize = flattened.size() * m_zoomLevel;
-  m_displayPixmap = QPixmap::fromImage(flattened.scaled(
-      targetSize, Qt::KeepAspectRatio, Qt::SmoothTransformation));
+  compositeDisplay(widgetArea);
+  update(widgetArea);
 }
 
 void ImageCanvas::drawCheckerboard(QPainter &painter, const QRect &rect) {
@@ -798,11 +1298,11 @@ void ImageCanvas::constrainPan() {
 }
 
 QRect ImageCanvas::currentImageRect() const {
-  if (!hasImage()) {
+  if (!hasImage() && m_previewImage.isNull()) {
     return QRect();
   }
 
-  QSize scaledSize = imageSize() * m_zoomLevel;
+  QSize scaledSize = m_canvasSize * m_zoomLevel;
   int x = (width() - scaledSize.width()) / 2 + m_panOffset.x();
   int y = (height() - scaledSize.height()) / 2 + m_panOffset.y();
   return QRect(x, y, scaledSize.width(), scaledSize.height());
@@ -815,6 +1315,189 @@ void ImageCanvas::updateCropOverlay() {
   }
 }
 
+void ImageCanvas::undo() {
+  if (!canUndo() || m_isDrawing || m_isAdjusting || m_cropOverlay) {
+    return;
+  }
+  startHistoryStep(tr("Undo %1").arg(undoText()), m_undoStack.undoStep());
+}
+
+void ImageCanvas::redo() {
+  if (!canRedo() || m_isDrawing || m_isAdjusting || m_cropOverlay) {
+    return;
+  }
+  startHistoryStep(tr("Redo %1").arg(redoText()), m_undoStack.redoStep());
+}
+
+bool ImageCanvas::canUndo() const {
+  return !m_isReplaying && m_undoStack.canUndo();
+}
+
+bool ImageCanvas::canRedo() const {
+  return !m_isReplaying && m_undoStack.canRedo();
+}
+
+bool ImageCanvas::isReplaying() const { return m_isReplaying; }
+
+QString ImageCanvas::undoText() const { return m_undoStack.undoText(); }
+
+QString ImageCanvas::redoText() const { return m_undoStack.redoText(); }
+
+void ImageCanvas::setHistoryLimit(qsizetype bytes) {
+  m_undoStack.setMemoryLimit(bytes);
+  emit historyChanged();
+}
+
+qsizetype ImageCanvas::historyLimit() const {
+  return m_undoStack.memoryLimit();
+}
+
+Recipe ImageCanvas::recipe() const { return Recipe(m_undoStack.commands()); }
+
+DocumentState ImageCanvas::documentState() const {
+  // Copying a layer copies its tile table, not its pixels.
+  DocumentState state;
+  state.layers.reserve(m_layers.size());
+  for (const auto &layer : m_layers) {
+    state.layers.push_back(*layer);
+  }
+  state.activeLayer = m_activeLayerIndex;
+  state.canvasSize = m_canvasSize;
+  return state;
+}
+
+void ImageCanvas::restoreDocumentState(const DocumentState &state) {
+  m_layers.clear();
+  for (const Layer &layer : state.layers) {
+    m_layers.push_back(std::make_shared<Layer>(layer));
+  }
+  m_activeLayerIndex = state.activeLayer;
+  m_canvasSize = state.canvasSize;
+
+  updateDisplayPixmap();
+  update();
+
+  emit layersReset();
+  emit activeLayerChanged(m_activeLayerIndex);
+  emit historyChanged();
+  emit imageModified();
+}
+
+void ImageCanvas::recordHistory(const QString &text, bool mergeable) {
+  cancelReplay();
+  ++m_revision;
+  DocumentState state = documentState();
+  m_undoStack.push(text, state, mergeable);
+  m_journal.record(text, state);
+  emit historyChanged();
+}
+
+void ImageCanvas::recordHistory(const QString &text,
+                                const EditCommand &command) {
+  cancelReplay();
+  ++m_revision;
+  DocumentState state = documentState();
+  m_undoStack.push(text, state, command);
+  m_journal.record(text, state, command);
+  emit historyChanged();
+}
+
+void ImageCanvas::runCommand(const QString &text,
+                             const EditCommand &command) {
+  DocumentState state = documentState();
+  command.apply(state);
+
+  // Commands never add or remove layers, so the layer objects and the
+  // layers panel stay as they are.
+  for (size_t i = 0; i < m_layers.size(); ++i) {
+    *m_layers[i] = state.layers[i];
+  }
+  m_canvasSize = state.canvasSize;
+
+  updateDisplayPixmap();
+  update();
+
+  recordHistory(text, command);
+  emit imageModified();
+}
+
+void ImageCanvas::startHistoryStep(const QString &text,
+                                   const UndoStack::Step &step) {
+  m_historyStepText = text;
+  if (step.commands.empty()) {
+    finishHistoryStep(step.index, step.base);
+    return;
+  }
+
+  // Replaying whole-image commands can take a while on a large document,
+  // so it runs on the thread pool and the document stays as it is until
+  // the rebuilt state is ready.
+  m_isReplaying = true;
+  m_replayIndex = step.index;
+  setCursor(Qt::BusyCursor);
+  emit historyChanged();
+
+  m_replayWatcher->setFuture(QtConcurrent::run([step]() {
+    DocumentState state = step.base;
+    EditCommand::applyAll(step.commands, state);
+    return state;
+  }));
+}
+
+void ImageCanvas::finishReplay() {
+  if (!m_isReplaying) {
+    return;
+  }
+
+  m_isReplaying = false;
+  unsetCursor();
+  finishHistoryStep(m_replayIndex, m_replayWatcher->result());
+  // The replay could not trim while it ran; see TiledImage::transformed.
+  TileCache::instance().trim();
+}
+
+void ImageCanvas::finishHistoryStep(int index, const DocumentState &state) {
+  m_undoStack.moveTo(index, state);
+  ++m_revision;
+  // The journal has no history of its own, so it logs where the step
+  // landed like any other edit.
+  m_journal.record(m_historyStepText, state);
+  restoreDocumentState(state);
+}
+
+bool ImageCanvas::recoverJournal(const QString &path) {
+  clearProject();
+
+  DocumentState recovered;
+  bool ok = m_journal.recover(
+      path, [this, &recovered](const QString &text, const DocumentState &state,
+                               const EditCommand *command) {
+        if (command) {
+          m_undoStack.push(text, state, *command);
+        } else {
+          m_undoStack.push(text, state);
+        }
+        recovered = state;
+      });
+  if (!ok) {
+    return false;
+  }
+
+  restoreDocumentState(recovered);
+  emit zoomChanged(m_zoomLevel);
+  return true;
+}
+
+void ImageCanvas::cancelReplay() {
+  // An edit made while a replay runs applies to the document on screen,
+  // which is still the state the replay started from; the replay result
+  // is dropped when it arrives.
+  if (m_isReplaying) {
+    m_isReplaying = false;
+    unsetCursor();
+  }
+}
+
 // Tool methods implementation
 void ImageCanvas::setToolMode(ToolMode mode)
 {
@@ -822,6 +1505,9 @@ void ImageCanvas::setToolMode(ToolMode mode)
     
     m_toolMode = mode;
     m_isDrawing = false;
+    m_isTabletStroke = false;
+    m_pendingSamples.clear();
+    m_predictedSegment = QLineF();
     
     // Create appropriate tool instance
     switch (mode) {
@@ -831,6 +1517,20 @@ void ImageCanvas::setToolMode(ToolMode mode)
     case ToolMode::Eraser:
         m_activeTool = std::make_unique<EraserTool>();
         break;
+    case ToolMode::Fill: {
+        auto fill = std::make_unique<FillTool>();
+        fill->setTolerance(m_fillTolerance);
+        fill->setContiguous(m_fillContiguous);
+        m_activeTool = std::move(fill);
+        break;
+    }
+    case ToolMode::Gradient: {
+        auto gradient = std::make_unique<GradientTool>();
+        gradient->setShape(m_gradientShape);
+        gradient->setEndColor(m_toolBackgroundColor);
+        m_activeTool = std::move(gradient);
+        break;
+    }
     case ToolMode::None:
     default:
         m_activeTool.reset();
@@ -850,6 +1550,14 @@ void ImageCanvas::setToolColor(const QColor& color)
     }
 }
 
+void ImageCanvas::setToolBackgroundColor(const QColor& color)
+{
+    m_toolBackgroundColor = color;
+    if (m_toolMode == ToolMode::Gradient) {
+        static_cast<GradientTool*>(m_activeTool.get())->setEndColor(color);
+    }
+}
+
 void ImageCanvas::setToolSize(int size)
 {
     if (m_activeTool) {
@@ -864,4 +1572,87 @@ void ImageCanvas::setToolOpacity(qreal opacity)
     }
 }
 
-ImageCanvas::~ImageCanvas() = default;
+void ImageCanvas::setStabilizerMode(StrokeStabilizer::Mode mode) {
+  m_stabilizer.setMode(mode);
+}
+
+StrokeStabilizer::Mode ImageCanvas::stabilizerMode() const {
+  return m_stabilizer.mode();
+}
+
+void ImageCanvas::setStabilizerStrength(qreal strength) {
+  m_stabilizer.setStrength(strength);
+}
+
+qreal ImageCanvas::stabilizerStrength() const {
+  return m_stabilizer.strength();
+}
+
+void ImageCanvas::setStrokePrediction(int msecs) {
+  m_stabilizer.setPredictionHorizon(msecs);
+}
+
+int ImageCanvas::strokePrediction() const {
+  return m_stabilizer.predictionHorizon();
+}
+
+void ImageCanvas::setFillTolerance(int tolerance)
+{
+    m_fillTolerance = tolerance;
+    if (m_toolMode == ToolMode::Fill) {
+        static_cast<FillTool*>(m_activeTool.get())->setTolerance(tolerance);
+    }
+}
+
+int ImageCanvas::fillTolerance() const
+{
+    return m_fillTolerance;
+}
+
+void ImageCanvas::setFillContiguous(bool contiguous)
+{
+    m_fillContiguous = contiguous;
+    if (m_toolMode == ToolMode::Fill) {
+        static_cast<FillTool*>(m_activeTool.get())->setContiguous(contiguous);
+    }
+}
+
+bool ImageCanvas::fillContiguous() const
+{
+    return m_fillContiguous;
+}
+
+void ImageCanvas::setGradientShape(GradientTool::Shape shape)
+{
+    m_gradientShape = shape;
+    if (m_toolMode == ToolMode::Gradient) {
+        static_cast<GradientTool*>(m_activeTool.get())->setShape(shape);
+    }
+}
+
+GradientTool::Shape ImageCanvas::gradientShape() const
+{
+    return m_gradientShape;
+}
+
+QString ImageCanvas::strokeHistoryText() const
+{
+    switch (m_toolMode) {
+    case ToolMode::Brush:
+        return tr("Brush Stroke");
+    case ToolMode::Eraser:
+        return tr("Erase");
+    case ToolMode::Fill:
+        return tr("Fill");
+    case ToolMode::Gradient:
+        return tr("Gradient");
+    case ToolMode::None:
+        break;
+    }
+    return tr("Edit");
+}
+
+ImageCanvas::~ImageCanvas() {
+  // The save owns a copy of the document, but must not be cut off.
+  m_saveWatcher->waitForFinished();
+}
@@ -1,7 +1,16 @@
 #ifndef IMAGECANVAS_H
 #define IMAGECANVAS_H
 
+#include "DrawingTool.h"
+#include "GradientTool.h"
+#include "Journal.h"
+#include "Recipe.h"
+#include "StrokeStabilizer.h"
+#include "UndoStack.h"
+
+#include <QFutureWatcher>
 #include <QImage>
+#include <QLineF>
 #include <QPixmap>
 #include <QWidget>
 #include <memory>
@@ -9,7 +18,7 @@
 
 class CropOverlay;
 class Layer;
-class DrawingTool;
+class QTimer;
 
 class ImageCanvas : public QWidget {
   Q_OBJECT
@@ -19,17 +28,35 @@ public:
   static constexpr qreal MaxZoom = 10.0;
   static constexpr qreal ZoomStep = 1.25;
 
-  enum class FilterType { Grayscale, Sepia, Invert, Blur, Sharpen };
-  enum class ToolMode { None, Brush, Eraser };
+  using FilterType = EditCommand::Filter;
+  enum class ToolMode { None, Brush, Eraser, Fill, Gradient };
 
   explicit ImageCanvas(QWidget *parent = nullptr);
   ~ImageCanvas() override;
 
+  // Opens an image or project. Large images the decoder can downscale
+  // show a preview first and finish loading in the background; the result
+  // arrives through imageLoaded() or loadFailed().
   bool loadProject(const QString &path);
+  // Saves a snapshot of the document on a worker thread and reports the
+  // outcome through imageSaved() or saveFailed(); editing carries on in
+  // the meantime. Returns false if there is nothing to save.
   bool saveProject(const QString &path);
+  [[nodiscard]] bool isSaving() const;
+  // True while a large image decodes in the background.
+  [[nodiscard]] bool isLoading() const;
+  // Blocks until a running save has finished and been reported.
+  void waitForSave();
   void clearProject();
+  // Called when another document takes the screen: drops the display
+  // pixmap and makes this document's tiles the first the cache evicts.
+  void moveToBackground();
+  // Rebuilds the document and its history from a crash-recovery journal.
+  bool recoverJournal(const QString &path);
 
-  void addLayer(const QImage &image, const QString &name);
+  void addLayer(const QImage &image, const QString &name,
+                const QPoint &offset = QPoint());
+  void pasteAsNewLayer(const QImage &image);
   void removeLayer(int index);
   void moveLayerUp(int index);
   void moveLayerDown(int index);
@@ -79,15 +106,46 @@ public:
 
   void applyFilter(FilterType type);
 
+  void undo();
+  void redo();
+  [[nodiscard]] bool canUndo() const;
+  [[nodiscard]] bool canRedo() const;
+  // True while an undo or redo rebuilds its state in the background.
+  [[nodiscard]] bool isReplaying() const;
+  [[nodiscard]] QString undoText() const;
+  [[nodiscard]] QString redoText() const;
+  void setHistoryLimit(qsizetype bytes);
+  [[nodiscard]] qsizetype historyLimit() const;
+  // The whole-image edits that led to the current state.
+  [[nodiscard]] Recipe recipe() const;
+
   void setToolMode(ToolMode mode);
   ToolMode toolMode() const;
   void setToolColor(const QColor &color);
+  void setToolBackgroundColor(const QColor &color);
   void setToolSize(int size);
   void setToolOpacity(qreal opacity);
 
+  void setStabilizerMode(StrokeStabilizer::Mode mode);
+  StrokeStabilizer::Mode stabilizerMode() const;
+  void setStabilizerStrength(qreal strength);
+  qreal stabilizerStrength() const;
+  void setStrokePrediction(int msecs);
+  int strokePrediction() const;
+
+  void setFillTolerance(int tolerance);
+  int fillTolerance() const;
+  void setFillContiguous(bool contiguous);
+  bool fillContiguous() const;
+  void setGradientShape(GradientTool::Shape shape);
+  GradientTool::Shape gradientShape() const;
+
 signals:
   void imageLoaded(const QString &path);
+  void loadFailed(const QString &path);
   void imageSaved(const QString &path);
+  void saveFailed(const QString &path);
+  void saveProgress(int percent);
   void imageModified();
   void zoomChanged(qreal level);
   void cropModeChanged(bool cropping);
@@ -97,6 +155,8 @@ signals:
   void layerRemoved(int index);
   void layerMoved(int from, int to);
   void activeLayerChanged(int index);
+  void layersReset();
+  void historyChanged();
 
 protected:
   void paintEvent(QPaintEvent *event) override;
@@ -105,9 +165,41 @@ protected:
   void mousePressEvent(QMouseEvent *event) override;
   void mouseMoveEvent(QMouseEvent *event) override;
   void mouseReleaseEvent(QMouseEvent *event) override;
+  void tabletEvent(QTabletEvent *event) override;
 
 private:
+  bool loadInBackground(const QString &path);
+  void finishLoad();
+  void appendLayer(std::shared_ptr<Layer> layer);
+  QPointF mapToImage(const QPointF &widgetPos) const;
+  bool beginStroke(const StrokeSample &sample);
+  void queueStrokeSample(const StrokeSample &sample);
+  void flushStrokeSamples();
+  void endStroke(const StrokeSample &sample);
+  QRect strokeRect(const QPointF &from, const QPointF &to) const;
+  void applyStrokeSamples(const std::vector<StrokeSample> &samples);
+  void updatePredictedSegment();
+  QRect predictedSegmentRect() const;
+  // The part of the image the viewport shows, in image coordinates.
+  QRect visibleImageRect() const;
+
+  DocumentState documentState() const;
+  void restoreDocumentState(const DocumentState &state);
+  void recordHistory(const QString &text, bool mergeable = false);
+  void recordHistory(const QString &text, const EditCommand &command);
+  void runCommand(const QString &text, const EditCommand &command);
+  void startHistoryStep(const QString &text, const UndoStack::Step &step);
+  void finishReplay();
+  void finishHistoryStep(int index, const DocumentState &state);
+  void cancelReplay();
+  void finishSave();
+  QString strokeHistoryText() const;
+
   void updateDisplayPixmap();
+  bool isDisplayCurrent() const;
+  void rebuildDisplayPixmap();
+  void compositeDisplay(const QRect &widgetArea);
+  void updateDisplayRegion(const QRect &region);
   void drawCheckerboard(QPainter &painter, const QRect &rect);
   void zoomAtPoint(qreal factor, const QPoint &point);
   void constrainPan();
@@ -116,9 +208,12 @@ private:
 
   std::vector<std::shared_ptr<Layer>> m_layers;
   int m_activeLayerIndex;
+  QSize m_canvasSize;
 
-  QImage m_originalLayerImage;
+  TiledImage m_originalLayerImage;
   QPixmap m_displayPixmap;
+  QRect m_displayRect;
+  QRect m_displayImageRect;
   qreal m_zoomLevel;
   QPoint m_panOffset;
   QPoint m_lastMousePos;
@@ -129,6 +224,42 @@ private:
   ToolMode m_toolMode;
   std::unique_ptr<DrawingTool> m_activeTool;
   bool m_isDrawing;
+  bool m_isTabletStroke;
+  std::vector<StrokeSample> m_pendingSamples;
+  QPointF m_lastStrokePos;
+  QRect m_strokeDirtyRect;
+  QTimer *m_strokeFlushTimer;
+  StrokeStabilizer m_stabilizer;
+  std::vector<StrokeSample> m_stabilizedSamples;
+  std::vector<StrokeSample> m_layerSamples;
+  QLineF m_predictedSegment;
+  int m_fillTolerance;
+  bool m_fillContiguous;
+  GradientTool::Shape m_gradientShape;
+  QColor m_toolBackgroundColor;
+
+  EditCommand m_adjustment;
+  UndoStack m_undoStack;
+  QFutureWatcher<DocumentState> *m_replayWatcher;
+  int m_replayIndex;
+  bool m_isReplaying;
+  QString m_historyStepText;
+  Journal m_journal;
+  QTimer *m_autosaveTimer;
+  // Counts history steps, so a save can tell whether edits landed while
+  // it ran.
+  quint64 m_revision;
+
+  // Stands in for the document while its full decode runs.
+  QImage m_previewImage;
+  QString m_loadPath;
+  QFutureWatcher<TiledImage> *m_loadWatcher;
+
+  QFutureWatcher<bool> *m_saveWatcher;
+  bool m_isSaving;
+  QString m_savePath;
+  DocumentState m_saveState;
+  quint64 m_saveRevision;
 };
 
 #endif
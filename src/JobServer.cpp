@@ -0,0 +1,249 @@
+#include "JobServer.h"
+#include "BatchProcessor.h"
+#include "TileCache.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QPointer>
+#include <QtConcurrent>
+#include <cstring>
+#include <optional>
+#include <utility>
+
+namespace {
+
+// How long a server already using the name gets to answer.
+constexpr int ProbeMsecs = 1000;
+
+const std::pair<const char *, QImage::Format> PixelFormats[] = {
+    {"argb32", QImage::Format_ARGB32},
+    {"argb32_premultiplied", QImage::Format_ARGB32_Premultiplied},
+    {"rgba8888", QImage::Format_RGBA8888},
+    {"rgb888", QImage::Format_RGB888},
+    {"grayscale8", QImage::Format_Grayscale8}};
+
+struct Outcome {
+  QString error;
+  QString output;
+  // The result when the request names no output file.
+  QImage image;
+  QSize size;
+  qint64 msecs = 0;
+};
+
+QImage readSharedImage(const QJsonObject &description, QString &error) {
+  std::optional<QImage::Format> format;
+  for (const auto &[name, value] : PixelFormats) {
+    if (description["format"].toString() == QLatin1String(name)) {
+      format = value;
+    }
+  }
+  const int width = description["width"].toInt();
+  const int height = description["height"].toInt();
+  const qsizetype bytesPerLine = description["bytesPerLine"].toInteger();
+  if (!format || width <= 0 || height <= 0 ||
+      bytesPerLine * 8 <
+          qsizetype(width) * QImage::toPixelFormat(*format).bitsPerPixel()) {
+    error = QStringLiteral("invalid shared memory description");
+    return QImage();
+  }
+
+  QSharedMemory memory;
+  memory.setKey(description["key"].toString());
+  if (!memory.attach(QSharedMemory::ReadOnly)) {
+    error = memory.errorString();
+    return QImage();
+  }
+  if (memory.size() < bytesPerLine * height) {
+    error = QStringLiteral("shared memory segment is too small");
+    return QImage();
+  }
+
+  // Copied out so the client can reuse its segment once it has the reply.
+  memory.lock();
+  QImage image = QImage(static_cast<const uchar *>(memory.constData()),
+                        width, height, bytesPerLine, *format)
+                     .copy();
+  memory.unlock();
+  return image;
+}
+
+Outcome runJob(const QJsonObject &request) {
+  QElapsedTimer timer;
+  timer.start();
+  Outcome outcome;
+
+  std::optional<DocumentState> state;
+  if (request.contains("sharedMemory")) {
+    QImage image =
+        readSharedImage(request["sharedMemory"].toObject(), outcome.error);
+    if (image.isNull()) {
+      return outcome;
+    }
+    state.emplace();
+    state->canvasSize = image.size();
+    state->layers.emplace_back(image, "Background");
+    state->activeLayer = 0;
+  } else {
+    state = BatchProcessor::loadDocument(request["input"].toString());
+    if (!state) {
+      outcome.error = QStringLiteral("could not read the input");
+      return outcome;
+    }
+  }
+
+  std::optional<Recipe> recipe =
+      Recipe::fromJson(request["recipe"].toArray());
+  if (!recipe) {
+    outcome.error = QStringLiteral("unknown recipe step");
+    return outcome;
+  }
+  QStringList operations;
+  for (const QJsonValue &value : request["operations"].toArray()) {
+    if (!BatchProcessor::isValidOperation(value.toString())) {
+      outcome.error =
+          QStringLiteral("unknown operation: %1").arg(value.toString());
+      return outcome;
+    }
+    operations.append(value.toString());
+  }
+
+  if (!BatchProcessor::editDocument(*state, *recipe, operations)) {
+    outcome.error = QStringLiteral("the edits leave no image");
+    return outcome;
+  }
+  outcome.size = state->canvasSize;
+
+  outcome.output = request["output"].toString();
+  if (outcome.output.isEmpty()) {
+    outcome.image = flattenDocument(*state);
+    if (hasDamagedTiles(*state)) {
+      outcome.image = QImage();
+      outcome.error = QStringLiteral("parts of the image could not be read");
+    }
+  } else if (!BatchProcessor::writeDocument(outcome.output, *state)) {
+    outcome.error = QStringLiteral("could not write %1").arg(outcome.output);
+  }
+  outcome.msecs = timer.elapsed();
+  return outcome;
+}
+
+} // namespace
+
+JobServer::JobServer(QObject *parent)
+    : QObject(parent), m_server(new QLocalServer(this)), m_results(),
+      m_nextResult(0) {
+  // Jobs edit documents on several threads at once, which the tile cache
+  // cannot trim under; see BatchProcessor.
+  TileCache::instance().setBudget(0);
+
+  m_server->setSocketOptions(QLocalServer::UserAccessOption);
+  connect(m_server, &QLocalServer::newConnection, this,
+          &JobServer::acceptConnections);
+}
+
+bool JobServer::listen(const QString &name) {
+  // A live server keeps its name. One that crashed leaves its socket file
+  // behind on Unix, which nothing answers on and which is removed.
+  QLocalSocket probe;
+  probe.connectToServer(name);
+  if (probe.waitForConnected(ProbeMsecs)) {
+    return false;
+  }
+  QLocalServer::removeServer(name);
+  return m_server->listen(name);
+}
+
+void JobServer::acceptConnections() {
+  while (QLocalSocket *socket = m_server->nextPendingConnection()) {
+    connect(socket, &QLocalSocket::readyRead, this,
+            [this, socket]() { readRequests(socket); });
+    connect(socket, &QLocalSocket::disconnected, this, [this, socket]() {
+      m_results.remove(socket);
+      socket->deleteLater();
+    });
+  }
+}
+
+void JobServer::readRequests(QLocalSocket *socket) {
+  while (socket->canReadLine()) {
+    const QByteArray line = socket->readLine().trimmed();
+    if (line.isEmpty()) {
+      continue;
+    }
+
+    const QJsonDocument document = QJsonDocument::fromJson(line);
+    if (!document.isObject()) {
+      reply(socket, {{"ok", false}, {"error", "malformed request"}});
+      continue;
+    }
+
+    const QJsonObject request = document.object();
+    if (request.contains("release")) {
+      m_results[socket].remove(request["release"].toString());
+      continue;
+    }
+    startJob(socket, request);
+  }
+}
+
+void JobServer::startJob(QLocalSocket *socket, const QJsonObject &request) {
+  QPointer<QLocalSocket> client(socket);
+  QtConcurrent::run(runJob, request)
+      .then(this, [this, client, id = request["id"]](Outcome outcome) {
+        // Nothing is kept for a client that has gone.
+        if (!client || client->state() != QLocalSocket::ConnectedState) {
+          return;
+        }
+
+        QJsonObject message{{"id", id}, {"ok", outcome.error.isEmpty()}};
+        if (!outcome.error.isEmpty()) {
+          message["error"] = outcome.error;
+          reply(client, message);
+          return;
+        }
+        message["width"] = outcome.size.width();
+        message["height"] = outcome.size.height();
+        message["msecs"] = outcome.msecs;
+
+        if (!outcome.output.isEmpty()) {
+          message["output"] = outcome.output;
+          reply(client, message);
+          return;
+        }
+
+        const QImage &image = outcome.image;
+        const QString key = QStringLiteral("picture-result-%1-%2")
+                                .arg(QCoreApplication::applicationPid())
+                                .arg(m_nextResult++);
+        auto memory = std::make_shared<QSharedMemory>();
+        memory->setKey(key);
+        if (!memory->create(image.sizeInBytes())) {
+          message["ok"] = false;
+          message["error"] = memory->errorString();
+          reply(client, message);
+          return;
+        }
+        memory->lock();
+        std::memcpy(memory->data(), image.constBits(), image.sizeInBytes());
+        memory->unlock();
+        m_results[client].insert(key, memory);
+
+        message["sharedMemory"] =
+            QJsonObject{{"key", key},
+                        {"width", image.width()},
+                        {"height", image.height()},
+                        {"bytesPerLine", image.bytesPerLine()},
+                        {"format", "argb32_premultiplied"}};
+        reply(client, message);
+      });
+}
+
+void JobServer::reply(QLocalSocket *socket, const QJsonObject &message) {
+  socket->write(QJsonDocument(message).toJson(QJsonDocument::Compact));
+  socket->write("\n");
+}
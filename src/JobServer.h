@@ -0,0 +1,56 @@
+#ifndef JOBSERVER_H
+#define JOBSERVER_H
+
+#include <QHash>
+#include <QJsonObject>
+#include <QObject>
+#include <QSharedMemory>
+#include <memory>
+
+class QLocalServer;
+class QLocalSocket;
+
+// Long-running batch mode for other tools: listens on a local socket
+// (Picture --batch --server NAME) and runs edit jobs on the global
+// thread pool, so the process and its image plugins stay loaded between
+// jobs. Requests and replies are single-line JSON objects:
+//
+//   {"id": 7, "input": "/in.jpg", "output": "/out.png",
+//    "recipe": [...], "operations": ["resize=50%", "sharpen"]}
+//
+// "recipe" holds steps as in a recipe file and "operations" takes --op
+// values; both are optional and run in that order. Instead of "input",
+// "sharedMemory": {"key", "width", "height", "bytesPerLine", "format"}
+// names a segment holding the pixels, with format one of argb32,
+// argb32_premultiplied, rgba8888, rgb888 or grayscale8. Without
+// "output" the result goes into a new segment, described the same way
+// in the reply, which the server holds until the client sends
+// {"release": KEY} or disconnects.
+//
+// Each reply echoes the id, with "ok", the result's "width" and
+// "height" and "msecs", plus "output" or "sharedMemory", or "error".
+// Jobs on one connection run concurrently and may finish out of order.
+class JobServer : public QObject {
+  Q_OBJECT
+
+public:
+  explicit JobServer(QObject *parent = nullptr);
+  ~JobServer() override = default;
+
+  // Fails if another server already answers on the name.
+  bool listen(const QString &name);
+
+private:
+  void acceptConnections();
+  void readRequests(QLocalSocket *socket);
+  void startJob(QLocalSocket *socket, const QJsonObject &request);
+  void reply(QLocalSocket *socket, const QJsonObject &message);
+
+  QLocalServer *m_server;
+  // Result segments not yet released, per connection.
+  QHash<QLocalSocket *, QHash<QString, std::shared_ptr<QSharedMemory>>>
+      m_results;
+  quint64 m_nextResult;
+};
+
+#endif
@@ -0,0 +1,576 @@
+#include "Journal.h"
+#include "MappedImage.h"
+#include "ProjectFile.h"
+#include "Tile.h"
+
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QJsonDocument>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+const QByteArray Magic("PICJNL01");
+constexpr int CompressionLevel = 1;
+
+QString journalDirectory() {
+  return QStandardPaths::writableLocation(
+             QStandardPaths::AppLocalDataLocation) +
+         "/recovery";
+}
+
+QString lockPath(const QString &journalPath) {
+  return journalPath + ".lock";
+}
+
+QString autosavePath(const QString &journalPath) {
+  QFileInfo info(journalPath);
+  return info.path() + "/" + info.completeBaseName() + ".picture";
+}
+
+// Identifies the contents of an image file a log starts from, so recovery
+// can tell when the file has been changed since. The checksum covers
+// evenly spaced blocks rather than the whole file, which keeps it cheap
+// for multi-gigabyte images.
+struct SourceFingerprint {
+  qint64 size = -1;
+  qint64 modified = -1;
+  QByteArray checksum;
+
+  bool operator==(const SourceFingerprint &) const = default;
+};
+
+constexpr qint64 FingerprintBlockBytes = 64 * 1024;
+constexpr int FingerprintBlocks = 16;
+
+SourceFingerprint fingerprint(const QString &path) {
+  SourceFingerprint result;
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return result;
+  }
+
+  result.size = file.size();
+  result.modified = QFileInfo(path).lastModified().toMSecsSinceEpoch();
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+  const qint64 span = std::max<qint64>(result.size - FingerprintBlockBytes, 0);
+  for (int i = 0; i < FingerprintBlocks; ++i) {
+    // The first block starts at the beginning, the last ends at the end.
+    if (!file.seek(span * i / (FingerprintBlocks - 1))) {
+      return SourceFingerprint();
+    }
+    hash.addData(file.read(FingerprintBlockBytes));
+  }
+  result.checksum = hash.result();
+  return result;
+}
+
+QByteArray frame(const QByteArray &record) {
+  QByteArray bytes;
+  QDataStream stream(&bytes, QIODevice::WriteOnly);
+  stream << quint32(record.size());
+  stream.writeRawData(record.constData(), record.size());
+  stream << qChecksum(record);
+  return bytes;
+}
+
+QByteArray packTile(const QImage &tile) {
+  if (tile.isNull()) {
+    return QByteArray();
+  }
+  return qCompress(tile.constBits(), tile.sizeInBytes(), CompressionLevel);
+}
+
+QImage unpackTile(const QByteArray &packed, const QSize &size) {
+  if (packed.isEmpty()) {
+    return QImage();
+  }
+  QImage tile(size, QImage::Format_ARGB32_Premultiplied);
+  QByteArray pixels = qUncompress(packed);
+  if (pixels.size() != tile.sizeInBytes()) {
+    return QImage();
+  }
+  std::memcpy(tile.bits(), pixels.constData(), pixels.size());
+  return tile;
+}
+
+// One layer of a state record: its properties, the layer of the previous
+// state its tile grid starts from, and the tiles that differ from it.
+struct LayerDelta {
+  Layer layer;
+  int source;
+  std::vector<int> changedTiles;
+};
+
+bool readRecord(QFile &file, QByteArray &payload) {
+  QDataStream stream(&file);
+  quint32 length = 0;
+  stream >> length;
+  if (stream.status() != QDataStream::Ok ||
+      file.bytesAvailable() < qint64(length) + 2) {
+    return false;
+  }
+
+  payload = file.read(length);
+  quint16 checksum = 0;
+  stream >> checksum;
+  return stream.status() == QDataStream::Ok &&
+         payload.size() == qsizetype(length) && checksum == qChecksum(payload);
+}
+
+} // namespace
+
+Journal::Journal()
+    : m_pool(), m_file(), m_path(), m_sourcePath(), m_lock(), m_state(),
+      m_tilePositions(), m_hasBase(false), m_baseFromSource(false),
+      m_hasUncheckpointedSteps(false) {
+  // A single thread keeps records in the order they were made.
+  m_pool.setMaxThreadCount(1);
+}
+
+Journal::~Journal() { discard(); }
+
+bool Journal::isOpen() const { return !m_path.isEmpty(); }
+
+bool Journal::readsFrom(const QString &path) const {
+  return !m_sourcePath.isEmpty() && QFileInfo(m_sourcePath) == QFileInfo(path);
+}
+
+void Journal::start(const QString &sourcePath) {
+  discard();
+
+  // Numbered, since every open document of a session keeps a journal.
+  static int nextJournal = 0;
+  QString name = QString("%1-%2-%3.journal")
+                     .arg(QDateTime::currentDateTime().toString(
+                         "yyyyMMdd-hhmmss"))
+                     .arg(QCoreApplication::applicationPid())
+                     .arg(nextJournal++);
+  if (!QDir().mkpath(journalDirectory()) ||
+      !open(journalDirectory() + "/" + name, false)) {
+    return;
+  }
+
+  if (!sourcePath.isEmpty()) {
+    m_sourcePath = sourcePath;
+    m_baseFromSource = true;
+    // Built here so a project is pinned to the revision just loaded or
+    // saved, not to whatever a later save leaves in the file.
+    QByteArray record = openRecord(sourcePath);
+    append([record]() { return record; });
+  }
+}
+
+void Journal::record(const QString &text, const DocumentState &state) {
+  if (!isOpen()) {
+    start(QString());
+    if (!isOpen()) {
+      return;
+    }
+  }
+
+  if (m_baseFromSource) {
+    m_baseFromSource = false;
+    setState(state);
+    return;
+  }
+  m_hasUncheckpointedSteps = true;
+
+  // Each layer starts from the previous layer holding most of its tiles
+  // in the same places; only the tiles that differ are written.
+  std::vector<LayerDelta> deltas;
+  deltas.reserve(state.layers.size());
+  for (const Layer &layer : state.layers) {
+    const auto &tiles = layer.tiles().tileStorage();
+
+    std::unordered_map<int, int> votes;
+    for (int i = 0; i < static_cast<int>(tiles.size()); ++i) {
+      auto found = m_tilePositions.find(tiles[i].get());
+      if (tiles[i] && found != m_tilePositions.end() &&
+          found->second.second == i) {
+        ++votes[found->second.first];
+      }
+    }
+
+    int source = -1;
+    int best = 0;
+    for (const auto &[candidate, count] : votes) {
+      if (count > best &&
+          m_state.layers[candidate].size() == layer.size()) {
+        source = candidate;
+        best = count;
+      }
+    }
+
+    LayerDelta delta{layer, source, {}};
+    for (int i = 0; i < static_cast<int>(tiles.size()); ++i) {
+      const Tile *previous =
+          source >= 0
+              ? m_state.layers[source].tiles().tileStorage()[i].get()
+              : nullptr;
+      if (tiles[i].get() != previous) {
+        delta.changedTiles.push_back(i);
+      }
+    }
+    deltas.push_back(std::move(delta));
+  }
+
+  append([text, activeLayer = state.activeLayer,
+          canvasSize = state.canvasSize, deltas = std::move(deltas)]() {
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_6_0);
+    stream << quint8(RecordType::State) << text << qint32(activeLayer)
+           << canvasSize << quint32(deltas.size());
+    for (const LayerDelta &delta : deltas) {
+      const Layer &layer = delta.layer;
+      const TiledImage &tiles = layer.tiles();
+      stream << layer.name() << layer.isVisible() << double(layer.opacity())
+             << qint32(layer.blendMode()) << layer.offset() << layer.size()
+             << qint32(delta.source) << quint32(delta.changedTiles.size());
+      for (int index : delta.changedTiles) {
+        stream << qint32(index)
+               << packTile(tiles.tile(index % tiles.columns(),
+                                      index / tiles.columns()));
+      }
+    }
+    return payload;
+  });
+  setState(state);
+}
+
+void Journal::record(const QString &text, const DocumentState &state,
+                     const EditCommand &command) {
+  // A command can only be replayed on top of a state already on disk.
+  if (!isOpen() || !m_hasBase || m_baseFromSource) {
+    record(text, state);
+    return;
+  }
+
+  QByteArray json = QJsonDocument(command.toJson()).toJson(
+      QJsonDocument::Compact);
+  append([text, json]() {
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_6_0);
+    stream << quint8(RecordType::Command) << text << json;
+    return payload;
+  });
+  setState(state);
+  m_hasUncheckpointedSteps = true;
+}
+
+void Journal::checkpoint() {
+  if (!isOpen() || !m_hasUncheckpointedSteps) {
+    return;
+  }
+  m_hasUncheckpointedSteps = false;
+
+  // Queued behind the records already made, so the state written is the
+  // one the log has reached, and later records continue from it.
+  m_pool.start([this, autosave = autosavePath(m_path),
+                state = m_state]() {
+    if (ProjectFile::save(autosave, state)) {
+      replaceWithCheckpoint(autosave);
+    }
+  });
+}
+
+void Journal::discard() {
+  m_pool.waitForDone();
+  if (isOpen()) {
+    m_file.close();
+    m_file.remove();
+    ProjectFile::remove(autosavePath(m_path));
+    m_path.clear();
+  }
+  m_sourcePath.clear();
+  m_lock.reset();
+  m_state = DocumentState();
+  m_tilePositions.clear();
+  m_hasBase = false;
+  m_baseFromSource = false;
+  m_hasUncheckpointedSteps = false;
+}
+
+QStringList Journal::orphanedJournals() {
+  QDir directory(journalDirectory());
+  QStringList orphaned;
+  const QFileInfoList journals = directory.entryInfoList(
+      {"*.journal"}, QDir::Files, QDir::Time);
+  for (const QFileInfo &info : journals) {
+    // The lock of a live session is held; one whose process is gone is
+    // stale and can be taken.
+    QLockFile lock(lockPath(info.absoluteFilePath()));
+    lock.setStaleLockTime(0);
+    if (lock.tryLock(0)) {
+      orphaned << info.absoluteFilePath();
+    }
+  }
+  return orphaned;
+}
+
+QStringList Journal::lastSessionJournals() {
+  const QStringList orphaned = orphanedJournals();
+  // Named date-time-pid-number, so the process id tells sessions apart.
+  auto session = [](const QString &path) {
+    return QFileInfo(path).completeBaseName().section('-', 2, 2);
+  };
+
+  QStringList journals;
+  for (const QString &path : orphaned) {
+    if (session(path) == session(orphaned.first())) {
+      journals << path;
+    }
+  }
+  return journals;
+}
+
+void Journal::remove(const QString &path) {
+  QFile::remove(path);
+  ProjectFile::remove(autosavePath(path));
+}
+
+bool Journal::recover(const QString &path, const RecoveredStep &step) {
+  discard();
+
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly) || file.read(Magic.size()) != Magic) {
+    return false;
+  }
+
+  DocumentState state;
+  qint64 validBytes = file.pos();
+  int steps = 0;
+  QByteArray payload;
+  while (readRecord(file, payload)) {
+    QDataStream stream(payload);
+    stream.setVersion(QDataStream::Qt_6_0);
+    quint8 type = 0;
+    QString text;
+    stream >> type >> text;
+
+    DocumentState next;
+    std::optional<EditCommand> command;
+    if (type == quint8(RecordType::Open)) {
+      QString source;
+      ProjectFile::Revision revision;
+      SourceFingerprint recorded;
+      std::shared_ptr<MappedImage> mapped;
+      stream >> source;
+      if (!stream.atEnd()) {
+        stream >> revision.indexOffset >> revision.indexBytes >>
+            revision.checksum;
+      }
+      if (!stream.atEnd()) {
+        stream >> recorded.size >> recorded.modified >> recorded.checksum;
+      }
+      // Projects are pinned to a revision; any other file has to be the
+      // one the log started from, or the steps would land on the wrong
+      // pixels.
+      if (!ProjectFile::isProjectPath(source) && recorded.size >= 0 &&
+          fingerprint(source) != recorded) {
+        break;
+      }
+      if (ProjectFile::isProjectPath(source)) {
+        std::optional<DocumentState> project =
+            ProjectFile::load(source, revision);
+        if (!project) {
+          break;
+        }
+        next = std::move(*project);
+      } else if (MappedImage::canOpen(source) &&
+                 (mapped = MappedImage::open(source))) {
+        next.layers.emplace_back(mapped->tiles(), "Background");
+        next.activeLayer = 0;
+        next.canvasSize = mapped->size();
+      } else {
+        QImageReader reader(source);
+        reader.setAutoTransform(true);
+        QImage image = reader.read();
+        if (image.isNull()) {
+          break;
+        }
+        next.layers.emplace_back(image, "Background");
+        next.activeLayer = 0;
+        next.canvasSize = image.size();
+      }
+    } else if (type == quint8(RecordType::State)) {
+      qint32 activeLayer = -1;
+      quint32 layerCount = 0;
+      stream >> activeLayer >> next.canvasSize >> layerCount;
+      next.activeLayer = activeLayer;
+      for (quint32 i = 0; i < layerCount; ++i) {
+        QString name;
+        bool visible = true;
+        double opacity = 1.0;
+        qint32 blendMode = 0;
+        QPoint offset;
+        QSize size;
+        qint32 source = -1;
+        quint32 changedCount = 0;
+        stream >> name >> visible >> opacity >> blendMode >> offset >>
+            size >> source >> changedCount;
+        if (stream.status() != QDataStream::Ok) {
+          break;
+        }
+
+        bool hasSource = source >= 0 &&
+                         source < static_cast<int>(state.layers.size()) &&
+                         state.layers[source].size() == size;
+        TiledImage tiles =
+            hasSource ? state.layers[source].tiles() : TiledImage(size);
+        for (quint32 j = 0; j < changedCount; ++j) {
+          qint32 index = 0;
+          QByteArray packed;
+          stream >> index >> packed;
+          if (index < 0 || index >= tiles.columns() * tiles.rows()) {
+            stream.setStatus(QDataStream::ReadCorruptData);
+            break;
+          }
+          const int column = index % tiles.columns();
+          const int row = index / tiles.columns();
+          tiles.setTile(column, row,
+                        unpackTile(packed,
+                                   tiles.tileRect(column, row).size()));
+        }
+
+        Layer layer(tiles, name);
+        layer.setVisible(visible);
+        layer.setOpacity(opacity);
+        layer.setBlendMode(static_cast<QPainter::CompositionMode>(blendMode));
+        layer.setOffset(offset);
+        next.layers.push_back(std::move(layer));
+      }
+    } else if (type == quint8(RecordType::Command)) {
+      QByteArray json;
+      stream >> json;
+      command = EditCommand::fromJson(QJsonDocument::fromJson(json).object());
+      if (!command) {
+        break;
+      }
+      next = state;
+      command->apply(next);
+    } else {
+      break;
+    }
+
+    if (stream.status() != QDataStream::Ok) {
+      break;
+    }
+
+    state = std::move(next);
+    step(text, state, command ? &*command : nullptr);
+    validBytes = file.pos();
+    ++steps;
+  }
+  file.close();
+
+  if (steps == 0) {
+    return false;
+  }
+
+  // Anything past the last good record is a torn write; new records go
+  // after the good ones.
+  if (!QFile::resize(path, validBytes) || !open(path, true)) {
+    return true;
+  }
+  setState(state);
+  m_hasBase = true;
+  m_hasUncheckpointedSteps = steps > 1;
+  return true;
+}
+
+bool Journal::open(const QString &path, bool resume) {
+  m_lock = std::make_unique<QLockFile>(lockPath(path));
+  m_lock->setStaleLockTime(0);
+  if (!m_lock->tryLock(0)) {
+    m_lock.reset();
+    return false;
+  }
+
+  m_file.setFileName(path);
+  QIODevice::OpenMode mode = QIODevice::WriteOnly | QIODevice::Truncate;
+  if (resume) {
+    mode = QIODevice::Append;
+  }
+  if (!m_file.open(mode)) {
+    m_lock.reset();
+    return false;
+  }
+  if (!resume) {
+    m_file.write(Magic);
+  }
+  m_path = path;
+  return true;
+}
+
+void Journal::replaceWithCheckpoint(const QString &autosavePath) {
+  // The new log replaces the old one in a single rename. Until then a
+  // crash recovers from the old log, whose base is an earlier revision of
+  // the autosave that appending left intact; only a save that compacted
+  // the autosave invalidates it.
+  QSaveFile next(m_file.fileName());
+  if (!next.open(QIODevice::WriteOnly)) {
+    return;
+  }
+  next.write(Magic);
+  next.write(frame(openRecord(autosavePath)));
+  if (!next.commit()) {
+    return;
+  }
+
+  m_file.close();
+  m_file.open(QIODevice::Append);
+}
+
+QByteArray Journal::openRecord(const QString &sourcePath) {
+  ProjectFile::Revision revision;
+  SourceFingerprint source;
+  if (ProjectFile::isProjectPath(sourcePath)) {
+    revision = ProjectFile::revision(sourcePath).value_or(revision);
+  } else {
+    source = fingerprint(sourcePath);
+  }
+
+  QByteArray payload;
+  QDataStream stream(&payload, QIODevice::WriteOnly);
+  stream.setVersion(QDataStream::Qt_6_0);
+  stream << quint8(RecordType::Open) << QString() << sourcePath
+         << revision.indexOffset << revision.indexBytes << revision.checksum
+         << source.size << source.modified << source.checksum;
+  return payload;
+}
+
+void Journal::setState(const DocumentState &state) {
+  m_state = state;
+  m_hasBase = true;
+
+  m_tilePositions.clear();
+  for (int layer = 0; layer < static_cast<int>(m_state.layers.size());
+       ++layer) {
+    const auto &tiles = m_state.layers[layer].tiles().tileStorage();
+    for (int i = 0; i < static_cast<int>(tiles.size()); ++i) {
+      if (tiles[i]) {
+        m_tilePositions[tiles[i].get()] = {layer, i};
+      }
+    }
+  }
+}
+
+void Journal::append(std::function<QByteArray()> payload) {
+  m_pool.start([this, payload = std::move(payload)]() {
+    // Flushed to the OS per record, so a crash of the editor itself loses
+    // at most the step being written. Only checkpoints are synced to disk.
+    m_file.write(frame(payload()));
+    m_file.flush();
+  });
+}
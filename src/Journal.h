@@ -0,0 +1,97 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "EditCommand.h"
+
+#include <QFile>
+#include <QLockFile>
+#include <QString>
+#include <QStringList>
+#include <QThreadPool>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+class Tile;
+
+// Append-only crash-recovery log of the open document. Each history step
+// is streamed to disk as it happens: whole-image commands as their
+// parameters, everything else as the layer stack plus the tiles that
+// changed since the previous step. Compression and writes run on a
+// private thread, so an edit only pays for comparing tile tables.
+//
+// A checkpoint folds the log into an autosave project kept next to it
+// and restarts the log from there. The autosave only receives tiles it
+// does not hold yet, and both files are synced to disk, so a checkpoint
+// costs about as much as the edits since the previous one.
+class Journal {
+public:
+  using RecoveredStep = std::function<void(
+      const QString &text, const DocumentState &state,
+      const EditCommand *command)>;
+
+  Journal();
+  ~Journal();
+
+  Journal(const Journal &) = delete;
+  Journal &operator=(const Journal &) = delete;
+
+  bool isOpen() const;
+  // Whether the journal started from the file at path, which a save over
+  // that file invalidates.
+  bool readsFrom(const QString &path) const;
+
+  // Starts a new journal for a document decoded from sourcePath. The first
+  // state recorded after this is that image and is not written. Recording
+  // without a started journal starts one and writes the state in full.
+  void start(const QString &sourcePath);
+  void record(const QString &text, const DocumentState &state);
+  void record(const QString &text, const DocumentState &state,
+              const EditCommand &command);
+  // Writes the last recorded state to the autosave in the background.
+  // Does nothing if no step was recorded since the previous checkpoint.
+  void checkpoint();
+  // Closes the journal and deletes it, e.g. once the document is closed.
+  void discard();
+
+  // Journals left behind by sessions that did not shut down, newest first.
+  static QStringList orphanedJournals();
+  // The orphaned journals of the newest such session, one per document it
+  // had open.
+  static QStringList lastSessionJournals();
+  static void remove(const QString &path);
+
+  // Rebuilds the steps stored in path, calling step for each in order, and
+  // carries on appending to that file. Reading stops at the first damaged
+  // record, which is where a crash interrupted a write.
+  bool recover(const QString &path, const RecoveredStep &step);
+
+private:
+  enum class RecordType : quint8 { Open, State, Command };
+
+  bool open(const QString &path, bool resume);
+  void replaceWithCheckpoint(const QString &autosavePath);
+  // The first record of a log: the file its base state is read from.
+  static QByteArray openRecord(const QString &sourcePath);
+  void setState(const DocumentState &state);
+  void append(std::function<QByteArray()> payload);
+
+  QThreadPool m_pool;
+  // Written by the pool thread only, apart from open() and discard(),
+  // which run while the pool is idle; a checkpoint reopens it.
+  QFile m_file;
+  // The log's path while one is open. Only the GUI thread touches it.
+  QString m_path;
+  // The file start() was given, if any.
+  QString m_sourcePath;
+  std::unique_ptr<QLockFile> m_lock;
+  DocumentState m_state;
+  // Where each tile of m_state sits, as (layer, tile index).
+  std::unordered_map<const Tile *, std::pair<int, int>> m_tilePositions;
+  bool m_hasBase;
+  bool m_baseFromSource;
+  bool m_hasUncheckpointedSteps;
+};
+
+#endif
@@ -1,21 +1,34 @@
 #include "Layer.h"
 
 Layer::Layer(const QImage &image, const QString &name)
-    : m_image(image), m_name(name), m_visible(true), m_opacity(1.0),
-      m_blendMode(QPainter::CompositionMode_SourceOver) {
-  if (m_image.format() != QImage::Format_ARGB32_Premultiplied) {
-    m_image = m_image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
-  }
-}
+    : m_tiles(image), m_offset(), m_name(name), m_visible(true), m_opacity(1.0),
+      m_blendMode(QPainter::CompositionMode_SourceOver) {}
 
-const QImage &Layer::image() const { return m_image; }
+Layer::Layer(const QSize &size, const QString &name)
+    : m_tiles(size), m_offset(), m_name(name), m_visible(true), m_opacity(1.0),
+      m_blendMode(QPainter::CompositionMode_SourceOver) {}
 
-void Layer::setImage(const QImage &image) {
-  m_image = image;
-  if (m_image.format() != QImage::Format_ARGB32_Premultiplied) {
-    m_image = m_image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
-  }
-}
+Layer::Layer(const TiledImage &tiles, const QString &name)
+    : m_tiles(tiles), m_offset(), m_name(name), m_visible(true), m_opacity(1.0),
+      m_blendMode(QPainter::CompositionMode_SourceOver) {}
+
+QImage Layer::image() const { return m_tiles.toImage(); }
+
+void Layer::setImage(const QImage &image) { m_tiles.setImage(image); }
+
+TiledImage &Layer::tiles() { return m_tiles; }
+
+const TiledImage &Layer::tiles() const { return m_tiles; }
+
+QSize Layer::size() const { return m_tiles.size(); }
+
+QRect Layer::bounds() const { return m_tiles.bounds().translated(m_offset); }
+
+QPoint Layer::offset() const { return m_offset; }
+
+void Layer::setOffset(const QPoint &offset) { m_offset = offset; }
+
+QRect Layer::rect() const { return m_tiles.rect().translated(m_offset); }
 
 QString Layer::name() const { return m_name; }
 
@@ -36,11 +49,29 @@ QPainter::CompositionMode Layer::blendMode() const { return m_blendMode; }
 void Layer::setBlendMode(QPainter::CompositionMode mode) { m_blendMode = mode; }
 
 void Layer::render(QPainter &painter, const QRect &targetRect) const {
-  if (!m_visible || qFuzzyIsNull(m_opacity) || m_image.isNull()) {
+  render(painter, targetRect, rect());
+}
+
+void Layer::render(QPainter &painter, const QRect &targetRect,
+                   const QRect &canvasRect) const {
+  if (!m_visible || qFuzzyIsNull(m_opacity) || m_tiles.isNull() ||
+      canvasRect.isEmpty()) {
     return;
   }
 
+  // Only the part of the requested canvas area this layer covers is drawn.
+  QRect area = canvasRect.intersected(rect());
+  if (area.isEmpty()) {
+    return;
+  }
+
+  const qreal scaleX = targetRect.width() / qreal(canvasRect.width());
+  const qreal scaleY = targetRect.height() / qreal(canvasRect.height());
+  QRectF target(targetRect.x() + (area.x() - canvasRect.x()) * scaleX,
+                targetRect.y() + (area.y() - canvasRect.y()) * scaleY,
+                area.width() * scaleX, area.height() * scaleY);
+
   painter.setOpacity(m_opacity);
   painter.setCompositionMode(m_blendMode);
-  painter.drawImage(targetRect, m_image);
+  m_tiles.render(painter, target, area.translated(-m_offset));
 }
@@ -1,6 +1,8 @@
 #ifndef LAYER_H
 #define LAYER_H
 
+#include "TiledImage.h"
+
 #include <QImage>
 #include <QPainter>
 #include <QString>
@@ -8,11 +10,25 @@
 class Layer {
 public:
     Layer(const QImage& image, const QString& name = "Layer");
+    Layer(const QSize& size, const QString& name = "Layer");
+    Layer(const TiledImage& tiles, const QString& name = "Layer");
     ~Layer() = default;
 
-    const QImage& image() const;
+    QImage image() const;
     void setImage(const QImage& image);
 
+    TiledImage& tiles();
+    const TiledImage& tiles() const;
+
+    QSize size() const;
+    QRect bounds() const;
+
+    // Position of the layer's top-left pixel on the canvas. rect() and
+    // bounds() are in canvas coordinates.
+    QPoint offset() const;
+    void setOffset(const QPoint& offset);
+    QRect rect() const;
+
     QString name() const;
     void setName(const QString& name);
 
@@ -26,9 +42,12 @@ public:
     void setBlendMode(QPainter::CompositionMode mode);
 
     void render(QPainter& painter, const QRect& targetRect) const;
+    void render(QPainter& painter, const QRect& targetRect,
+                const QRect& canvasRect) const;
 
 private:
-    QImage m_image;
+    TiledImage m_tiles;
+    QPoint m_offset;
     QString m_name;
     bool m_visible;
     qreal m_opacity;
@@ -2,26 +2,43 @@
 #include "AdjustmentsPanel.h"
 #include "ColorPanel.h"
 #include "ImageCanvas.h"
+#include "Journal.h"
 #include "LayersPanel.h"
 #include "ResizeDialog.h"
 #include "RotateDialog.h"
+#include "TileCache.h"
 
+#include <QActionGroup>
+#include <QClipboard>
 #include <QCloseEvent>
 #include <QDockWidget>
 #include <QFileDialog>
+#include <QFileInfo>
+#include <QGuiApplication>
 #include <QKeyEvent>
 #include <QLabel>
 #include <QMenuBar>
 #include <QMessageBox>
+#include <QProgressBar>
+#include <QTabWidget>
 #include <QStatusBar>
+#include <QTimer>
+#include <utility>
+
+namespace {
+
+constexpr int StrokePredictionMsecs = 16;
+
+} // namespace
 
 MainWindow::MainWindow(QWidget *parent)
-    : QMainWindow(parent), m_canvas(new ImageCanvas(this)),
-      m_adjustmentsPanel(nullptr), m_layersPanel(nullptr),
+    : QMainWindow(parent), m_tabs(new QTabWidget(this)), m_canvas(nullptr),
+      m_documents(), m_adjustmentsPanel(nullptr), m_layersPanel(nullptr),
       m_colorPanel(nullptr), m_adjustmentsDock(nullptr), m_layersDock(nullptr),
       m_colorDock(nullptr), m_statusLabel(new QLabel(this)),
-      m_zoomLabel(new QLabel(this)), m_currentFilePath(), m_isModified(false),
-      m_zoomInAction(nullptr), m_zoomOutAction(nullptr),
+      m_zoomLabel(new QLabel(this)), m_saveProgress(new QProgressBar(this)),
+      m_undoAction(nullptr), m_redoAction(nullptr), m_zoomInAction(nullptr),
+      m_zoomOutAction(nullptr),
       m_fitToWindowAction(nullptr), m_actualSizeAction(nullptr),
       m_resizeAction(nullptr), m_cropAction(nullptr),
       m_rotate90CWAction(nullptr), m_rotate90CCWAction(nullptr),
@@ -31,35 +48,183 @@ MainWindow::MainWindow(QWidget *parent)
       m_filterGrayscaleAction(nullptr), m_filterSepiaAction(nullptr),
       m_filterInvertAction(nullptr), m_filterBlurAction(nullptr),
       m_filterSharpenAction(nullptr), m_toolBrushAction(nullptr),
-      m_toolEraserAction(nullptr) {
-  setCentralWidget(m_canvas);
+      m_toolEraserAction(nullptr), m_toolFillAction(nullptr),
+      m_toolGradientAction(nullptr) {
+  m_tabs->setDocumentMode(true);
+  m_tabs->setTabsClosable(true);
+  m_tabs->setMovable(true);
+  setCentralWidget(m_tabs);
   setMinimumSize(800, 600);
   resize(1200, 800);
 
+  // The menus read their initial settings from the first document.
+  m_canvas = addDocument();
   setupMenuBar();
   setupStatusBar();
   setupDockWidgets();
   updateWindowTitle();
 
-  connect(m_canvas, &ImageCanvas::imageLoaded, this,
-          &MainWindow::onImageLoaded);
-  connect(m_canvas, &ImageCanvas::imageModified, this,
-          &MainWindow::onImageModified);
-  connect(m_canvas, &ImageCanvas::zoomChanged, this,
-          &MainWindow::onZoomChanged);
-  connect(m_canvas, &ImageCanvas::cropModeChanged, this,
-          &MainWindow::onCropModeChanged);
-  connect(m_canvas, &ImageCanvas::adjustmentModeChanged, this,
-          &MainWindow::onAdjustmentModeChanged);
-
-  connect(m_canvas, &ImageCanvas::activeLayerChanged, this,
-          &MainWindow::onActiveLayerChanged);
-  connect(m_canvas, &ImageCanvas::layerAdded, m_layersPanel,
-          &LayersPanel::addLayer);
-  connect(m_canvas, &ImageCanvas::layerRemoved, m_layersPanel,
-          [this](int index) { m_layersPanel->updateLayer(index, "", false); });
+  connect(m_tabs, &QTabWidget::currentChanged, this,
+          &MainWindow::onCurrentTabChanged);
+  connect(m_tabs, &QTabWidget::tabCloseRequested, this,
+          &MainWindow::onTabCloseRequested);
+
+  // Offered once the window is up, so the question has a parent to show on.
+  QTimer::singleShot(0, this, &MainWindow::onRecoverWork);
+}
+
+ImageCanvas *MainWindow::addDocument() {
+  auto *canvas = new ImageCanvas(m_tabs);
+  // Settings from the menus apply to every document.
+  if (m_canvas) {
+    canvas->setHistoryLimit(m_canvas->historyLimit());
+    canvas->setFillTolerance(m_canvas->fillTolerance());
+    canvas->setFillContiguous(m_canvas->fillContiguous());
+    canvas->setGradientShape(m_canvas->gradientShape());
+    canvas->setStabilizerMode(m_canvas->stabilizerMode());
+    canvas->setStabilizerStrength(m_canvas->stabilizerStrength());
+    canvas->setStrokePrediction(m_canvas->strokePrediction());
+    canvas->setToolMode(m_canvas->toolMode());
+  }
+  m_documents.insert(canvas, Document());
+
+  connect(canvas, &ImageCanvas::imageLoaded, this,
+          [this, canvas](const QString &path) { onImageLoaded(canvas, path); });
+  connect(canvas, &ImageCanvas::loadFailed, this,
+          [this, canvas](const QString &path) { onLoadFailed(canvas, path); });
+  connect(canvas, &ImageCanvas::imageModified, this,
+          [this, canvas]() { onImageModified(canvas); });
+  connect(canvas, &ImageCanvas::imageSaved, this,
+          [this, canvas](const QString &path) { onImageSaved(canvas, path); });
+  connect(canvas, &ImageCanvas::saveFailed, this,
+          [this, canvas](const QString &path) { onSaveFailed(canvas, path); });
+
+  // The rest only shows for the document on screen; switching tabs
+  // refreshes it.
+  connect(canvas, &ImageCanvas::saveProgress, this, [this, canvas](int value) {
+    if (canvas == m_canvas) {
+      m_saveProgress->setValue(value);
+    }
+  });
+  connect(canvas, &ImageCanvas::zoomChanged, this, [this, canvas](qreal level) {
+    if (canvas == m_canvas) {
+      onZoomChanged(level);
+    }
+  });
+  connect(canvas, &ImageCanvas::cropModeChanged, this,
+          [this, canvas](bool cropping) {
+            if (canvas == m_canvas) {
+              onCropModeChanged(cropping);
+            }
+          });
+  connect(canvas, &ImageCanvas::adjustmentModeChanged, this,
+          [this, canvas](bool adjusting) {
+            if (canvas == m_canvas) {
+              onAdjustmentModeChanged(adjusting);
+            }
+          });
+  connect(canvas, &ImageCanvas::historyChanged, this, [this, canvas]() {
+    if (canvas == m_canvas) {
+      updateHistoryActions();
+      updateImageActions();
+    }
+  });
+  connect(canvas, &ImageCanvas::layersReset, this, [this, canvas]() {
+    if (canvas == m_canvas) {
+      onLayersReset();
+    }
+  });
+  connect(canvas, &ImageCanvas::activeLayerChanged, this,
+          [this, canvas](int index) {
+            if (canvas == m_canvas) {
+              onActiveLayerChanged(index);
+            }
+          });
+  connect(canvas, &ImageCanvas::layerAdded, this,
+          [this, canvas](const QString &name, bool visible) {
+            if (canvas == m_canvas) {
+              m_layersPanel->addLayer(name, visible);
+            }
+          });
+  connect(canvas, &ImageCanvas::layerRemoved, this, [this, canvas]() {
+    if (canvas == m_canvas) {
+      m_layersPanel->clear();
+    }
+  });
+
+  m_tabs->setCurrentIndex(m_tabs->addTab(canvas, QString()));
+  updateTabTitle(canvas);
+  return canvas;
 }
 
+ImageCanvas *MainWindow::documentForOpening() {
+  if (!m_canvas->hasImage() && !m_canvas->isLoading()) {
+    return m_canvas;
+  }
+  return addDocument();
+}
+
+ImageCanvas *MainWindow::canvasAt(int index) const {
+  return qobject_cast<ImageCanvas *>(m_tabs->widget(index));
+}
+
+void MainWindow::closeDocument(int index) {
+  ImageCanvas *canvas = canvasAt(index);
+  if (!canvas || !maybeSave(canvas)) {
+    return;
+  }
+
+  // Waits for a running save and deletes the document's journal.
+  canvas->clearProject();
+  if (m_tabs->count() == 1) {
+    m_documents[canvas] = Document();
+    m_adjustmentsDock->setVisible(false);
+    m_layersPanel->clear();
+    updateTabTitle(canvas);
+    updateWindowTitle();
+    updateStatusBar();
+    updateViewActions();
+    updateImageActions();
+    return;
+  }
+
+  // The tab that becomes current is not asked to move to the background.
+  if (canvas == m_canvas) {
+    m_canvas = nullptr;
+  }
+  m_documents.remove(canvas);
+  m_tabs->removeTab(m_tabs->indexOf(canvas));
+  canvas->deleteLater();
+}
+
+void MainWindow::onCurrentTabChanged(int index) {
+  ImageCanvas *canvas = canvasAt(index);
+  if (!canvas || canvas == m_canvas) {
+    return;
+  }
+
+  if (m_canvas) {
+    // Adjustment previews do not survive a tab switch.
+    if (m_canvas->isAdjusting()) {
+      m_canvas->cancelAdjustments();
+      m_adjustmentsPanel->reset();
+    }
+    m_canvas->moveToBackground();
+  }
+  m_canvas = canvas;
+
+  m_adjustmentsDock->setVisible(false);
+  m_saveProgress->setVisible(m_canvas->isSaving());
+  onLayersReset();
+  onZoomChanged(m_canvas->zoomLevel());
+  updateWindowTitle();
+  updateViewActions();
+  updateHistoryActions();
+  updateToolActions();
+}
+
+void MainWindow::onTabCloseRequested(int index) { closeDocument(index); }
+
 void MainWindow::setupMenuBar() {
   QMenu *fileMenu = menuBar()->addMenu(tr("&File"));
 
@@ -81,6 +246,10 @@ void MainWindow::setupMenuBar() {
   saveAsAction->setShortcut(QKeySequence::SaveAs);
   connect(saveAsAction, &QAction::triggered, this, &MainWindow::onSaveFileAs);
 
+  QAction *exportRecipeAction = fileMenu->addAction(tr("Export &Recipe..."));
+  connect(exportRecipeAction, &QAction::triggered, this,
+          &MainWindow::onExportRecipe);
+
   fileMenu->addSeparator();
 
   QAction *closeAction = fileMenu->addAction(tr("&Close"));
@@ -93,13 +262,71 @@ void MainWindow::setupMenuBar() {
 
   QMenu *editMenu = menuBar()->addMenu(tr("&Edit"));
 
-  QAction *undoAction = editMenu->addAction(tr("&Undo"));
-  undoAction->setShortcut(QKeySequence::Undo);
-  undoAction->setEnabled(false);
+  m_undoAction = editMenu->addAction(tr("&Undo"));
+  m_undoAction->setShortcut(QKeySequence::Undo);
+  m_undoAction->setEnabled(false);
+  connect(m_undoAction, &QAction::triggered, this,
+          [this]() { m_canvas->undo(); });
+
+  m_redoAction = editMenu->addAction(tr("&Redo"));
+  m_redoAction->setShortcut(QKeySequence::Redo);
+  m_redoAction->setEnabled(false);
+  connect(m_redoAction, &QAction::triggered, this,
+          [this]() { m_canvas->redo(); });
+
+  editMenu->addSeparator();
+
+  QAction *pasteLayerAction = editMenu->addAction(tr("Paste as New &Layer"));
+  pasteLayerAction->setShortcut(QKeySequence(Qt::CTRL | Qt::SHIFT | Qt::Key_V));
+  connect(pasteLayerAction, &QAction::triggered, this,
+          &MainWindow::onPasteAsNewLayer);
+
+  editMenu->addSeparator();
+
+  // One budget covers every open document. Tiles beyond it are compressed
+  // and then swapped to disk, background documents first, then least
+  // recently used.
+  QMenu *memoryMenu = editMenu->addMenu(tr("&Memory Budget"));
+  auto *memoryGroup = new QActionGroup(this);
+
+  const std::pair<QString, qsizetype> memoryBudgets[] = {
+      {tr("&512 MB"), qsizetype(512) << 20},
+      {tr("&1 GB"), qsizetype(1) << 30},
+      {tr("&2 GB"), qsizetype(2) << 30},
+      {tr("&4 GB"), qsizetype(4) << 30},
+      {tr("&Unlimited"), 0}};
+
+  for (const auto &[label, bytes] : memoryBudgets) {
+    QAction *action = memoryMenu->addAction(label);
+    action->setCheckable(true);
+    action->setChecked(bytes == TileCache::instance().budget());
+    memoryGroup->addAction(action);
+    connect(action, &QAction::triggered, this, [bytes = bytes]() {
+      TileCache::instance().setBudget(bytes);
+      TileCache::instance().trim();
+    });
+  }
 
-  QAction *redoAction = editMenu->addAction(tr("&Redo"));
-  redoAction->setShortcut(QKeySequence::Redo);
-  redoAction->setEnabled(false);
+  QMenu *historyMenu = editMenu->addMenu(tr("&History Limit"));
+  auto *historyGroup = new QActionGroup(this);
+
+  const std::pair<QString, qsizetype> historyLimits[] = {
+      {tr("&256 MB"), qsizetype(256) << 20},
+      {tr("&512 MB"), qsizetype(512) << 20},
+      {tr("&1 GB"), qsizetype(1) << 30},
+      {tr("&2 GB"), qsizetype(2) << 30}};
+
+  for (const auto &[label, bytes] : historyLimits) {
+    QAction *action = historyMenu->addAction(label);
+    action->setCheckable(true);
+    action->setChecked(bytes == m_canvas->historyLimit());
+    historyGroup->addAction(action);
+    connect(action, &QAction::triggered, this, [this, bytes = bytes]() {
+      for (int i = 0; i < m_tabs->count(); ++i) {
+        canvasAt(i)->setHistoryLimit(bytes);
+      }
+    });
+  }
 
   QMenu *imageMenu = menuBar()->addMenu(tr("&Image"));
 
@@ -231,6 +458,22 @@ void MainWindow::setupMenuBar() {
   connect(m_actualSizeAction, &QAction::triggered, this,
           &MainWindow::onActualSize);
 
+  viewMenu->addSeparator();
+
+  QAction *nextDocumentAction = viewMenu->addAction(tr("&Next Document"));
+  nextDocumentAction->setShortcut(QKeySequence::NextChild);
+  connect(nextDocumentAction, &QAction::triggered, this, [this]() {
+    m_tabs->setCurrentIndex((m_tabs->currentIndex() + 1) % m_tabs->count());
+  });
+
+  QAction *previousDocumentAction =
+      viewMenu->addAction(tr("&Previous Document"));
+  previousDocumentAction->setShortcut(QKeySequence::PreviousChild);
+  connect(previousDocumentAction, &QAction::triggered, this, [this]() {
+    m_tabs->setCurrentIndex((m_tabs->currentIndex() + m_tabs->count() - 1) %
+                            m_tabs->count());
+  });
+
   QMenu *toolsMenu = menuBar()->addMenu(tr("&Tools"));
 
   m_toolBrushAction = toolsMenu->addAction(tr("&Brush"));
@@ -244,6 +487,116 @@ void MainWindow::setupMenuBar() {
   m_toolEraserAction->setCheckable(true);
   connect(m_toolEraserAction, &QAction::triggered, this,
           &MainWindow::onToolEraser);
+
+  m_toolFillAction = toolsMenu->addAction(tr("&Fill"));
+  m_toolFillAction->setShortcut(QKeySequence(Qt::Key_G));
+  m_toolFillAction->setCheckable(true);
+  connect(m_toolFillAction, &QAction::triggered, this,
+          &MainWindow::onToolFill);
+
+  QAction *contiguousAction = toolsMenu->addAction(tr("Fill &Contiguous"));
+  contiguousAction->setCheckable(true);
+  contiguousAction->setChecked(true);
+  connect(contiguousAction, &QAction::toggled, this, [this](bool checked) {
+    for (int i = 0; i < m_tabs->count(); ++i) {
+      canvasAt(i)->setFillContiguous(checked);
+    }
+  });
+
+  QMenu *toleranceMenu = toolsMenu->addMenu(tr("Fill &Tolerance"));
+  auto *toleranceGroup = new QActionGroup(this);
+
+  const std::pair<QString, int> fillTolerances[] = {
+      {tr("&Exact"), 0}, {tr("&Low"), 16}, {tr("&Medium"), 32},
+      {tr("&High"), 64}, {tr("&Very High"), 128}};
+
+  for (const auto &[label, tolerance] : fillTolerances) {
+    QAction *action = toleranceMenu->addAction(label);
+    action->setCheckable(true);
+    action->setChecked(tolerance == m_canvas->fillTolerance());
+    toleranceGroup->addAction(action);
+    connect(action, &QAction::triggered, this, [this, tolerance = tolerance]() {
+      for (int i = 0; i < m_tabs->count(); ++i) {
+        canvasAt(i)->setFillTolerance(tolerance);
+      }
+    });
+  }
+
+  m_toolGradientAction = toolsMenu->addAction(tr("&Gradient"));
+  m_toolGradientAction->setShortcut(QKeySequence(Qt::SHIFT | Qt::Key_G));
+  m_toolGradientAction->setCheckable(true);
+  connect(m_toolGradientAction, &QAction::triggered, this,
+          &MainWindow::onToolGradient);
+
+  QMenu *gradientMenu = toolsMenu->addMenu(tr("Gradient S&hape"));
+  auto *gradientGroup = new QActionGroup(this);
+
+  const std::pair<QString, GradientTool::Shape> gradientShapes[] = {
+      {tr("&Linear"), GradientTool::Shape::Linear},
+      {tr("&Radial"), GradientTool::Shape::Radial},
+      {tr("&Angular"), GradientTool::Shape::Angular}};
+
+  for (const auto &[label, shape] : gradientShapes) {
+    QAction *action = gradientMenu->addAction(label);
+    action->setCheckable(true);
+    action->setChecked(shape == m_canvas->gradientShape());
+    gradientGroup->addAction(action);
+    connect(action, &QAction::triggered, this, [this, shape = shape]() {
+      for (int i = 0; i < m_tabs->count(); ++i) {
+        canvasAt(i)->setGradientShape(shape);
+      }
+    });
+  }
+
+  toolsMenu->addSeparator();
+
+  QMenu *stabilizerMenu = toolsMenu->addMenu(tr("&Stabilizer"));
+  auto *stabilizerGroup = new QActionGroup(this);
+
+  const std::pair<QString, StrokeStabilizer::Mode> stabilizerModes[] = {
+      {tr("&Off"), StrokeStabilizer::Mode::None},
+      {tr("&Pulled String"), StrokeStabilizer::Mode::PulledString},
+      {tr("&Adaptive (One Euro)"), StrokeStabilizer::Mode::OneEuro}};
+
+  for (const auto &[label, mode] : stabilizerModes) {
+    QAction *action = stabilizerMenu->addAction(label);
+    action->setCheckable(true);
+    action->setChecked(mode == m_canvas->stabilizerMode());
+    stabilizerGroup->addAction(action);
+    connect(action, &QAction::triggered, this, [this, mode = mode]() {
+      for (int i = 0; i < m_tabs->count(); ++i) {
+        canvasAt(i)->setStabilizerMode(mode);
+      }
+    });
+  }
+
+  stabilizerMenu->addSeparator();
+
+  QMenu *strengthMenu = stabilizerMenu->addMenu(tr("S&trength"));
+  auto *strengthGroup = new QActionGroup(this);
+
+  const std::pair<QString, qreal> stabilizerStrengths[] = {
+      {tr("&Light"), 0.25}, {tr("&Medium"), 0.5}, {tr("&Strong"), 0.85}};
+
+  for (const auto &[label, strength] : stabilizerStrengths) {
+    QAction *action = strengthMenu->addAction(label);
+    action->setCheckable(true);
+    action->setChecked(qFuzzyCompare(strength, m_canvas->stabilizerStrength()));
+    strengthGroup->addAction(action);
+    connect(action, &QAction::triggered, this, [this, strength = strength]() {
+      for (int i = 0; i < m_tabs->count(); ++i) {
+        canvasAt(i)->setStabilizerStrength(strength);
+      }
+    });
+  }
+
+  QAction *predictionAction = stabilizerMenu->addAction(tr("P&redict Stroke"));
+  predictionAction->setCheckable(true);
+  connect(predictionAction, &QAction::toggled, this, [this](bool enabled) {
+    for (int i = 0; i < m_tabs->count(); ++i) {
+      canvasAt(i)->setStrokePrediction(enabled ? StrokePredictionMsecs : 0);
+    }
+  });
 }
 
 void MainWindow::setupStatusBar() {
@@ -254,6 +607,12 @@ void MainWindow::setupStatusBar() {
   m_zoomLabel->setMinimumWidth(60);
   m_zoomLabel->setAlignment(Qt::AlignRight | Qt::AlignVCenter);
   statusBar()->addPermanentWidget(m_zoomLabel);
+
+  m_saveProgress->setRange(0, 100);
+  m_saveProgress->setFormat(tr("Saving %p%"));
+  m_saveProgress->setMaximumWidth(160);
+  m_saveProgress->hide();
+  statusBar()->addPermanentWidget(m_saveProgress);
 }
 
 void MainWindow::setupDockWidgets() {
@@ -291,28 +650,28 @@ void MainWindow::setupDockWidgets() {
   m_layersDock->setVisible(false);
   addDockWidget(Qt::RightDockWidgetArea, m_layersDock);
 
-  connect(m_layersPanel, &LayersPanel::activeLayerChanged, m_canvas,
-          &ImageCanvas::setActiveLayer);
-  connect(m_layersPanel, &LayersPanel::layerVisibilityChanged, m_canvas,
-          &ImageCanvas::setLayerVisibility);
-  connect(m_layersPanel, &LayersPanel::layerOpacityChanged, m_canvas,
-          &ImageCanvas::setLayerOpacity);
-  connect(m_layersPanel, &LayersPanel::layerBlendModeChanged, m_canvas,
-          &ImageCanvas::setLayerBlendMode);
-
-  connect(m_layersPanel, &LayersPanel::layerRemoved, m_canvas,
-          &ImageCanvas::removeLayer);
-  connect(m_layersPanel, &LayersPanel::layerMovedUp, m_canvas,
-          &ImageCanvas::moveLayerUp);
-  connect(m_layersPanel, &LayersPanel::layerMovedDown, m_canvas,
-          &ImageCanvas::moveLayerDown);
-
-  connect(m_canvas, &ImageCanvas::layerAdded, m_layersPanel,
-          &LayersPanel::addLayer);
-  connect(m_canvas, &ImageCanvas::layerRemoved, [this](int index) {
-    Q_UNUSED(index);
-    m_layersPanel->clear();
-  });
+  // The panel always edits the document in the current tab.
+  connect(m_layersPanel, &LayersPanel::activeLayerChanged, this,
+          [this](int index) { m_canvas->setActiveLayer(index); });
+  connect(m_layersPanel, &LayersPanel::layerVisibilityChanged, this,
+          [this](int index, bool visible) {
+            m_canvas->setLayerVisibility(index, visible);
+          });
+  connect(m_layersPanel, &LayersPanel::layerOpacityChanged, this,
+          [this](int index, qreal opacity) {
+            m_canvas->setLayerOpacity(index, opacity);
+          });
+  connect(m_layersPanel, &LayersPanel::layerBlendModeChanged, this,
+          [this](int index, int mode) {
+            m_canvas->setLayerBlendMode(index, mode);
+          });
+
+  connect(m_layersPanel, &LayersPanel::layerRemoved, this,
+          [this](int index) { m_canvas->removeLayer(index); });
+  connect(m_layersPanel, &LayersPanel::layerMovedUp, this,
+          [this](int index) { m_canvas->moveLayerUp(index); });
+  connect(m_layersPanel, &LayersPanel::layerMovedDown, this,
+          [this](int index) { m_canvas->moveLayerDown(index); });
 
   connect(m_layersDock, &QDockWidget::visibilityChanged,
           [this](bool visible) { m_layersAction->setChecked(visible); });
@@ -327,23 +686,43 @@ void MainWindow::setupDockWidgets() {
 
   connect(m_colorPanel, &ColorPanel::foregroundColorChanged, this,
           &MainWindow::onForegroundColorChanged);
+  connect(m_colorPanel, &ColorPanel::backgroundColorChanged, this,
+          [this](const QColor &color) {
+            m_canvas->setToolBackgroundColor(color);
+          });
 }
 
 void MainWindow::updateWindowTitle() {
+  const Document document = m_documents.value(m_canvas);
   QString title = "Picture";
 
-  if (!m_currentFilePath.isEmpty()) {
-    QFileInfo info(m_currentFilePath);
+  if (!document.filePath.isEmpty()) {
+    QFileInfo info(document.filePath);
     title = info.fileName() + " - Picture";
   }
 
-  if (m_isModified) {
+  if (document.isModified) {
     title.prepend("* ");
   }
 
   setWindowTitle(title);
 }
 
+void MainWindow::updateTabTitle(ImageCanvas *canvas) {
+  const Document document = m_documents.value(canvas);
+  QString title = document.filePath.isEmpty()
+                      ? tr("Untitled")
+                      : QFileInfo(document.filePath).fileName();
+
+  if (document.isModified) {
+    title.prepend("* ");
+  }
+
+  const int index = m_tabs->indexOf(canvas);
+  m_tabs->setTabText(index, title);
+  m_tabs->setTabToolTip(index, document.filePath);
+}
+
 void MainWindow::updateStatusBar() {
   if (m_canvas->hasImage()) {
     QSize size = m_canvas->imageSize();
@@ -365,27 +744,28 @@ void MainWindow::updateViewActions() {
 }
 
 void MainWindow::updateImageActions() {
-  bool hasImage = m_canvas->hasImage();
+  // The document is left alone while an undo or redo rebuilds it.
+  bool editable = m_canvas->hasImage() && !m_canvas->isReplaying();
   bool notCropping = !m_canvas->isCropping();
   bool notAdjusting = !m_canvas->isAdjusting();
 
-  m_resizeAction->setEnabled(hasImage && notCropping && notAdjusting);
-  m_cropAction->setEnabled(hasImage && notAdjusting);
-  m_adjustmentsAction->setEnabled(hasImage && notCropping);
-  m_layersAction->setEnabled(hasImage);
+  m_resizeAction->setEnabled(editable && notCropping && notAdjusting);
+  m_cropAction->setEnabled(editable && notAdjusting);
+  m_adjustmentsAction->setEnabled(editable && notCropping);
+  m_layersAction->setEnabled(editable);
 
-  m_rotate90CWAction->setEnabled(hasImage && notCropping && notAdjusting);
-  m_rotate90CCWAction->setEnabled(hasImage && notCropping && notAdjusting);
-  m_rotate180Action->setEnabled(hasImage && notCropping && notAdjusting);
-  m_rotateArbitraryAction->setEnabled(hasImage && notCropping && notAdjusting);
-  m_flipHorizontalAction->setEnabled(hasImage && notCropping && notAdjusting);
-  m_flipVerticalAction->setEnabled(hasImage && notCropping && notAdjusting);
+  m_rotate90CWAction->setEnabled(editable && notCropping && notAdjusting);
+  m_rotate90CCWAction->setEnabled(editable && notCropping && notAdjusting);
+  m_rotate180Action->setEnabled(editable && notCropping && notAdjusting);
+  m_rotateArbitraryAction->setEnabled(editable && notCropping && notAdjusting);
+  m_flipHorizontalAction->setEnabled(editable && notCropping && notAdjusting);
+  m_flipVerticalAction->setEnabled(editable && notCropping && notAdjusting);
 
-  m_filterGrayscaleAction->setEnabled(hasImage && notCropping && notAdjusting);
-  m_filterSepiaAction->setEnabled(hasImage && notCropping && notAdjusting);
-  m_filterInvertAction->setEnabled(hasImage && notCropping && notAdjusting);
-  m_filterBlurAction->setEnabled(hasImage && notCropping && notAdjusting);
-  m_filterSharpenAction->setEnabled(hasImage && notCropping && notAdjusting);
+  m_filterGrayscaleAction->setEnabled(editable && notCropping && notAdjusting);
+  m_filterSepiaAction->setEnabled(editable && notCropping && notAdjusting);
+  m_filterInvertAction->setEnabled(editable && notCropping && notAdjusting);
+  m_filterBlurAction->setEnabled(editable && notCropping && notAdjusting);
+  m_filterSharpenAction->setEnabled(editable && notCropping && notAdjusting);
 
   if (m_canvas->isCropping()) {
     m_cropAction->setText(tr("&Apply Crop"));
@@ -394,11 +774,26 @@ void MainWindow::updateImageActions() {
   }
 }
 
-bool MainWindow::maybeSave() {
-  if (!m_isModified) {
+void MainWindow::updateHistoryActions() {
+  m_undoAction->setEnabled(m_canvas->canUndo());
+  m_redoAction->setEnabled(m_canvas->canRedo());
+
+  QString undoText = m_canvas->undoText();
+  QString redoText = m_canvas->redoText();
+  m_undoAction->setText(undoText.isEmpty() ? tr("&Undo")
+                                           : tr("&Undo %1").arg(undoText));
+  m_redoAction->setText(redoText.isEmpty() ? tr("&Redo")
+                                           : tr("&Redo %1").arg(redoText));
+}
+
+bool MainWindow::maybeSave(ImageCanvas *canvas) {
+  if (!m_documents.value(canvas).isModified) {
     return true;
   }
 
+  // The question and the save are about the document on screen.
+  m_tabs->setCurrentWidget(canvas);
+
   QMessageBox::StandardButton result = QMessageBox::warning(
       this, tr("Unsaved Changes"),
       tr("The image has been modified.\nDo you want to save your changes?"),
@@ -406,7 +801,8 @@ bool MainWindow::maybeSave() {
 
   if (result == QMessageBox::Save) {
     onSaveFile();
-    return !m_isModified;
+    canvas->waitForSave();
+    return !m_documents.value(canvas).isModified;
   } else if (result == QMessageBox::Cancel) {
     return false;
   }
@@ -415,11 +811,17 @@ bool MainWindow::maybeSave() {
 }
 
 void MainWindow::closeEvent(QCloseEvent *event) {
-  if (maybeSave()) {
-    event->accept();
-  } else {
-    event->ignore();
+  for (int i = 0; i < m_tabs->count(); ++i) {
+    if (!maybeSave(canvasAt(i))) {
+      event->ignore();
+      return;
+    }
   }
+
+  for (int i = 0; i < m_tabs->count(); ++i) {
+    canvasAt(i)->waitForSave();
+  }
+  event->accept();
 }
 
 void MainWindow::keyPressEvent(QKeyEvent *event) {
@@ -437,66 +839,82 @@ void MainWindow::keyPressEvent(QKeyEvent *event) {
   QMainWindow::keyPressEvent(event);
 }
 
-void MainWindow::onNewFile() {
-  if (!maybeSave()) {
+void MainWindow::onNewFile() { documentForOpening(); }
+
+void MainWindow::onOpenFile() {
+  QString filter = tr("Images (*.picture *.png *.jpg *.jpeg *.bmp *.gif "
+                      "*.tiff *.webp *.pam *.ppm *.pgm *.pnm *.rgba);;"
+                      "Picture Project (*.picture);;"
+                      "All Files (*)");
+  QString filePath =
+      QFileDialog::getOpenFileName(this, tr("Open Image"), QString(), filter);
+
+  if (filePath.isEmpty()) {
     return;
   }
 
-  m_canvas->clearProject();
-  m_currentFilePath.clear();
-  m_isModified = false;
-  m_adjustmentsDock->setVisible(false);
-  m_layersPanel->clear();
-  updateWindowTitle();
-  updateStatusBar();
-  updateViewActions();
-  updateImageActions();
+  // A file already open is brought to the front instead of loaded twice.
+  const QString canonicalPath = QFileInfo(filePath).canonicalFilePath();
+  for (int i = 0; i < m_tabs->count(); ++i) {
+    const QString openPath = m_documents.value(canvasAt(i)).filePath;
+    if (!openPath.isEmpty() &&
+        QFileInfo(openPath).canonicalFilePath() == canonicalPath) {
+      m_tabs->setCurrentIndex(i);
+      return;
+    }
+  }
+
+  ImageCanvas *canvas = documentForOpening();
+  if (!canvas->loadProject(filePath)) {
+    onLoadFailed(canvas, filePath);
+  }
 }
 
-void MainWindow::onOpenFile() {
-  if (!maybeSave()) {
+void MainWindow::onRecoverWork() {
+  const QStringList journals = Journal::lastSessionJournals();
+  if (journals.isEmpty()) {
     return;
   }
 
-  QString filter = tr(
-      "Images (*.png *.jpg *.jpeg *.bmp *.gif *.tiff *.webp);;All Files (*)");
-  QString filePath =
-      QFileDialog::getOpenFileName(this, tr("Open Image"), QString(), filter);
-
-  if (filePath.isEmpty()) {
+  // Only the newest session is offered; older ones wait for the next start.
+  QMessageBox::StandardButton answer = QMessageBox::question(
+      this, tr("Recover Work"),
+      tr("Picture did not shut down properly. Recover the unsaved work "
+         "from the last session?"));
+  if (answer != QMessageBox::Yes) {
+    for (const QString &journal : journals) {
+      Journal::remove(journal);
+    }
     return;
   }
 
-  if (m_canvas->loadProject(filePath)) {
-    m_currentFilePath = filePath;
-    m_isModified = false;
-    m_adjustmentsDock->setVisible(false);
-    m_layersPanel->clear();
-    m_layersPanel->addLayer("Background", true);
-    updateWindowTitle();
-    updateStatusBar();
-    updateViewActions();
-    updateImageActions();
-  } else {
-    QMessageBox::critical(this, tr("Error"),
-                          tr("Failed to open image:\n%1").arg(filePath));
+  // Each document of the session comes back in its own tab.
+  for (const QString &journal : journals) {
+    ImageCanvas *canvas = documentForOpening();
+    if (!canvas->recoverJournal(journal)) {
+      Journal::remove(journal);
+      closeDocument(m_tabs->indexOf(canvas));
+      continue;
+    }
+    updateTabTitle(canvas);
   }
+
+  m_adjustmentsDock->setVisible(false);
+  onLayersReset();
+  updateWindowTitle();
+  updateStatusBar();
+  updateViewActions();
+  updateImageActions();
 }
 
 void MainWindow::onSaveFile() {
-  if (m_currentFilePath.isEmpty()) {
+  const QString filePath = m_documents.value(m_canvas).filePath;
+  if (filePath.isEmpty()) {
     onSaveFileAs();
     return;
   }
 
-  if (m_canvas->saveProject(m_currentFilePath)) {
-    m_isModified = false;
-    updateWindowTitle();
-  } else {
-    QMessageBox::critical(
-        this, tr("Error"),
-        tr("Failed to save image:\n%1").arg(m_currentFilePath));
-  }
+  startSave(filePath);
 }
 
 void MainWindow::onSaveFileAs() {
@@ -504,7 +922,8 @@ void MainWindow::onSaveFileAs() {
     return;
   }
 
-  QString filter = tr("PNG (*.png);;JPEG (*.jpg *.jpeg);;BMP (*.bmp)");
+  QString filter = tr("Picture Project (*.picture);;PNG (*.png);;"
+                      "JPEG (*.jpg *.jpeg);;BMP (*.bmp)");
   QString filePath = QFileDialog::getSaveFileName(this, tr("Save Image As"),
                                                   QString(), filter);
 
@@ -512,32 +931,59 @@ void MainWindow::onSaveFileAs() {
     return;
   }
 
-  if (m_canvas->saveProject(filePath)) {
-    m_currentFilePath = filePath;
-    m_isModified = false;
-    updateWindowTitle();
-  } else {
+  startSave(filePath);
+}
+
+void MainWindow::onExportRecipe() {
+  if (!m_canvas->hasImage()) {
+    return;
+  }
+
+  Recipe recipe = m_canvas->recipe();
+  if (recipe.isEmpty()) {
+    QMessageBox::information(
+        this, tr("Export Recipe"),
+        tr("There are no resize, crop, rotate, flip, filter or adjustment "
+           "steps to export."));
+    return;
+  }
+
+  QString filePath = QFileDialog::getSaveFileName(
+      this, tr("Export Recipe"), QString(), tr("Picture Recipe (*.json)"));
+  if (filePath.isEmpty()) {
+    return;
+  }
+
+  if (!recipe.save(filePath)) {
     QMessageBox::critical(this, tr("Error"),
-                          tr("Failed to save image:\n%1").arg(filePath));
+                          tr("Failed to export recipe:\n%1").arg(filePath));
+    return;
   }
+  statusBar()->showMessage(
+      tr("Exported %1 steps to %2")
+          .arg(recipe.steps().size())
+          .arg(QFileInfo(filePath).fileName()),
+      3000);
 }
 
-void MainWindow::onCloseFile() {
-  if (!maybeSave()) {
+void MainWindow::startSave(const QString &path) {
+  if (!m_canvas->saveProject(path)) {
+    QMessageBox::critical(this, tr("Error"),
+                          tr("Failed to save image:\n%1").arg(path));
     return;
   }
 
-  m_canvas->clearProject();
-  m_currentFilePath.clear();
-  m_isModified = false;
-  m_adjustmentsDock->setVisible(false);
-  m_layersPanel->clear();
+  // Cleared when the save starts, so edits made while it runs mark the
+  // document modified again.
+  m_documents[m_canvas].isModified = false;
+  m_saveProgress->setValue(0);
+  m_saveProgress->show();
+  updateTabTitle(m_canvas);
   updateWindowTitle();
-  updateStatusBar();
-  updateViewActions();
-  updateImageActions();
 }
 
+void MainWindow::onCloseFile() { closeDocument(m_tabs->currentIndex()); }
+
 void MainWindow::onResizeImage() {
   if (!m_canvas->hasImage()) {
     return;
@@ -593,6 +1039,30 @@ void MainWindow::onFlipHorizontal() { m_canvas->flipHorizontal(); }
 
 void MainWindow::onFlipVertical() { m_canvas->flipVertical(); }
 
+void MainWindow::onPasteAsNewLayer() {
+  QImage image = QGuiApplication::clipboard()->image();
+  if (image.isNull()) {
+    statusBar()->showMessage(tr("Clipboard does not contain an image"), 3000);
+    return;
+  }
+
+  m_canvas->pasteAsNewLayer(image);
+  updateStatusBar();
+  updateViewActions();
+  updateImageActions();
+}
+
+void MainWindow::onLayersReset() {
+  m_layersPanel->clear();
+  for (const auto &layer : m_canvas->layers()) {
+    m_layersPanel->addLayer(layer->name(), layer->isVisible());
+  }
+  m_layersPanel->selectLayer(m_canvas->activeLayerIndex());
+
+  updateStatusBar();
+  updateImageActions();
+}
+
 void MainWindow::onToggleAdjustments() {
   bool visible = !m_adjustmentsDock->isVisible();
   m_adjustmentsDock->setVisible(visible);
@@ -646,17 +1116,61 @@ void MainWindow::onFitToWindow() { m_canvas->fitToWindow(); }
 
 void MainWindow::onActualSize() { m_canvas->actualSize(); }
 
-void MainWindow::onImageLoaded(const QString &path) {
-  Q_UNUSED(path);
+void MainWindow::onImageLoaded(ImageCanvas *canvas, const QString &path) {
+  // Large images finish loading after loadProject() has returned, possibly
+  // once another tab is current.
+  m_documents[canvas] = Document{path, false};
+  updateTabTitle(canvas);
+  if (canvas != m_canvas) {
+    return;
+  }
+
+  m_adjustmentsDock->setVisible(false);
+  onLayersReset();
+  updateWindowTitle();
   updateStatusBar();
   updateViewActions();
   updateImageActions();
 }
 
-void MainWindow::onImageModified() {
-  m_isModified = true;
-  updateWindowTitle();
-  updateStatusBar();
+void MainWindow::onLoadFailed(ImageCanvas *canvas, const QString &path) {
+  QMessageBox::critical(this, tr("Error"),
+                        tr("Failed to open image:\n%1").arg(path));
+  // The tab opened for the image goes again.
+  if (!canvas->hasImage() && !canvas->isLoading()) {
+    closeDocument(m_tabs->indexOf(canvas));
+  }
+}
+
+void MainWindow::onImageSaved(ImageCanvas *canvas, const QString &path) {
+  m_documents[canvas].filePath = path;
+  updateTabTitle(canvas);
+  if (canvas == m_canvas) {
+    m_saveProgress->hide();
+    updateWindowTitle();
+  }
+  statusBar()->showMessage(
+      tr("Saved %1").arg(QFileInfo(path).fileName()), 3000);
+}
+
+void MainWindow::onSaveFailed(ImageCanvas *canvas, const QString &path) {
+  m_documents[canvas].isModified = true;
+  updateTabTitle(canvas);
+  if (canvas == m_canvas) {
+    m_saveProgress->hide();
+    updateWindowTitle();
+  }
+  QMessageBox::critical(this, tr("Error"),
+                        tr("Failed to save image:\n%1").arg(path));
+}
+
+void MainWindow::onImageModified(ImageCanvas *canvas) {
+  m_documents[canvas].isModified = true;
+  updateTabTitle(canvas);
+  if (canvas == m_canvas) {
+    updateWindowTitle();
+    updateStatusBar();
+  }
 }
 
 void MainWindow::onZoomChanged(qreal level) {
@@ -693,22 +1207,45 @@ void MainWindow::onActiveLayerChanged(int index) {
 void MainWindow::onToolBrush()
 {
     m_canvas->setToolMode(ImageCanvas::ToolMode::Brush);
-    m_toolBrushAction->setChecked(true);
-    m_toolEraserAction->setChecked(false);
+    updateToolActions();
 }
 
 void MainWindow::onToolEraser()
 {
     m_canvas->setToolMode(ImageCanvas::ToolMode::Eraser);
-    m_toolBrushAction->setChecked(false);
-    m_toolEraserAction->setChecked(true);
+    updateToolActions();
+}
+
+void MainWindow::onToolFill()
+{
+    m_canvas->setToolMode(ImageCanvas::ToolMode::Fill);
+    updateToolActions();
+}
+
+void MainWindow::onToolGradient()
+{
+    m_canvas->setToolMode(ImageCanvas::ToolMode::Gradient);
+    updateToolActions();
 }
 
 void MainWindow::onToolNone()
 {
     m_canvas->setToolMode(ImageCanvas::ToolMode::None);
-    m_toolBrushAction->setChecked(false);
-    m_toolEraserAction->setChecked(false);
+    updateToolActions();
+}
+
+void MainWindow::updateToolActions()
+{
+    ImageCanvas::ToolMode mode = m_canvas->toolMode();
+    m_toolBrushAction->setChecked(mode == ImageCanvas::ToolMode::Brush);
+    m_toolEraserAction->setChecked(mode == ImageCanvas::ToolMode::Eraser);
+    m_toolFillAction->setChecked(mode == ImageCanvas::ToolMode::Fill);
+    m_toolGradientAction->setChecked(mode ==
+                                     ImageCanvas::ToolMode::Gradient);
+
+    // Freshly created tools start from the panel's current colours.
+    m_canvas->setToolColor(m_colorPanel->foregroundColor());
+    m_canvas->setToolBackgroundColor(m_colorPanel->backgroundColor());
 }
 
 void MainWindow::onForegroundColorChanged(const QColor& color)
@@ -1,6 +1,7 @@
 #ifndef MAINWINDOW_H
 #define MAINWINDOW_H
 
+#include <QHash>
 #include <QMainWindow>
 
 class ImageCanvas;
@@ -8,8 +9,10 @@ class AdjustmentsPanel;
 class LayersPanel;
 class ColorPanel;
 class QLabel;
+class QProgressBar;
 class QAction;
 class QDockWidget;
+class QTabWidget;
 
 class MainWindow : public QMainWindow {
   Q_OBJECT
@@ -27,7 +30,13 @@ private slots:
   void onOpenFile();
   void onSaveFile();
   void onSaveFileAs();
+  void onExportRecipe();
   void onCloseFile();
+  void onCurrentTabChanged(int index);
+  void onTabCloseRequested(int index);
+  void onRecoverWork();
+  void onPasteAsNewLayer();
+  void onLayersReset();
   void onResizeImage();
   void onCrop();
   void onApplyCrop();
@@ -52,8 +61,6 @@ private slots:
   void onZoomOut();
   void onFitToWindow();
   void onActualSize();
-  void onImageLoaded(const QString &path);
-  void onImageModified();
   void onZoomChanged(qreal level);
   void onCropModeChanged(bool cropping);
   void onAdjustmentModeChanged(bool adjusting);
@@ -67,20 +74,49 @@ private slots:
   // Tool slots
   void onToolBrush();
   void onToolEraser();
+  void onToolFill();
+  void onToolGradient();
   void onToolNone();
   void onForegroundColorChanged(const QColor &color);
 
 private:
+  // What the window tracks for each open document.
+  struct Document {
+    QString filePath;
+    bool isModified = false;
+  };
+
+  // Opens an empty document in a new tab and makes it current.
+  ImageCanvas *addDocument();
+  // The current document if it is empty, otherwise a new one.
+  ImageCanvas *documentForOpening();
+  ImageCanvas *canvasAt(int index) const;
+  // The last tab is cleared rather than closed.
+  void closeDocument(int index);
+
+  void onImageLoaded(ImageCanvas *canvas, const QString &path);
+  void onLoadFailed(ImageCanvas *canvas, const QString &path);
+  void onImageSaved(ImageCanvas *canvas, const QString &path);
+  void onSaveFailed(ImageCanvas *canvas, const QString &path);
+  void onImageModified(ImageCanvas *canvas);
+
   void setupMenuBar();
   void setupStatusBar();
   void setupDockWidgets();
   void updateWindowTitle();
+  void updateTabTitle(ImageCanvas *canvas);
   void updateStatusBar();
   void updateViewActions();
   void updateImageActions();
-  bool maybeSave();
+  void updateToolActions();
+  void updateHistoryActions();
+  bool maybeSave(ImageCanvas *canvas);
+  void startSave(const QString &path);
 
+  QTabWidget *m_tabs;
+  // The document in the current tab.
   ImageCanvas *m_canvas;
+  QHash<ImageCanvas *, Document> m_documents;
   AdjustmentsPanel *m_adjustmentsPanel;
   LayersPanel *m_layersPanel;
   ColorPanel *m_colorPanel;
@@ -90,9 +126,10 @@ private:
 
   QLabel *m_statusLabel;
   QLabel *m_zoomLabel;
-  QString m_currentFilePath;
-  bool m_isModified;
+  QProgressBar *m_saveProgress;
 
+  QAction *m_undoAction;
+  QAction *m_redoAction;
   QAction *m_zoomInAction;
   QAction *m_zoomOutAction;
   QAction *m_fitToWindowAction;
@@ -115,6 +152,8 @@ private:
 
   QAction *m_toolBrushAction;
   QAction *m_toolEraserAction;
+  QAction *m_toolFillAction;
+  QAction *m_toolGradientAction;
 };
 
 #endif
@@ -0,0 +1,215 @@
+#include "MappedImage.h"
+#include "Tile.h"
+
+#include <QFileInfo>
+#include <QRegularExpression>
+#include <algorithm>
+#include <cctype>
+
+namespace {
+
+// Enough for any header with a few comment lines.
+constexpr qint64 HeaderBytes = 4096;
+// Larger sizes are taken for a damaged header.
+constexpr int MaxDimension = 1 << 20;
+
+int bytesPerPixel(QImage::Format format) {
+  return QImage::toPixelFormat(format).bitsPerPixel() / 8;
+}
+
+} // namespace
+
+bool MappedImage::canOpen(const QString &path) {
+  const QString suffix = QFileInfo(path).suffix().toLower();
+  return suffix == "pam" || suffix == "ppm" || suffix == "pgm" ||
+         suffix == "pnm" || suffix == "rgba";
+}
+
+std::shared_ptr<MappedImage> MappedImage::open(const QString &path) {
+  std::shared_ptr<MappedImage> image(new MappedImage(path));
+  if (!image->m_file.open(QIODevice::ReadOnly) || !image->readHeader()) {
+    return nullptr;
+  }
+
+  image->m_bytesPerLine =
+      qsizetype(image->m_size.width()) * bytesPerPixel(image->m_format);
+  const qint64 end =
+      image->m_offset + image->m_bytesPerLine * image->m_size.height();
+  if (image->m_file.size() < end) {
+    return nullptr;
+  }
+
+  // A shared read-only mapping: the pages are the file's own page cache.
+  const uchar *mapping = image->m_file.map(0, end);
+  if (!mapping) {
+    return nullptr;
+  }
+  image->m_data = mapping + image->m_offset;
+  return image;
+}
+
+MappedImage::MappedImage(const QString &path)
+    : m_file(path), m_data(nullptr), m_size(),
+      m_format(QImage::Format_Invalid), m_bytesPerLine(0), m_offset(0) {}
+
+MappedImage::~MappedImage() = default;
+
+QSize MappedImage::size() const { return m_size; }
+
+QImage MappedImage::copy(const QRect &area) const {
+  const QRect clipped = area & QRect(QPoint(0, 0), m_size);
+  if (clipped.isEmpty()) {
+    return QImage();
+  }
+
+  // Wraps the rows in place; the conversion is the only copy.
+  const uchar *first = m_data + clipped.y() * m_bytesPerLine +
+                       qsizetype(clipped.x()) * bytesPerPixel(m_format);
+  return QImage(first, clipped.width(), clipped.height(), m_bytesPerLine,
+                m_format)
+      .convertToFormat(QImage::Format_ARGB32_Premultiplied);
+}
+
+TiledImage MappedImage::tiles() {
+  TiledImage tiles(m_size);
+  for (int row = 0; row < tiles.rows(); ++row) {
+    for (int column = 0; column < tiles.columns(); ++column) {
+      const QRect area = tiles.tileRect(column, row);
+      tiles.setTile(column, row,
+                    std::make_shared<Tile>(area.size(), shared_from_this(),
+                                           area.topLeft()));
+    }
+  }
+  return tiles;
+}
+
+bool MappedImage::readHeader() {
+  const QByteArray head = m_file.peek(HeaderBytes);
+  if (head.startsWith("P7")) {
+    return readPam(head);
+  }
+  if (head.startsWith("P5") || head.startsWith("P6")) {
+    return readPnm(head);
+  }
+  return QFileInfo(m_file.fileName()).suffix().toLower() == "rgba" &&
+         readRawSize();
+}
+
+bool MappedImage::readPam(const QByteArray &head) {
+  int width = 0;
+  int height = 0;
+  int depth = 0;
+  int maxValue = 0;
+  qsizetype position = head.indexOf('\n') + 1;
+  while (true) {
+    const qsizetype end = head.indexOf('\n', position);
+    if (position <= 0 || end < 0) {
+      return false;
+    }
+    const QByteArray line = head.mid(position, end - position).simplified();
+    position = end + 1;
+    if (line == "ENDHDR") {
+      break;
+    }
+
+    const QList<QByteArray> fields = line.split(' ');
+    if (fields.size() < 2 || line.startsWith('#')) {
+      continue;
+    }
+    if (fields[0] == "WIDTH") {
+      width = fields[1].toInt();
+    } else if (fields[0] == "HEIGHT") {
+      height = fields[1].toInt();
+    } else if (fields[0] == "DEPTH") {
+      depth = fields[1].toInt();
+    } else if (fields[0] == "MAXVAL") {
+      maxValue = fields[1].toInt();
+    }
+  }
+
+  // The tuple type is implied by the depth for the layouts QImage has.
+  switch (depth) {
+  case 1:
+    m_format = QImage::Format_Grayscale8;
+    break;
+  case 3:
+    m_format = QImage::Format_RGB888;
+    break;
+  case 4:
+    m_format = QImage::Format_RGBA8888;
+    break;
+  default:
+    return false;
+  }
+  if (maxValue != 255 || width <= 0 || height <= 0 ||
+      width > MaxDimension || height > MaxDimension) {
+    return false;
+  }
+
+  m_size = QSize(width, height);
+  m_offset = position;
+  return true;
+}
+
+bool MappedImage::readPnm(const QByteArray &head) {
+  qsizetype position = 2;
+  auto nextNumber = [&head, &position]() {
+    // Whitespace and comments may sit between any two fields.
+    while (position < head.size()) {
+      if (head[position] == '#') {
+        while (position < head.size() && head[position] != '\n') {
+          ++position;
+        }
+      } else if (std::isspace(uchar(head[position]))) {
+        ++position;
+      } else {
+        break;
+      }
+    }
+
+    int value = -1;
+    while (position < head.size() && std::isdigit(uchar(head[position])) &&
+           value <= MaxDimension) {
+      value = std::max(value, 0) * 10 + (head[position] - '0');
+      ++position;
+    }
+    return value;
+  };
+
+  const int width = nextNumber();
+  const int height = nextNumber();
+  const int maxValue = nextNumber();
+  if (width <= 0 || height <= 0 || width > MaxDimension ||
+      height > MaxDimension || maxValue != 255 || position >= head.size() ||
+      !std::isspace(uchar(head[position]))) {
+    return false;
+  }
+
+  m_format = head[1] == '5' ? QImage::Format_Grayscale8
+                            : QImage::Format_RGB888;
+  m_size = QSize(width, height);
+  // Exactly one whitespace character separates the header from the data.
+  m_offset = position + 1;
+  return true;
+}
+
+bool MappedImage::readRawSize() {
+  static const QRegularExpression pattern("(\\d+)x(\\d+)$");
+  const QRegularExpressionMatch match =
+      pattern.match(QFileInfo(m_file.fileName()).completeBaseName());
+  if (!match.hasMatch()) {
+    return false;
+  }
+
+  const int width = match.captured(1).toInt();
+  const int height = match.captured(2).toInt();
+  if (width <= 0 || height <= 0 || width > MaxDimension ||
+      height > MaxDimension) {
+    return false;
+  }
+
+  m_format = QImage::Format_RGBA8888;
+  m_size = QSize(width, height);
+  m_offset = 0;
+  return true;
+}
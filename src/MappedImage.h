@@ -0,0 +1,54 @@
+#ifndef MAPPEDIMAGE_H
+#define MAPPEDIMAGE_H
+
+#include "TiledImage.h"
+
+#include <QFile>
+#include <QImage>
+#include <QString>
+#include <memory>
+
+// An uncompressed image file mapped into memory instead of decoded:
+// 8-bit binary PAM (P7), PPM (P6) and PGM (P5), and headerless RGBA
+// whose size is in the name, e.g. scan_6000x4000.rgba. Opening reads only
+// the header. Its tiles convert their pixels straight from the mapping
+// the first time they are drawn or edited, and can be dropped again for
+// free while unchanged, so a multi-gigabyte scan opens at once and its
+// pages stay in the page cache shared with other processes.
+class MappedImage : public std::enable_shared_from_this<MappedImage> {
+public:
+  // By suffix; open() still rejects variants it cannot map, such as
+  // 16-bit samples, which then go through QImageReader.
+  static bool canOpen(const QString &path);
+  static std::shared_ptr<MappedImage> open(const QString &path);
+
+  ~MappedImage();
+
+  MappedImage(const MappedImage &) = delete;
+  MappedImage &operator=(const MappedImage &) = delete;
+
+  QSize size() const;
+
+  // The area converted to ARGB32 premultiplied. Only touches the pages
+  // holding its rows. Safe from any thread.
+  QImage copy(const QRect &area) const;
+  // A tile grid whose tiles read from this mapping until first written.
+  TiledImage tiles();
+
+private:
+  explicit MappedImage(const QString &path);
+
+  bool readHeader();
+  bool readPam(const QByteArray &head);
+  bool readPnm(const QByteArray &head);
+  bool readRawSize();
+
+  QFile m_file;
+  const uchar *m_data;
+  QSize m_size;
+  QImage::Format m_format;
+  qsizetype m_bytesPerLine;
+  qint64 m_offset;
+};
+
+#endif
@@ -0,0 +1,279 @@
+#include "PngWriter.h"
+
+#include <QSaveFile>
+#include <QThread>
+#include <QtConcurrent>
+#include <QtEndian>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <vector>
+#include <zlib.h>
+
+namespace {
+
+const QByteArray Signature("\x89PNG\r\n\x1a\n", 8);
+// Raw bytes per band. Large enough that restarting the dictionary at
+// each band barely shows in the output size.
+constexpr qsizetype BandBytes = 1024 * 1024;
+
+enum FilterType : uchar { None, Sub, Up, Average, Paeth };
+
+struct Band {
+  int firstRow;
+  int rows;
+  bool last;
+  QByteArray compressed;
+  uLong adler;
+  qsizetype rawBytes;
+};
+
+uchar paeth(int left, int up, int upLeft) {
+  const int estimate = left + up - upLeft;
+  const int toLeft = std::abs(estimate - left);
+  const int toUp = std::abs(estimate - up);
+  const int toUpLeft = std::abs(estimate - upLeft);
+  if (toLeft <= toUp && toLeft <= toUpLeft) {
+    return left;
+  }
+  return toUp <= toUpLeft ? up : upLeft;
+}
+
+// Filters one row with every filter type and keeps the one with the
+// smallest sum of absolute signed residuals: the usual heuristic, which
+// comes close to trying each filter through deflate at a tiny fraction
+// of the cost. previous is null for the first row of the image.
+void filterRow(const uchar *row, const uchar *previous, int bytes, int pixel,
+               std::array<std::vector<uchar>, 5> &candidates, uchar *out) {
+  for (auto &candidate : candidates) {
+    candidate.resize(bytes);
+  }
+
+  for (int i = 0; i < bytes; ++i) {
+    const int left = i >= pixel ? row[i - pixel] : 0;
+    const int up = previous ? previous[i] : 0;
+    const int upLeft = previous && i >= pixel ? previous[i - pixel] : 0;
+    candidates[None][i] = row[i];
+    candidates[Sub][i] = row[i] - left;
+    candidates[Up][i] = row[i] - up;
+    candidates[Average][i] = row[i] - (left + up) / 2;
+    candidates[Paeth][i] = row[i] - paeth(left, up, upLeft);
+  }
+
+  int best = None;
+  quint64 bestCost = ~quint64(0);
+  for (int type = None; type <= Paeth; ++type) {
+    quint64 cost = 0;
+    for (uchar value : candidates[type]) {
+      cost += value < 128 ? value : 256 - value;
+    }
+    if (cost < bestCost) {
+      best = type;
+      bestCost = cost;
+    }
+  }
+
+  out[0] = uchar(best);
+  std::copy(candidates[best].begin(), candidates[best].end(), out + 1);
+}
+
+bool deflateBand(const QByteArray &raw, int level, bool last,
+                 QByteArray &compressed) {
+  // Raw deflate: the zlib header and checksum are written once for the
+  // whole stream.
+  z_stream stream{};
+  if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8,
+                   Z_FILTERED) != Z_OK) {
+    return false;
+  }
+
+  // Bands before the last end in a sync flush, which byte-aligns the
+  // output without marking the final block.
+  compressed.resize(deflateBound(&stream, raw.size()) + 64);
+  stream.next_in =
+      reinterpret_cast<Bytef *>(const_cast<char *>(raw.constData()));
+  stream.avail_in = uInt(raw.size());
+  int result = Z_OK;
+  do {
+    if (stream.total_out == uLong(compressed.size())) {
+      compressed.resize(compressed.size() * 2);
+    }
+    stream.next_out =
+        reinterpret_cast<Bytef *>(compressed.data()) + stream.total_out;
+    stream.avail_out = uInt(compressed.size() - stream.total_out);
+    result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+  } while (result == Z_OK && stream.avail_out == 0);
+
+  compressed.resize(stream.total_out);
+  deflateEnd(&stream);
+  return last ? result == Z_STREAM_END : result == Z_OK;
+}
+
+bool encodeBand(const QImage &source, int channels, int level,
+                Band &band) {
+  // Converted a band at a time, with the row above for the filters, so
+  // the whole image is never copied.
+  const int above = band.firstRow > 0 ? 1 : 0;
+  const QImage rows =
+      source.copy(0, band.firstRow - above, source.width(), band.rows + above)
+          .convertToFormat(channels == 4 ? QImage::Format_RGBA8888
+                                         : QImage::Format_RGB888);
+
+  const int bytes = source.width() * channels;
+  QByteArray raw(qsizetype(band.rows) * (bytes + 1), Qt::Uninitialized);
+  std::array<std::vector<uchar>, 5> candidates;
+  for (int y = 0; y < band.rows; ++y) {
+    const uchar *previous =
+        y + above > 0 ? rows.constScanLine(y + above - 1) : nullptr;
+    filterRow(rows.constScanLine(y + above), previous, bytes, channels,
+              candidates,
+              reinterpret_cast<uchar *>(raw.data()) +
+                  qsizetype(y) * (bytes + 1));
+  }
+
+  band.rawBytes = raw.size();
+  band.adler = adler32(adler32(0, Z_NULL, 0),
+                       reinterpret_cast<const Bytef *>(raw.constData()),
+                       uInt(raw.size()));
+  return deflateBand(raw, level, band.last, band.compressed);
+}
+
+bool writeChunk(QIODevice &device, const char *type,
+                const QByteArray &data) {
+  uchar length[4];
+  qToBigEndian(quint32(data.size()), length);
+  uLong crc = crc32(0, reinterpret_cast<const Bytef *>(type), 4);
+  crc = crc32(crc, reinterpret_cast<const Bytef *>(data.constData()),
+              uInt(data.size()));
+  uchar checksum[4];
+  qToBigEndian(quint32(crc), checksum);
+
+  return device.write(reinterpret_cast<const char *>(length), 4) == 4 &&
+         device.write(type, 4) == 4 && device.write(data) == data.size() &&
+         device.write(reinterpret_cast<const char *>(checksum), 4) == 4;
+}
+
+QByteArray zlibHeader(int level) {
+  // Deflate with a 32 KiB window, and the level hint zlib itself writes.
+  const int hint = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+  const int method = 0x78;
+  int flags = hint << 6;
+  flags += 31 - (method * 256 + flags) % 31;
+  return QByteArray({char(method), char(flags)});
+}
+
+} // namespace
+
+bool PngWriter::write(const QString &path, const QImage &image,
+                      int compression,
+                      const std::function<void(int)> &progress) {
+  if (image.isNull()) {
+    return false;
+  }
+
+  QImage source = image;
+  if (source.format() != QImage::Format_ARGB32 &&
+      source.format() != QImage::Format_ARGB32_Premultiplied &&
+      source.format() != QImage::Format_RGB32) {
+    source = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+  }
+  const int level = std::clamp(compression, 0, 9);
+
+  const int rowsPerBand = std::max<qsizetype>(
+      1, BandBytes / (qsizetype(source.width()) * 4));
+  std::vector<Band> bands;
+  for (int y = 0; y < source.height(); y += rowsPerBand) {
+    const int rows = std::min(rowsPerBand, source.height() - y);
+    bands.push_back({y, rows, y + rows == source.height(), QByteArray(),
+                     0, 0});
+  }
+
+  // Opaque images are written without the alpha channel.
+  std::atomic<bool> translucent = false;
+  if (source.hasAlphaChannel()) {
+    QtConcurrent::blockingMap(bands, [&source, &translucent](Band &band) {
+      for (int y = band.firstRow;
+           y < band.firstRow + band.rows && !translucent; ++y) {
+        const QRgb *line =
+            reinterpret_cast<const QRgb *>(source.constScanLine(y));
+        for (int x = 0; x < source.width(); ++x) {
+          if (qAlpha(line[x]) != 255) {
+            translucent = true;
+            return;
+          }
+        }
+      }
+    });
+  }
+  const int channels = translucent ? 4 : 3;
+
+  QSaveFile file(path);
+  if (!file.open(QIODevice::WriteOnly) || file.write(Signature) != 8) {
+    return false;
+  }
+
+  QByteArray header(13, '\0');
+  uchar *fields = reinterpret_cast<uchar *>(header.data());
+  qToBigEndian(quint32(source.width()), fields);
+  qToBigEndian(quint32(source.height()), fields + 4);
+  fields[8] = 8;
+  fields[9] = channels == 4 ? 6 : 2;
+  if (!writeChunk(file, "IHDR", header)) {
+    return false;
+  }
+
+  if (source.dotsPerMeterX() > 0 && source.dotsPerMeterY() > 0) {
+    QByteArray density(9, '\0');
+    uchar *values = reinterpret_cast<uchar *>(density.data());
+    qToBigEndian(quint32(source.dotsPerMeterX()), values);
+    qToBigEndian(quint32(source.dotsPerMeterY()), values + 4);
+    values[8] = 1;
+    if (!writeChunk(file, "pHYs", density)) {
+      return false;
+    }
+  }
+
+  // Bands are encoded a wave at a time and written in order, so only one
+  // wave of compressed data is held at once.
+  const size_t wave = size_t(QThread::idealThreadCount()) * 2;
+  uLong adler = adler32(0, Z_NULL, 0);
+  for (size_t first = 0; first < bands.size(); first += wave) {
+    auto begin = bands.begin() + first;
+    auto end = bands.begin() + std::min(first + wave, bands.size());
+    std::atomic<bool> failed = false;
+    QtConcurrent::blockingMap(
+        begin, end, [&source, channels, level, &failed](Band &band) {
+          if (!encodeBand(source, channels, level, band)) {
+            failed = true;
+          }
+        });
+    if (failed) {
+      file.cancelWriting();
+      return false;
+    }
+
+    for (auto it = begin; it != end; ++it) {
+      QByteArray data = std::move(it->compressed);
+      if (it->firstRow == 0) {
+        data.prepend(zlibHeader(level));
+      }
+      adler = adler32_combine(adler, it->adler, it->rawBytes);
+      if (it->last) {
+        uchar checksum[4];
+        qToBigEndian(quint32(adler), checksum);
+        data.append(reinterpret_cast<const char *>(checksum), 4);
+      }
+      if (!writeChunk(file, "IDAT", data)) {
+        file.cancelWriting();
+        return false;
+      }
+    }
+
+    if (progress) {
+      progress(int(100 * (end - bands.begin()) / bands.size()));
+    }
+  }
+
+  return writeChunk(file, "IEND", QByteArray()) && file.commit();
+}
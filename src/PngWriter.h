@@ -0,0 +1,26 @@
+#ifndef PNGWRITER_H
+#define PNGWRITER_H
+
+#include <QImage>
+#include <QString>
+#include <functional>
+
+// PNG encoder that deflates bands of rows in parallel. Each band is
+// compressed with its own dictionary and ends on a byte boundary, so the
+// bands join into one valid zlib stream; the checksum is combined from
+// the per-band ones. Costs a fraction of a percent in size against a
+// single-threaded encoder at the same level.
+class PngWriter {
+public:
+  // Writes 8-bit RGB, or RGBA when any pixel is translucent. progress
+  // receives the percentage of rows written. Safe to call off the GUI
+  // thread.
+  static bool write(const QString &path, const QImage &image,
+                    int compression = 9,
+                    const std::function<void(int)> &progress = {});
+
+private:
+  PngWriter() = default;
+};
+
+#endif
@@ -0,0 +1,438 @@
+#include "ProjectFile.h"
+#include "Tile.h"
+
+#include <QDataStream>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QThread>
+#include <QtConcurrent>
+#include <algorithm>
+#include <functional>
+#include <map>
+
+#if defined(Q_OS_WIN)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+const QByteArray Magic("PICTURE1");
+constexpr quint32 Version = 1;
+// Magic, version, index checksum, index offset and index size.
+constexpr qint64 HeaderBytes = 32;
+
+struct IndexEntry {
+  qint32 tile;
+  qint64 offset;
+  qint64 bytes;
+};
+
+// Index entries of every stored tile, per layer.
+using LayerIndex = std::vector<std::vector<IndexEntry>>;
+
+struct PendingTile {
+  std::shared_ptr<Tile> tile;
+  int layer;
+  size_t entry;
+  QByteArray data;
+};
+
+// The store currently backing each project path. A store that has been
+// replaced by a full rewrite stays alive for the tiles that still read
+// from it, but no longer receives appends.
+QMutex &storesMutex() {
+  static QMutex mutex;
+  return mutex;
+}
+
+std::map<QString, std::weak_ptr<ProjectFile>> &stores() {
+  static std::map<QString, std::weak_ptr<ProjectFile>> stores;
+  return stores;
+}
+
+std::shared_ptr<ProjectFile> currentStore(const QString &path) {
+  QMutexLocker locker(&storesMutex());
+  auto found = stores().find(path);
+  return found != stores().end() ? found->second.lock() : nullptr;
+}
+
+void setCurrentStore(const QString &path,
+                     const std::shared_ptr<ProjectFile> &store) {
+  QMutexLocker locker(&storesMutex());
+  stores()[path] = store;
+}
+
+bool syncToDisk(QFile &file) {
+#if defined(Q_OS_WIN)
+  return _commit(file.handle()) == 0;
+#else
+  return ::fsync(file.handle()) == 0;
+#endif
+}
+
+QByteArray header(qint64 indexOffset, const QByteArray &index) {
+  QByteArray bytes;
+  QDataStream stream(&bytes, QIODevice::WriteOnly);
+  stream.writeRawData(Magic.constData(), Magic.size());
+  stream << Version << quint32(qChecksum(index)) << indexOffset
+         << qint64(index.size());
+  return bytes;
+}
+
+QByteArray serializeIndex(const DocumentState &state,
+                          const LayerIndex &index) {
+  QByteArray bytes;
+  QDataStream stream(&bytes, QIODevice::WriteOnly);
+  stream.setVersion(QDataStream::Qt_6_0);
+  stream << state.canvasSize << qint32(state.activeLayer)
+         << quint32(state.layers.size());
+  for (size_t i = 0; i < state.layers.size(); ++i) {
+    const Layer &layer = state.layers[i];
+    stream << layer.name() << layer.isVisible() << double(layer.opacity())
+           << qint32(layer.blendMode()) << layer.offset() << layer.size()
+           << quint32(index[i].size());
+    for (const IndexEntry &entry : index[i]) {
+      stream << entry.tile << entry.offset << entry.bytes;
+    }
+  }
+  return bytes;
+}
+
+// Builds the index of a state, writing the tiles store does not hold yet
+// through write(). Tiles are compressed in parallel a batch at a time,
+// so only one batch of compressed data is held at once.
+bool writeTiles(
+    const DocumentState &state, const ProjectFile *store,
+    const std::function<std::optional<qint64>(const QByteArray &)> &write,
+    const ProjectFile::Progress &progress, LayerIndex &index,
+    std::vector<PendingTile> &written) {
+  index.assign(state.layers.size(), {});
+  std::vector<PendingTile> pending;
+  for (size_t layer = 0; layer < state.layers.size(); ++layer) {
+    const auto &tiles = state.layers[layer].tiles().tileStorage();
+    for (size_t i = 0; i < tiles.size(); ++i) {
+      if (!tiles[i]) {
+        continue;
+      }
+      if (tiles[i]->isDamaged()) {
+        return false;
+      }
+      TileLocation location = tiles[i]->location(store);
+      if (location.file) {
+        index[layer].push_back(
+            {qint32(i), location.offset, location.bytes});
+      } else {
+        index[layer].push_back({qint32(i), 0, 0});
+        pending.push_back({tiles[i], int(layer), index[layer].size() - 1,
+                           QByteArray()});
+      }
+    }
+  }
+
+  const size_t batchSize = QThread::idealThreadCount() * 4;
+  for (size_t first = 0; first < pending.size(); first += batchSize) {
+    auto begin = pending.begin() + first;
+    auto end = pending.begin() + std::min(first + batchSize, pending.size());
+    QtConcurrent::blockingMap(begin, end, [](PendingTile &pending) {
+      pending.data = pending.tile->packedData();
+    });
+
+    for (auto it = begin; it != end; ++it) {
+      // A tile whose pixels were lost is not written as a blank one.
+      if (it->data.isEmpty()) {
+        return false;
+      }
+      std::optional<qint64> offset = write(it->data);
+      if (!offset) {
+        return false;
+      }
+      IndexEntry &entry = index[it->layer][it->entry];
+      entry.offset = *offset;
+      entry.bytes = it->data.size();
+      it->data = QByteArray();
+    }
+    if (progress) {
+      progress(int(100 * (end - pending.begin()) / pending.size()));
+    }
+  }
+
+  written = std::move(pending);
+  return true;
+}
+
+} // namespace
+
+ProjectFile::ProjectFile(const QString &path)
+    : m_path(path), m_mutex(), m_file(path) {}
+
+ProjectFile::~ProjectFile() = default;
+
+bool ProjectFile::isProjectPath(const QString &path) {
+  return QFileInfo(path).suffix().toLower() == "picture";
+}
+
+QString ProjectFile::path() const { return m_path; }
+
+std::optional<ProjectFile::Revision>
+ProjectFile::revision(const QString &path) {
+  std::shared_ptr<ProjectFile> store =
+      open(QFileInfo(path).absoluteFilePath());
+  if (!store) {
+    return std::nullopt;
+  }
+  return store->readHeader();
+}
+
+void ProjectFile::remove(const QString &path) {
+  // Tiles still reading from the file keep their handle to it.
+  const QString target = QFileInfo(path).absoluteFilePath();
+  setCurrentStore(target, nullptr);
+  QFile::remove(target);
+}
+
+std::optional<DocumentState> ProjectFile::load(const QString &path,
+                                               const Revision &revision) {
+  std::shared_ptr<ProjectFile> store =
+      open(QFileInfo(path).absoluteFilePath());
+  if (!store) {
+    return std::nullopt;
+  }
+
+  // Earlier revisions stay readable until the file is next rewritten.
+  std::optional<Revision> found = revision;
+  if (revision.indexOffset < 0) {
+    found = store->readHeader();
+  }
+  if (!found) {
+    return std::nullopt;
+  }
+
+  QByteArray index = store->read(found->indexOffset, found->indexBytes);
+  if (index.size() != found->indexBytes ||
+      qChecksum(index) != found->checksum) {
+    return std::nullopt;
+  }
+
+  const qint64 fileSize = store->size();
+  QDataStream stream(index);
+  stream.setVersion(QDataStream::Qt_6_0);
+  DocumentState state;
+  qint32 activeLayer = -1;
+  quint32 layerCount = 0;
+  stream >> state.canvasSize >> activeLayer >> layerCount;
+  state.activeLayer = activeLayer;
+
+  for (quint32 i = 0; i < layerCount; ++i) {
+    QString name;
+    bool visible = true;
+    double opacity = 1.0;
+    qint32 blendMode = 0;
+    QPoint offset;
+    QSize size;
+    quint32 tileCount = 0;
+    stream >> name >> visible >> opacity >> blendMode >> offset >> size >>
+        tileCount;
+    if (stream.status() != QDataStream::Ok) {
+      return std::nullopt;
+    }
+
+    // Tiles are only read from the file once something needs them.
+    TiledImage tiles(size);
+    for (quint32 j = 0; j < tileCount; ++j) {
+      IndexEntry entry{};
+      stream >> entry.tile >> entry.offset >> entry.bytes;
+      // A tile past the end of the file means the file was cut short.
+      if (entry.tile < 0 || entry.tile >= tiles.columns() * tiles.rows() ||
+          entry.offset < 0 || entry.bytes <= 0 ||
+          entry.offset + entry.bytes > fileSize) {
+        return std::nullopt;
+      }
+      const int column = entry.tile % tiles.columns();
+      const int row = entry.tile / tiles.columns();
+      tiles.setTile(column, row,
+                    std::make_shared<Tile>(
+                        tiles.tileRect(column, row).size(),
+                        TileLocation{store, entry.offset, entry.bytes}));
+    }
+
+    Layer layer(tiles, name);
+    layer.setVisible(visible);
+    layer.setOpacity(opacity);
+    layer.setBlendMode(static_cast<QPainter::CompositionMode>(blendMode));
+    layer.setOffset(offset);
+    state.layers.push_back(std::move(layer));
+  }
+
+  if (stream.status() != QDataStream::Ok) {
+    return std::nullopt;
+  }
+  return state;
+}
+
+bool ProjectFile::save(const QString &path, const DocumentState &state,
+                       const Progress &progress) {
+  const QString target = QFileInfo(path).absoluteFilePath();
+
+  // Appending only pays off while most of the file is still in use.
+  std::shared_ptr<ProjectFile> store = currentStore(target);
+  if (store) {
+    qint64 reusedBytes = 0;
+    for (const Layer &layer : state.layers) {
+      for (const auto &tile : layer.tiles().tileStorage()) {
+        if (tile) {
+          reusedBytes += tile->location(store.get()).bytes;
+        }
+      }
+    }
+    if (store->size() - reusedBytes <= reusedBytes &&
+        store->append(state, progress)) {
+      return true;
+    }
+  }
+
+  return writeFresh(target, state, progress);
+}
+
+std::optional<ProjectFile::Revision> ProjectFile::readHeader() {
+  QByteArray head = read(0, HeaderBytes);
+  QDataStream stream(head);
+  QByteArray magic(Magic.size(), '\0');
+  stream.readRawData(magic.data(), magic.size());
+  quint32 version = 0;
+  Revision revision;
+  stream >> version >> revision.checksum >> revision.indexOffset >>
+      revision.indexBytes;
+  if (stream.status() != QDataStream::Ok || magic != Magic ||
+      version != Version) {
+    return std::nullopt;
+  }
+  return revision;
+}
+
+QByteArray ProjectFile::read(qint64 offset, qint64 bytes) {
+  QMutexLocker locker(&m_mutex);
+  if (!m_file.seek(offset)) {
+    return QByteArray();
+  }
+  QByteArray data = m_file.read(bytes);
+  return data.size() == bytes ? data : QByteArray();
+}
+
+std::shared_ptr<ProjectFile> ProjectFile::open(const QString &path) {
+  if (std::shared_ptr<ProjectFile> store = currentStore(path)) {
+    return store;
+  }
+
+  std::shared_ptr<ProjectFile> store(new ProjectFile(path));
+  // A read-only project still opens; saving to it then rewrites it.
+  if (!store->m_file.open(QIODevice::ReadWrite) &&
+      !store->m_file.open(QIODevice::ReadOnly)) {
+    return nullptr;
+  }
+  setCurrentStore(path, store);
+  return store;
+}
+
+bool ProjectFile::writeFresh(const QString &path,
+                             const DocumentState &state,
+                             const Progress &progress) {
+  QSaveFile file(path);
+  if (!file.open(QIODevice::WriteOnly) ||
+      file.write(QByteArray(HeaderBytes, '\0')) != HeaderBytes) {
+    return false;
+  }
+
+  LayerIndex index;
+  std::vector<PendingTile> written;
+  bool ok = writeTiles(
+      state, nullptr,
+      [&file](const QByteArray &data) -> std::optional<qint64> {
+        qint64 offset = file.pos();
+        if (file.write(data) != data.size()) {
+          return std::nullopt;
+        }
+        return offset;
+      },
+      progress, index, written);
+  if (!ok) {
+    file.cancelWriting();
+    return false;
+  }
+
+  QByteArray indexBytes = serializeIndex(state, index);
+  qint64 indexOffset = file.pos();
+  if (file.write(indexBytes) != indexBytes.size() || !file.seek(0) ||
+      file.write(header(indexOffset, indexBytes)) != HeaderBytes ||
+      !file.commit()) {
+    return false;
+  }
+
+  // The old file, if any, was replaced by a rename; tiles still reading
+  // from it keep their handle, and the saved tiles move to the new one.
+  setCurrentStore(path, nullptr);
+  std::shared_ptr<ProjectFile> store = open(path);
+  if (!store) {
+    return true;
+  }
+  for (const PendingTile &tile : written) {
+    const IndexEntry &entry = index[tile.layer][tile.entry];
+    tile.tile->addLocation({store, entry.offset, entry.bytes});
+  }
+  return true;
+}
+
+bool ProjectFile::append(const DocumentState &state,
+                         const Progress &progress) {
+  if (!m_file.isWritable()) {
+    return false;
+  }
+
+  LayerIndex index;
+  std::vector<PendingTile> written;
+  bool ok = writeTiles(
+      state, this, [this](const QByteArray &data) { return write(data); },
+      progress, index, written);
+  if (!ok) {
+    return false;
+  }
+
+  // The header is switched over last, so until then the file still reads
+  // as the previous version.
+  QByteArray indexBytes = serializeIndex(state, index);
+  std::optional<qint64> indexOffset = write(indexBytes);
+  if (!indexOffset || !writeHeader(header(*indexOffset, indexBytes))) {
+    return false;
+  }
+
+  std::shared_ptr<ProjectFile> self = shared_from_this();
+  for (const PendingTile &tile : written) {
+    const IndexEntry &entry = index[tile.layer][tile.entry];
+    tile.tile->addLocation({self, entry.offset, entry.bytes});
+  }
+  return true;
+}
+
+qint64 ProjectFile::size() {
+  QMutexLocker locker(&m_mutex);
+  return m_file.size();
+}
+
+std::optional<qint64> ProjectFile::write(const QByteArray &data) {
+  QMutexLocker locker(&m_mutex);
+  const qint64 offset = m_file.size();
+  if (!m_file.seek(offset) || m_file.write(data) != data.size()) {
+    return std::nullopt;
+  }
+  return offset;
+}
+
+bool ProjectFile::writeHeader(const QByteArray &header) {
+  // Both syncs matter: the tiles and index must be on disk before the
+  // header points at them, and the header before the save reports done.
+  QMutexLocker locker(&m_mutex);
+  return m_file.flush() && syncToDisk(m_file) && m_file.seek(0) &&
+         m_file.write(header) == header.size() && m_file.flush() &&
+         syncToDisk(m_file);
+}
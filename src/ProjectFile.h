@@ -0,0 +1,69 @@
+#ifndef PROJECTFILE_H
+#define PROJECTFILE_H
+
+#include "EditCommand.h"
+
+#include <QFile>
+#include <QMutex>
+#include <QString>
+#include <functional>
+#include <memory>
+#include <optional>
+
+// Native .picture container: a header pointing at an index of layers and
+// tiles, and each tile compressed on its own. Loading reads only the
+// index; tiles stay in the file until something draws or edits them.
+// Saving back to the same file appends the tiles that changed and a new
+// index, then switches the header over, so an interrupted save leaves
+// the previous version intact. Once most of the file is stale, the next
+// save rewrites it from scratch.
+class ProjectFile : public std::enable_shared_from_this<ProjectFile> {
+public:
+  // Receives the percentage of tiles written so far.
+  using Progress = std::function<void(int percent)>;
+
+  // One saved version of a project: where its index sits and its
+  // checksum. A default revision means the latest one.
+  struct Revision {
+    qint64 indexOffset = -1;
+    qint64 indexBytes = 0;
+    quint32 checksum = 0;
+  };
+
+  static bool isProjectPath(const QString &path);
+
+  static std::optional<Revision> revision(const QString &path);
+  // Deletes a project file that nothing will save to again.
+  static void remove(const QString &path);
+  static std::optional<DocumentState>
+  load(const QString &path, const Revision &revision = Revision());
+  // Safe to call off the GUI thread.
+  static bool save(const QString &path, const DocumentState &state,
+                   const Progress &progress = Progress());
+
+  ~ProjectFile();
+
+  QString path() const;
+  // Reads the compressed bytes of one tile, or returns an empty array if
+  // they cannot all be read. Safe from any thread.
+  QByteArray read(qint64 offset, qint64 bytes);
+
+private:
+  explicit ProjectFile(const QString &path);
+
+  static std::shared_ptr<ProjectFile> open(const QString &path);
+  static bool writeFresh(const QString &path, const DocumentState &state,
+                         const Progress &progress);
+  bool append(const DocumentState &state, const Progress &progress);
+
+  std::optional<Revision> readHeader();
+  qint64 size();
+  std::optional<qint64> write(const QByteArray &data);
+  bool writeHeader(const QByteArray &header);
+
+  QString m_path;
+  QMutex m_mutex;
+  QFile m_file;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#include "Recipe.h"
+
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <utility>
+
+namespace {
+
+const char *const FormatName = "picture-recipe";
+constexpr int FormatVersion = 1;
+
+} // namespace
+
+Recipe::Recipe(std::vector<EditCommand> steps) : m_steps(std::move(steps)) {}
+
+const std::vector<EditCommand> &Recipe::steps() const { return m_steps; }
+
+bool Recipe::isEmpty() const { return m_steps.empty(); }
+
+bool Recipe::save(const QString &path) const {
+  QJsonArray steps;
+  for (const EditCommand &step : m_steps) {
+    steps.append(step.toJson());
+  }
+  QJsonObject root{{"format", FormatName},
+                   {"version", FormatVersion},
+                   {"steps", steps}};
+
+  QSaveFile file(path);
+  if (!file.open(QIODevice::WriteOnly)) {
+    return false;
+  }
+  QByteArray json = QJsonDocument(root).toJson(QJsonDocument::Indented);
+  return file.write(json) == json.size() && file.commit();
+}
+
+std::optional<Recipe> Recipe::load(const QString &path) {
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return std::nullopt;
+  }
+
+  QJsonObject root = QJsonDocument::fromJson(file.readAll()).object();
+  if (root["format"].toString() != QLatin1String(FormatName) ||
+      root["version"].toInt() > FormatVersion) {
+    return std::nullopt;
+  }
+
+  return fromJson(root["steps"].toArray());
+}
+
+std::optional<Recipe> Recipe::fromJson(const QJsonArray &steps) {
+  std::vector<EditCommand> commands;
+  for (const QJsonValue &value : steps) {
+    std::optional<EditCommand> step = EditCommand::fromJson(value.toObject());
+    if (!step) {
+      return std::nullopt;
+    }
+    commands.push_back(*step);
+  }
+  return Recipe(std::move(commands));
+}
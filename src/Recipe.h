@@ -0,0 +1,33 @@
+#ifndef RECIPE_H
+#define RECIPE_H
+
+#include "EditCommand.h"
+
+#include <QJsonArray>
+#include <QString>
+#include <optional>
+#include <vector>
+
+// A sequence of whole-image edits saved as JSON, for replaying one
+// session's resizes, crops, rotations, filters and adjustments on other
+// images. Steps use the same JSON as the recovery journal. Brush strokes
+// and layer changes have no command, so they are not part of a recipe.
+class Recipe {
+public:
+  Recipe() = default;
+  explicit Recipe(std::vector<EditCommand> steps);
+
+  const std::vector<EditCommand> &steps() const;
+  bool isEmpty() const;
+
+  bool save(const QString &path) const;
+  // Returns nothing when the file is unreadable or has an unknown step.
+  static std::optional<Recipe> load(const QString &path);
+  // Reads the steps array of a recipe file.
+  static std::optional<Recipe> fromJson(const QJsonArray &steps);
+
+private:
+  std::vector<EditCommand> m_steps;
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include "StrokeStabilizer.h"
+
+#include <QLineF>
+#include <QtMath>
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+constexpr qreal MaxStringLength = 40.0;
+constexpr qreal MinCutoffLow = 0.3;
+constexpr qreal MinCutoffHigh = 8.0;
+constexpr qreal SpeedCoefficient = 0.02;
+constexpr qreal DerivativeCutoff = 1.0;
+constexpr qreal VelocitySmoothing = 0.5;
+
+qreal smoothingFactor(qreal cutoff, qreal dtSeconds) {
+  qreal tau = 1.0 / (2.0 * M_PI * cutoff);
+  return 1.0 / (1.0 + tau / dtSeconds);
+}
+
+} // namespace
+
+StrokeStabilizer::StrokeStabilizer()
+    : m_mode(Mode::None), m_strength(0.5), m_predictionHorizon(0),
+      m_rawPos(), m_rawVelocity(), m_lastPos(), m_velocity(),
+      m_lastTimestamp(0), m_lastOutputTimestamp(0) {}
+
+void StrokeStabilizer::setMode(Mode mode) { m_mode = mode; }
+
+StrokeStabilizer::Mode StrokeStabilizer::mode() const { return m_mode; }
+
+void StrokeStabilizer::setStrength(qreal strength) {
+  m_strength = std::clamp(strength, 0.0, 1.0);
+}
+
+qreal StrokeStabilizer::strength() const { return m_strength; }
+
+void StrokeStabilizer::setPredictionHorizon(int msecs) {
+  m_predictionHorizon = std::max(0, msecs);
+}
+
+int StrokeStabilizer::predictionHorizon() const { return m_predictionHorizon; }
+
+StrokeSample StrokeStabilizer::begin(const StrokeSample &sample) {
+  m_rawPos = sample.pos;
+  m_rawVelocity = QPointF();
+  m_lastPos = sample.pos;
+  m_velocity = QPointF();
+  m_lastTimestamp = sample.timestamp;
+  m_lastOutputTimestamp = sample.timestamp;
+  return sample;
+}
+
+void StrokeStabilizer::filter(const std::vector<StrokeSample> &input,
+                              std::vector<StrokeSample> &output) {
+  output.clear();
+  output.reserve(input.size());
+
+  for (const auto &sample : input) {
+    StrokeSample filtered;
+    if (filterSample(sample, filtered)) {
+      trackVelocity(filtered);
+      output.push_back(filtered);
+    }
+  }
+}
+
+std::vector<StrokeSample> StrokeStabilizer::finish(const StrokeSample &sample) {
+  std::vector<StrokeSample> tail;
+  filter({sample}, tail);
+
+  // The one-euro filter only lags, so the stroke is pulled onto the
+  // release point. A pulled string deliberately stays where it is.
+  if (m_mode == Mode::OneEuro && m_lastPos != sample.pos) {
+    tail.push_back(sample);
+    m_lastPos = sample.pos;
+  }
+
+  m_velocity = QPointF();
+  return tail;
+}
+
+bool StrokeStabilizer::hasPrediction() const {
+  return m_predictionHorizon > 0 && !m_velocity.isNull();
+}
+
+QPointF StrokeStabilizer::lastPosition() const { return m_lastPos; }
+
+QPointF StrokeStabilizer::predictedPosition() const {
+  return m_lastPos + m_velocity * m_predictionHorizon;
+}
+
+bool StrokeStabilizer::filterSample(const StrokeSample &input,
+                                    StrokeSample &output) {
+  output = input;
+
+  qreal dt = input.timestamp > m_lastTimestamp
+                 ? static_cast<qreal>(input.timestamp - m_lastTimestamp)
+                 : 1.0;
+  m_lastTimestamp = input.timestamp;
+
+  if (m_mode == Mode::None || qFuzzyIsNull(m_strength)) {
+    m_rawPos = input.pos;
+    return true;
+  }
+
+  if (m_mode == Mode::PulledString) {
+    qreal length = m_strength * MaxStringLength;
+    QLineF string(m_lastPos, input.pos);
+    if (string.length() <= length) {
+      return false;
+    }
+    string.setLength(string.length() - length);
+    output.pos = string.p2();
+    return true;
+  }
+
+  // One-euro filter: the cutoff frequency rises with pen speed, so slow
+  // detail work is smoothed heavily while fast strokes keep up.
+  qreal dtSeconds = dt / 1000.0;
+  QPointF rawVelocity = (input.pos - m_rawPos) / dtSeconds;
+  m_rawPos = input.pos;
+
+  qreal derivativeAlpha = smoothingFactor(DerivativeCutoff, dtSeconds);
+  m_rawVelocity += (rawVelocity - m_rawVelocity) * derivativeAlpha;
+
+  qreal speed = std::hypot(m_rawVelocity.x(), m_rawVelocity.y());
+  qreal minCutoff =
+      MinCutoffHigh + (MinCutoffLow - MinCutoffHigh) * m_strength;
+  qreal alpha = smoothingFactor(minCutoff + SpeedCoefficient * speed,
+                                dtSeconds);
+
+  output.pos = m_lastPos + (input.pos - m_lastPos) * alpha;
+  return true;
+}
+
+void StrokeStabilizer::trackVelocity(const StrokeSample &output) {
+  qreal dt = output.timestamp > m_lastOutputTimestamp
+                 ? static_cast<qreal>(output.timestamp - m_lastOutputTimestamp)
+                 : 1.0;
+  QPointF velocity = (output.pos - m_lastPos) / dt;
+  m_velocity += (velocity - m_velocity) * VelocitySmoothing;
+
+  m_lastPos = output.pos;
+  m_lastOutputTimestamp = output.timestamp;
+}
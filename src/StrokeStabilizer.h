@@ -0,0 +1,52 @@
+#ifndef STROKESTABILIZER_H
+#define STROKESTABILIZER_H
+
+#include "DrawingTool.h"
+
+#include <QPointF>
+#include <vector>
+
+class StrokeStabilizer {
+public:
+  enum class Mode { None, PulledString, OneEuro };
+
+  StrokeStabilizer();
+
+  void setMode(Mode mode);
+  Mode mode() const;
+
+  // 0 keeps the raw input, 1 applies the heaviest smoothing.
+  void setStrength(qreal strength);
+  qreal strength() const;
+
+  // How far ahead, in milliseconds, predictedPosition() extrapolates the
+  // stroke.
+  void setPredictionHorizon(int msecs);
+  int predictionHorizon() const;
+
+  StrokeSample begin(const StrokeSample &sample);
+  void filter(const std::vector<StrokeSample> &input,
+              std::vector<StrokeSample> &output);
+  std::vector<StrokeSample> finish(const StrokeSample &sample);
+
+  bool hasPrediction() const;
+  QPointF lastPosition() const;
+  QPointF predictedPosition() const;
+
+private:
+  bool filterSample(const StrokeSample &input, StrokeSample &output);
+  void trackVelocity(const StrokeSample &output);
+
+  Mode m_mode;
+  qreal m_strength;
+  int m_predictionHorizon;
+
+  QPointF m_rawPos;
+  QPointF m_rawVelocity;
+  QPointF m_lastPos;
+  QPointF m_velocity;
+  quint64 m_lastTimestamp;
+  quint64 m_lastOutputTimestamp;
+};
+
+#endif
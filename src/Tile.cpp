@@ -0,0 +1,208 @@
+#include "Tile.h"
+#include "MappedImage.h"
+#include "ProjectFile.h"
+#include "TileCache.h"
+#include "TileSwap.h"
+
+#include <cstring>
+#include <utility>
+
+namespace {
+
+// Level 1 keeps compression cheap enough to run between edits; painted
+// and photographic tiles still shrink to well under half their size.
+constexpr int CompressionLevel = 1;
+
+} // namespace
+
+Tile::Tile(const QImage &image)
+    : m_mutex(), m_size(image.size()), m_image(image), m_packed(),
+      m_slot(-1), m_slotBytes(0), m_locations(), m_source(), m_origin(),
+      m_damaged(false) {
+  TileCache::instance().touch(this, m_image.sizeInBytes());
+}
+
+Tile::Tile(const QSize &size, const TileLocation &location)
+    : m_mutex(), m_size(size), m_image(), m_packed(), m_slot(-1),
+      m_slotBytes(0), m_locations{location}, m_source(), m_origin(),
+      m_damaged(false) {}
+
+Tile::Tile(const QSize &size, std::shared_ptr<const MappedImage> source,
+           const QPoint &origin)
+    : m_mutex(), m_size(size), m_image(), m_packed(), m_slot(-1),
+      m_slotBytes(0), m_locations(), m_source(std::move(source)),
+      m_origin(origin), m_damaged(false) {}
+
+Tile::~Tile() {
+  TileCache::instance().forget(this);
+  releaseSlot();
+}
+
+QSize Tile::size() const { return m_size; }
+
+qsizetype Tile::residentBytes() const {
+  QMutexLocker locker(&m_mutex);
+  return m_image.sizeInBytes() + m_packed.size();
+}
+
+QImage Tile::image() {
+  QImage image;
+  {
+    QMutexLocker locker(&m_mutex);
+    load();
+    image = m_image;
+  }
+  // The cache is told after the tile lock is released; TileCache::trim
+  // takes the two locks in the opposite order.
+  TileCache::instance().touch(this, image.sizeInBytes());
+  return image;
+}
+
+QImage &Tile::imageForWriting() {
+  {
+    QMutexLocker locker(&m_mutex);
+    load();
+    // The swapped and saved copies go stale as soon as the caller writes.
+    releaseSlot();
+    m_locations.clear();
+    m_source.reset();
+  }
+  TileCache::instance().touch(this, m_image.sizeInBytes());
+  return m_image;
+}
+
+bool Tile::isDamaged() const {
+  QMutexLocker locker(&m_mutex);
+  return m_damaged;
+}
+
+TileLocation Tile::location(const ProjectFile *file) const {
+  QMutexLocker locker(&m_mutex);
+  for (const TileLocation &location : m_locations) {
+    if (location.file.get() == file) {
+      return location;
+    }
+  }
+  return TileLocation();
+}
+
+void Tile::addLocation(const TileLocation &location) {
+  QMutexLocker locker(&m_mutex);
+  std::erase_if(m_locations, [&location](const TileLocation &existing) {
+    return existing.file->path() == location.file->path();
+  });
+  m_locations.push_back(location);
+}
+
+QByteArray Tile::packedData() {
+  QMutexLocker locker(&m_mutex);
+  if (m_damaged) {
+    return QByteArray();
+  }
+  if (!m_packed.isEmpty()) {
+    return m_packed;
+  }
+  if (!m_image.isNull()) {
+    return qCompress(m_image.constBits(), m_image.sizeInBytes(),
+                     CompressionLevel);
+  }
+  if (m_slot >= 0) {
+    QByteArray packed = TileSwap::instance().load(m_slot, m_slotBytes);
+    if (packed.isEmpty()) {
+      qWarning("Could not read a %dx%d tile back from swap",
+               m_size.width(), m_size.height());
+      m_damaged = true;
+    }
+    return packed;
+  }
+  if (!m_locations.empty()) {
+    const TileLocation &location = m_locations.front();
+    QByteArray packed = location.file->read(location.offset, location.bytes);
+    if (packed.isEmpty()) {
+      qWarning("Could not read a %dx%d tile from %s", m_size.width(),
+               m_size.height(), qPrintable(location.file->path()));
+      m_damaged = true;
+    }
+    return packed;
+  }
+  if (m_source) {
+    const QImage image = m_source->copy(QRect(m_origin, m_size));
+    return qCompress(image.constBits(), image.sizeInBytes(),
+                     CompressionLevel);
+  }
+  return QByteArray();
+}
+
+qsizetype Tile::pack() {
+  QMutexLocker locker(&m_mutex);
+  // A tile that was only read since it came back from swap or was loaded
+  // from a project or mapped file still has a valid copy there, so
+  // evicting it is free.
+  if (m_image.isNull() || m_slot >= 0 || !m_locations.empty() || m_source) {
+    m_image = QImage();
+    return 0;
+  }
+
+  m_packed = qCompress(m_image.constBits(), m_image.sizeInBytes(),
+                       CompressionLevel);
+  m_image = QImage();
+  return m_packed.size();
+}
+
+bool Tile::spill() {
+  QMutexLocker locker(&m_mutex);
+  if (m_packed.isEmpty()) {
+    return false;
+  }
+
+  int slot = TileSwap::instance().store(m_packed);
+  if (slot < 0) {
+    return false;
+  }
+
+  m_slot = slot;
+  m_slotBytes = m_packed.size();
+  m_packed = QByteArray();
+  return true;
+}
+
+void Tile::load() {
+  if (!m_image.isNull()) {
+    return;
+  }
+
+  QByteArray packed = m_packed;
+  if (packed.isEmpty() && m_slot >= 0) {
+    packed = TileSwap::instance().load(m_slot, m_slotBytes);
+  }
+  if (packed.isEmpty() && !m_locations.empty()) {
+    const TileLocation &location = m_locations.front();
+    packed = location.file->read(location.offset, location.bytes);
+  }
+  if (packed.isEmpty() && m_source) {
+    m_image = m_source->copy(QRect(m_origin, m_size));
+    return;
+  }
+
+  m_image = QImage(m_size, QImage::Format_ARGB32_Premultiplied);
+  QByteArray pixels = qUncompress(packed);
+  if (pixels.size() == m_image.sizeInBytes()) {
+    std::memcpy(m_image.bits(), pixels.constData(), pixels.size());
+  } else {
+    // The pixels are gone. Saying so, and keeping the tile marked, stops
+    // the blank stand-in from being saved over the real image.
+    qWarning("Could not read back a %dx%d tile",
+             m_size.width(), m_size.height());
+    m_damaged = true;
+    m_image.fill(Qt::transparent);
+  }
+  m_packed = QByteArray();
+}
+
+void Tile::releaseSlot() {
+  if (m_slot >= 0) {
+    TileSwap::instance().release(m_slot);
+    m_slot = -1;
+    m_slotBytes = 0;
+  }
+}
@@ -0,0 +1,81 @@
+#ifndef TILE_H
+#define TILE_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QMutex>
+#include <QPoint>
+#include <memory>
+#include <vector>
+
+class MappedImage;
+class ProjectFile;
+
+// Where a clean copy of a tile's compressed pixels lives in a project file.
+struct TileLocation {
+  std::shared_ptr<ProjectFile> file;
+  qint64 offset = 0;
+  qint64 bytes = 0;
+};
+
+// Pixels of one TiledImage tile. Tiles are shared between TiledImage
+// copies until one of them writes. Under memory pressure TileCache moves
+// cold tiles down from decoded pixels, to compressed bytes in RAM, to a
+// slot in the TileSwap scratch file; any access brings them back. A tile
+// that is unchanged since it was saved or loaded can always be dropped
+// and read back from a project file, and may sit in several at once,
+// e.g. the user's project and the autosave. A tile of a MappedImage
+// reads from the mapping the same way until it is first written.
+class Tile {
+public:
+  explicit Tile(const QImage &image);
+  // A tile whose pixels stay in a project file until first accessed.
+  Tile(const QSize &size, const TileLocation &location);
+  // A tile whose pixels stay in a mapped file until first accessed.
+  Tile(const QSize &size, std::shared_ptr<const MappedImage> source,
+       const QPoint &origin);
+  ~Tile();
+
+  Tile(const Tile &) = delete;
+  Tile &operator=(const Tile &) = delete;
+
+  QSize size() const;
+  qsizetype residentBytes() const;
+
+  QImage image();
+  QImage &imageForWriting();
+  // True once the pixels could not be read back from where the tile kept
+  // them. The tile then holds transparent pixels in their place, and a
+  // document that contains it must not be saved.
+  bool isDamaged() const;
+
+  // Where the tile is stored in file, or an empty location.
+  TileLocation location(const ProjectFile *file) const;
+  // Replaces any location in an earlier version of the same file.
+  void addLocation(const TileLocation &location);
+  // The pixels compressed the way swap and project files store them.
+  QByteArray packedData();
+
+  // Drops the decoded pixels and returns how many bytes stay in RAM.
+  // Called by TileCache.
+  qsizetype pack();
+  // Moves compressed bytes to the swap file. Called by TileCache.
+  bool spill();
+
+private:
+  void load();
+  void releaseSlot();
+
+  mutable QMutex m_mutex;
+  QSize m_size;
+  QImage m_image;
+  QByteArray m_packed;
+  int m_slot;
+  qsizetype m_slotBytes;
+  std::vector<TileLocation> m_locations;
+  std::shared_ptr<const MappedImage> m_source;
+  QPoint m_origin;
+  bool m_damaged;
+};
+
+#endif
@@ -0,0 +1,133 @@
+#include "TileCache.h"
+#include "Tile.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace {
+
+constexpr qsizetype DefaultBudget = qsizetype(1024) * 1024 * 1024;
+
+} // namespace
+
+TileCache &TileCache::instance() {
+  static TileCache cache;
+  return cache;
+}
+
+TileCache::TileCache()
+    : m_mutex(), m_budget(DefaultBudget), m_decodedBytes(0), m_packedBytes(0),
+      m_decoded(), m_packed(), m_index() {}
+
+void TileCache::setBudget(qsizetype bytes) {
+  QMutexLocker locker(&m_mutex);
+  m_budget = std::max<qsizetype>(bytes, 0);
+}
+
+qsizetype TileCache::budget() const {
+  QMutexLocker locker(&m_mutex);
+  return m_budget;
+}
+
+qsizetype TileCache::residentBytes() const {
+  QMutexLocker locker(&m_mutex);
+  return m_decodedBytes + m_packedBytes;
+}
+
+void TileCache::touch(Tile *tile, qsizetype bytes) {
+  QMutexLocker locker(&m_mutex);
+  auto found = m_index.find(tile);
+  if (found != m_index.end()) {
+    if (!found->second->packed) {
+      m_decoded.splice(m_decoded.begin(), m_decoded, found->second);
+      return;
+    }
+    // The tile was decompressed, so its packed bytes are gone.
+    remove(found->second);
+  }
+
+  m_decoded.push_front({tile, bytes, false});
+  m_index[tile] = m_decoded.begin();
+  m_decodedBytes += bytes;
+}
+
+void TileCache::forget(Tile *tile) {
+  QMutexLocker locker(&m_mutex);
+  auto found = m_index.find(tile);
+  if (found != m_index.end()) {
+    remove(found->second);
+  }
+}
+
+void TileCache::demote(Tile *tile) {
+  QMutexLocker locker(&m_mutex);
+  auto found = m_index.find(tile);
+  if (found == m_index.end()) {
+    return;
+  }
+
+  std::list<Entry> &list = found->second->packed ? m_packed : m_decoded;
+  list.splice(list.end(), list, found->second);
+}
+
+void TileCache::trim() {
+  QMutexLocker locker(&m_mutex);
+  if (m_budget == 0) {
+    return;
+  }
+
+  while (m_decodedBytes > m_budget && !m_decoded.empty()) {
+    pack(std::prev(m_decoded.end()));
+  }
+
+  // Tiles that cannot be spilled stay packed in RAM rather than failing.
+  const qsizetype packedBudget = m_budget / 4;
+  auto entry = m_packed.end();
+  while (m_packedBytes > packedBudget && entry != m_packed.begin()) {
+    --entry;
+    if (entry->tile->spill()) {
+      auto next = std::next(entry);
+      remove(entry);
+      entry = next;
+    }
+  }
+}
+
+void TileCache::evict(Tile *tile, bool spill) {
+  QMutexLocker locker(&m_mutex);
+  auto found = m_index.find(tile);
+  if (found == m_index.end()) {
+    return;
+  }
+
+  if (!found->second->packed) {
+    pack(found->second);
+    found = m_index.find(tile);
+  }
+  if (spill && found != m_index.end() && tile->spill()) {
+    remove(found->second);
+  }
+}
+
+void TileCache::pack(std::list<Entry>::iterator entry) {
+  Tile *tile = entry->tile;
+  remove(entry);
+
+  qsizetype packedBytes = tile->pack();
+  if (packedBytes > 0) {
+    m_packed.push_front({tile, packedBytes, true});
+    m_index[tile] = m_packed.begin();
+    m_packedBytes += packedBytes;
+  }
+}
+
+void TileCache::remove(std::list<Entry>::iterator entry) {
+  m_index.erase(entry->tile);
+  if (entry->packed) {
+    m_packedBytes -= entry->bytes;
+    m_packed.erase(entry);
+  } else {
+    m_decodedBytes -= entry->bytes;
+    m_decoded.erase(entry);
+  }
+}
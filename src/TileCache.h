@@ -0,0 +1,61 @@
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include <QMutex>
+#include <QtGlobal>
+#include <list>
+#include <unordered_map>
+
+class Tile;
+
+// Process-wide LRU of tiles held in RAM. Once decoded tiles exceed the
+// budget, trim() compresses the least recently used ones; once those
+// compressed bytes exceed a quarter of the budget, the oldest of them are
+// spilled to the swap file. All open documents share the one budget;
+// tiles of documents in background tabs are demoted so they go first.
+class TileCache {
+public:
+  static TileCache &instance();
+
+  // A budget of 0 disables eviction.
+  void setBudget(qsizetype bytes);
+  qsizetype budget() const;
+
+  qsizetype residentBytes() const;
+
+  void touch(Tile *tile, qsizetype bytes);
+  void forget(Tile *tile);
+  // Moves a tile to the cold end of the LRU, so trim() reaches it before
+  // any tile in use.
+  void demote(Tile *tile);
+
+  // Only call these while no other thread is writing tiles, e.g. from
+  // the GUI thread between edits. evict() is also safe on a tile no other
+  // thread can reach yet.
+  void trim();
+  // Compresses one tile now, and optionally spills it to swap, whatever
+  // its place in the LRU.
+  void evict(Tile *tile, bool spill);
+
+private:
+  struct Entry {
+    Tile *tile;
+    qsizetype bytes;
+    bool packed;
+  };
+
+  TileCache();
+
+  void remove(std::list<Entry>::iterator entry);
+  void pack(std::list<Entry>::iterator entry);
+
+  mutable QMutex m_mutex;
+  qsizetype m_budget;
+  qsizetype m_decodedBytes;
+  qsizetype m_packedBytes;
+  std::list<Entry> m_decoded;
+  std::list<Entry> m_packed;
+  std::unordered_map<const Tile *, std::list<Entry>::iterator> m_index;
+};
+
+#endif
@@ -0,0 +1,90 @@
+#include "TileSwap.h"
+#include "TiledImage.h"
+
+#include <QDir>
+#include <cstring>
+
+namespace {
+
+constexpr qsizetype SlotBytes =
+    qsizetype(TiledImage::TileSize) * TiledImage::TileSize * 4;
+constexpr int SlotsPerChunk = 256;
+constexpr qsizetype ChunkBytes = SlotBytes * SlotsPerChunk;
+
+} // namespace
+
+TileSwap &TileSwap::instance() {
+  static TileSwap swap;
+  return swap;
+}
+
+TileSwap::TileSwap()
+    : m_mutex(), m_file(QDir::tempPath() + "/picture-swap-XXXXXX"),
+      m_failed(false), m_chunks(), m_freeSlots() {}
+
+int TileSwap::store(const QByteArray &data) {
+  if (data.size() > SlotBytes) {
+    return -1;
+  }
+
+  QMutexLocker locker(&m_mutex);
+  if (m_freeSlots.empty() && (!open() || !grow())) {
+    return -1;
+  }
+
+  int slot = m_freeSlots.back();
+  m_freeSlots.pop_back();
+  std::memcpy(slotData(slot), data.constData(), data.size());
+  return slot;
+}
+
+QByteArray TileSwap::load(int slot, qsizetype length) const {
+  QMutexLocker locker(&m_mutex);
+  return QByteArray(reinterpret_cast<const char *>(slotData(slot)), length);
+}
+
+void TileSwap::release(int slot) {
+  QMutexLocker locker(&m_mutex);
+  m_freeSlots.push_back(slot);
+}
+
+bool TileSwap::open() {
+  if (m_file.isOpen()) {
+    return true;
+  }
+  if (m_failed) {
+    return false;
+  }
+
+  // The scratch file is created lazily, the first time a tile spills.
+  if (!m_file.open()) {
+    qWarning("Could not create tile swap file in %s",
+             qPrintable(QDir::tempPath()));
+    m_failed = true;
+    return false;
+  }
+  return true;
+}
+
+bool TileSwap::grow() {
+  qsizetype offset = static_cast<qsizetype>(m_chunks.size()) * ChunkBytes;
+  if (!m_file.resize(offset + ChunkBytes)) {
+    return false;
+  }
+
+  uchar *chunk = m_file.map(offset, ChunkBytes);
+  if (!chunk) {
+    return false;
+  }
+
+  int firstSlot = static_cast<int>(m_chunks.size()) * SlotsPerChunk;
+  m_chunks.push_back(chunk);
+  for (int slot = firstSlot + SlotsPerChunk - 1; slot >= firstSlot; --slot) {
+    m_freeSlots.push_back(slot);
+  }
+  return true;
+}
+
+uchar *TileSwap::slotData(int slot) const {
+  return m_chunks[slot / SlotsPerChunk] + (slot % SlotsPerChunk) * SlotBytes;
+}
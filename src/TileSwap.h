@@ -0,0 +1,36 @@
+#ifndef TILESWAP_H
+#define TILESWAP_H
+
+#include <QByteArray>
+#include <QMutex>
+#include <QTemporaryFile>
+#include <vector>
+
+// Scratch file for tiles pushed out of RAM. The file grows in chunks that
+// are memory-mapped once, and every tile gets a fixed-size slot, so the
+// kernel page cache does the actual buffering.
+class TileSwap {
+public:
+  static TileSwap &instance();
+
+  // Returns the slot holding the data, or -1 if it does not fit or the
+  // scratch file cannot grow.
+  int store(const QByteArray &data);
+  QByteArray load(int slot, qsizetype length) const;
+  void release(int slot);
+
+private:
+  TileSwap();
+
+  bool open();
+  bool grow();
+  uchar *slotData(int slot) const;
+
+  mutable QMutex m_mutex;
+  QTemporaryFile m_file;
+  bool m_failed;
+  std::vector<uchar *> m_chunks;
+  std::vector<int> m_freeSlots;
+};
+
+#endif
@@ -0,0 +1,312 @@
+#include "TiledImage.h"
+#include "Tile.h"
+
+#include <QPainter>
+#include <QtConcurrent>
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+TiledImage::TiledImage() : m_size(), m_columns(0), m_rows(0), m_tiles() {}
+
+TiledImage::TiledImage(const QSize &size)
+    : m_size(size.expandedTo(QSize(0, 0))),
+      m_columns((m_size.width() + TileSize - 1) / TileSize),
+      m_rows((m_size.height() + TileSize - 1) / TileSize),
+      m_tiles(static_cast<size_t>(m_columns) * m_rows) {}
+
+TiledImage::TiledImage(const QImage &image) : TiledImage(image.size()) {
+  setImage(image);
+}
+
+bool TiledImage::isNull() const { return m_size.isEmpty(); }
+
+QSize TiledImage::size() const { return m_size; }
+
+int TiledImage::width() const { return m_size.width(); }
+
+int TiledImage::height() const { return m_size.height(); }
+
+QRect TiledImage::rect() const { return QRect(QPoint(0, 0), m_size); }
+
+int TiledImage::columns() const { return m_columns; }
+
+int TiledImage::rows() const { return m_rows; }
+
+QRect TiledImage::tileRect(int column, int row) const {
+  return QRect(column * TileSize, row * TileSize, TileSize, TileSize)
+      .intersected(rect());
+}
+
+QRect TiledImage::tileSpan(const QRect &area) const {
+  QRect clipped = area.intersected(rect());
+  if (clipped.isEmpty()) {
+    return QRect();
+  }
+  return QRect(QPoint(clipped.left() / TileSize, clipped.top() / TileSize),
+               QPoint(clipped.right() / TileSize, clipped.bottom() / TileSize));
+}
+
+bool TiledImage::hasTile(int column, int row) const {
+  return m_tiles[tileIndex(column, row)] != nullptr;
+}
+
+QImage TiledImage::tile(int column, int row) const {
+  const std::shared_ptr<Tile> &tile = m_tiles[tileIndex(column, row)];
+  return tile ? tile->image() : QImage();
+}
+
+QImage &TiledImage::tileForWriting(int column, int row) {
+  std::shared_ptr<Tile> &tile = m_tiles[tileIndex(column, row)];
+  if (!tile) {
+    QImage image(tileRect(column, row).size(),
+                 QImage::Format_ARGB32_Premultiplied);
+    image.fill(Qt::transparent);
+    tile = std::make_shared<Tile>(image);
+  } else if (tile.use_count() > 1) {
+    // Another TiledImage still shares this tile; the pixels themselves
+    // are only copied once the caller writes to them.
+    tile = std::make_shared<Tile>(tile->image());
+  }
+  return tile->imageForWriting();
+}
+
+void TiledImage::setTile(int column, int row, const QImage &image) {
+  m_tiles[tileIndex(column, row)] =
+      image.isNull() ? nullptr : std::make_shared<Tile>(image);
+}
+
+void TiledImage::setTile(int column, int row, std::shared_ptr<Tile> tile) {
+  m_tiles[tileIndex(column, row)] = std::move(tile);
+}
+
+void TiledImage::releaseTile(int column, int row) {
+  m_tiles[tileIndex(column, row)].reset();
+}
+
+QRect TiledImage::bounds() const {
+  QRect bounds;
+  for (int row = 0; row < m_rows; ++row) {
+    for (int column = 0; column < m_columns; ++column) {
+      if (hasTile(column, row)) {
+        bounds |= tileRect(column, row);
+      }
+    }
+  }
+  return bounds;
+}
+
+qsizetype TiledImage::allocatedBytes() const {
+  qsizetype bytes = 0;
+  for (const auto &tile : m_tiles) {
+    if (tile) {
+      bytes += qsizetype(tile->size().width()) * tile->size().height() * 4;
+    }
+  }
+  return bytes;
+}
+
+qsizetype TiledImage::residentBytes() const {
+  qsizetype bytes = 0;
+  for (const auto &tile : m_tiles) {
+    if (tile) {
+      bytes += tile->residentBytes();
+    }
+  }
+  return bytes;
+}
+
+bool TiledImage::isDamaged() const {
+  return std::any_of(m_tiles.begin(), m_tiles.end(), [](const auto &tile) {
+    return tile && tile->isDamaged();
+  });
+}
+
+const std::vector<std::shared_ptr<Tile>> &TiledImage::tileStorage() const {
+  return m_tiles;
+}
+
+void TiledImage::setImage(const QImage &image) {
+  QImage source = image;
+  if (source.format() != QImage::Format_ARGB32_Premultiplied) {
+    source = source.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+  }
+
+  *this = TiledImage(source.size());
+
+  for (int row = 0; row < m_rows; ++row) {
+    for (int column = 0; column < m_columns; ++column) {
+      QRect area = tileRect(column, row);
+      if (!isTransparent(source, area)) {
+        setTile(column, row, source.copy(area));
+      }
+    }
+  }
+}
+
+QImage TiledImage::toImage() const {
+  if (isNull()) {
+    return QImage();
+  }
+
+  QImage image(m_size, QImage::Format_ARGB32_Premultiplied);
+  image.fill(Qt::transparent);
+
+  for (int row = 0; row < m_rows; ++row) {
+    for (int column = 0; column < m_columns; ++column) {
+      QImage source = tile(column, row);
+      if (source.isNull()) {
+        continue;
+      }
+      QRect area = tileRect(column, row);
+      for (int y = 0; y < area.height(); ++y) {
+        std::memcpy(image.scanLine(area.top() + y) + area.left() * 4,
+                    source.constScanLine(y), area.width() * 4);
+      }
+    }
+  }
+
+  return image;
+}
+
+QImage TiledImage::copy(const QRect &area) const {
+  QImage image(area.size(), QImage::Format_ARGB32_Premultiplied);
+  image.fill(Qt::transparent);
+
+  QRect span = tileSpan(area);
+  for (int row = span.top(); row <= span.bottom(); ++row) {
+    for (int column = span.left(); column <= span.right(); ++column) {
+      QImage source = tile(column, row);
+      if (source.isNull()) {
+        continue;
+      }
+      QRect tileArea = tileRect(column, row);
+      QRect part = tileArea.intersected(area);
+      for (int y = part.top(); y <= part.bottom(); ++y) {
+        std::memcpy(image.scanLine(y - area.top()) +
+                        (part.left() - area.left()) * 4,
+                    source.constScanLine(y - tileArea.top()) +
+                        (part.left() - tileArea.left()) * 4,
+                    part.width() * 4);
+      }
+    }
+  }
+
+  return image;
+}
+
+TiledImage TiledImage::transformed(
+    const std::function<QImage(const QImage &)> &function, int apron) const {
+  TiledImage result = *this;
+
+  auto process = [&](int index) {
+    const int column = index % m_columns;
+    const int row = index / m_columns;
+    // Transparent tiles only change when a neighbour can bleed into them.
+    if (apron > 0 ? !hasTileNear(column, row) : !hasTile(column, row)) {
+      return;
+    }
+
+    QRect area = tileRect(column, row);
+    QImage output;
+    if (apron > 0) {
+      QRect source = area.adjusted(-apron, -apron, apron, apron) & rect();
+      output = function(copy(source))
+                   .copy(area.translated(-source.topLeft()));
+    } else {
+      const QImage input = tile(column, row);
+      output = function(input);
+      // A function that hands its input back leaves the tile shared.
+      if (output.cacheKey() == input.cacheKey()) {
+        return;
+      }
+    }
+
+    if (output.format() != QImage::Format_ARGB32_Premultiplied) {
+      output = output.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    }
+    result.setTile(column, row,
+                   isTransparent(output, output.rect()) ? QImage() : output);
+  };
+
+  // No cache trim in here: this also runs on worker threads, e.g. for an
+  // undo replay, while the GUI thread may be writing tiles. Callers on the
+  // GUI thread trim once the result is in place.
+  std::vector<int> indices(m_tiles.size());
+  std::iota(indices.begin(), indices.end(), 0);
+  QtConcurrent::blockingMap(indices, process);
+
+  return result;
+}
+
+void TiledImage::optimize(const QRect &area) {
+  QRect span = tileSpan(area);
+  for (int row = span.top(); row <= span.bottom(); ++row) {
+    for (int column = span.left(); column <= span.right(); ++column) {
+      QImage source = tile(column, row);
+      if (!source.isNull() && isTransparent(source, source.rect())) {
+        releaseTile(column, row);
+      }
+    }
+  }
+}
+
+void TiledImage::render(QPainter &painter, const QRectF &targetRect,
+                        const QRect &sourceRect) const {
+  if (sourceRect.isEmpty()) {
+    return;
+  }
+
+  const qreal scaleX = targetRect.width() / qreal(sourceRect.width());
+  const qreal scaleY = targetRect.height() / qreal(sourceRect.height());
+
+  QRect span = tileSpan(sourceRect);
+  for (int row = span.top(); row <= span.bottom(); ++row) {
+    for (int column = span.left(); column <= span.right(); ++column) {
+      QImage source = tile(column, row);
+      if (source.isNull()) {
+        continue;
+      }
+      QRect tileArea = tileRect(column, row);
+      QRect part = tileArea.intersected(sourceRect);
+      QRectF target(targetRect.x() + (part.x() - sourceRect.x()) * scaleX,
+                    targetRect.y() + (part.y() - sourceRect.y()) * scaleY,
+                    part.width() * scaleX, part.height() * scaleY);
+      painter.drawImage(target, source,
+                        QRectF(part.translated(-tileArea.topLeft())));
+    }
+  }
+}
+
+bool TiledImage::isTransparent(const QImage &image, const QRect &area) {
+  for (int y = area.top(); y <= area.bottom(); ++y) {
+    const QRgb *line =
+        reinterpret_cast<const QRgb *>(image.constScanLine(y)) + area.left();
+    // Premultiplied transparent pixels are all zero, so OR-ing whole
+    // pixels together is enough and vectorizes well.
+    QRgb bits = 0;
+    for (int x = 0; x < area.width(); ++x) {
+      bits |= line[x];
+    }
+    if (bits != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int TiledImage::tileIndex(int column, int row) const {
+  return row * m_columns + column;
+}
+
+bool TiledImage::hasTileNear(int column, int row) const {
+  for (int r = std::max(row - 1, 0); r <= std::min(row + 1, m_rows - 1); ++r) {
+    for (int c = std::max(column - 1, 0);
+         c <= std::min(column + 1, m_columns - 1); ++c) {
+      if (hasTile(c, r)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
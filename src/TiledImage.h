@@ -0,0 +1,84 @@
+#ifndef TILEDIMAGE_H
+#define TILEDIMAGE_H
+
+#include <QImage>
+#include <QRect>
+#include <QSize>
+#include <functional>
+#include <memory>
+#include <vector>
+
+class QPainter;
+class Tile;
+
+// ARGB32 premultiplied pixels stored as a grid of tiles. Tiles that were
+// never painted, or that became fully transparent, are not allocated.
+// Copies share tiles until one side writes, and cold tiles may be held
+// compressed by TileCache.
+class TiledImage {
+public:
+  static constexpr int TileSize = 256;
+
+  TiledImage();
+  explicit TiledImage(const QSize &size);
+  explicit TiledImage(const QImage &image);
+
+  bool isNull() const;
+  QSize size() const;
+  int width() const;
+  int height() const;
+  QRect rect() const;
+
+  int columns() const;
+  int rows() const;
+  QRect tileRect(int column, int row) const;
+  QRect tileSpan(const QRect &area) const;
+
+  bool hasTile(int column, int row) const;
+  QImage tile(int column, int row) const;
+  QImage &tileForWriting(int column, int row);
+  void setTile(int column, int row, const QImage &image);
+  void setTile(int column, int row, std::shared_ptr<Tile> tile);
+  void releaseTile(int column, int row);
+
+  QRect bounds() const;
+  qsizetype allocatedBytes() const;
+  qsizetype residentBytes() const;
+  // Whether a tile has lost its pixels; see Tile::isDamaged.
+  bool isDamaged() const;
+
+  // The shared tile objects, for tracking what copies have in common.
+  const std::vector<std::shared_ptr<Tile>> &tileStorage() const;
+
+  void setImage(const QImage &image);
+  QImage toImage() const;
+  QImage copy(const QRect &area) const;
+
+  // Runs the function on every tile in parallel and returns the result.
+  // With an apron the function sees that many neighbouring pixels on each
+  // side, for filters that read outside the pixel they write. Every tile
+  // the function runs on is replaced, except that without an apron a tile
+  // whose image it returns untouched keeps sharing its pixels with this
+  // image, as do transparent tiles it cannot affect.
+  TiledImage transformed(const std::function<QImage(const QImage &)> &function,
+                         int apron = 0) const;
+
+  // Drops tiles overlapping the area that no longer hold visible pixels.
+  void optimize(const QRect &area);
+
+  void render(QPainter &painter, const QRectF &targetRect,
+              const QRect &sourceRect) const;
+
+  static bool isTransparent(const QImage &image, const QRect &area);
+
+private:
+  int tileIndex(int column, int row) const;
+  bool hasTileNear(int column, int row) const;
+
+  QSize m_size;
+  int m_columns;
+  int m_rows;
+  std::vector<std::shared_ptr<Tile>> m_tiles;
+};
+
+#endif
@@ -0,0 +1,261 @@
+#include "UndoStack.h"
+#include "Tile.h"
+#include "TileCache.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+namespace {
+
+constexpr qsizetype DefaultLimit = qsizetype(512) * 1024 * 1024;
+// Every this many commands, one keeps its state, which bounds how many
+// an undo has to replay.
+constexpr int CheckpointInterval = 4;
+
+} // namespace
+
+UndoStack::UndoStack()
+    : m_entries(), m_droppedCommands(), m_index(-1), m_limit(DefaultLimit) {}
+
+void UndoStack::setMemoryLimit(qsizetype bytes) {
+  m_limit = std::max<qsizetype>(bytes, 0);
+  enforceLimit();
+}
+
+qsizetype UndoStack::memoryLimit() const { return m_limit; }
+
+qsizetype UndoStack::memoryUsage() const {
+  qsizetype bytes = 0;
+  for (const Entry &entry : m_entries) {
+    bytes += entry.bytes;
+  }
+  return bytes;
+}
+
+void UndoStack::reset(const DocumentState &state) {
+  m_entries.clear();
+  m_droppedCommands.clear();
+  Entry entry;
+  entry.state = state;
+  m_entries.push_back(std::move(entry));
+  m_index = 0;
+}
+
+void UndoStack::clear() {
+  m_entries.clear();
+  m_droppedCommands.clear();
+  m_index = -1;
+}
+
+void UndoStack::push(const QString &text, const DocumentState &state,
+                     bool mergeable) {
+  Entry entry;
+  entry.text = text;
+  entry.state = state;
+  append(std::move(entry), mergeable);
+}
+
+void UndoStack::push(const QString &text, const DocumentState &state,
+                     const EditCommand &command) {
+  Entry entry;
+  entry.text = text;
+  entry.state = state;
+  entry.command = command;
+  append(std::move(entry), false);
+}
+
+void UndoStack::append(Entry entry, bool mergeable) {
+  if (m_index < 0) {
+    reset(*entry.state);
+    return;
+  }
+
+  m_entries.erase(m_entries.begin() + m_index + 1, m_entries.end());
+
+  Entry &top = m_entries.back();
+  if (mergeable && m_index > 0 && !top.command && top.text == entry.text) {
+    top.state = entry.state;
+  } else {
+    if (entry.command) {
+      // A checkpoint bounds how many commands an undo has to replay.
+      int replayed = 1;
+      for (int i = m_index; i >= 0 && !keepsState(m_entries[i]); --i) {
+        ++replayed;
+      }
+      entry.checkpoint = replayed >= CheckpointInterval;
+    }
+    if (!keepsState(top)) {
+      top.state.reset();
+      top.replacedTiles.clear();
+      top.bytes = 0;
+    }
+    m_entries.push_back(std::move(entry));
+    ++m_index;
+  }
+
+  int previous = m_index - 1;
+  while (previous >= 0 && !m_entries[previous].state) {
+    --previous;
+  }
+  if (previous >= 0) {
+    updateReplacedTiles(previous);
+  }
+  enforceLimit();
+}
+
+bool UndoStack::canUndo() const { return m_index > 0; }
+
+bool UndoStack::canRedo() const {
+  return m_index >= 0 && m_index + 1 < static_cast<int>(m_entries.size());
+}
+
+QString UndoStack::undoText() const {
+  return canUndo() ? m_entries[m_index].text : QString();
+}
+
+QString UndoStack::redoText() const {
+  return canRedo() ? m_entries[m_index + 1].text : QString();
+}
+
+UndoStack::Step UndoStack::undoStep() const {
+  return canUndo() ? stepTo(m_index - 1) : Step();
+}
+
+UndoStack::Step UndoStack::redoStep() const {
+  return canRedo() ? stepTo(m_index + 1) : Step();
+}
+
+void UndoStack::moveTo(int index, const DocumentState &state) {
+  if (index < 0 || index >= static_cast<int>(m_entries.size())) {
+    return;
+  }
+
+  const int previous = m_index;
+  Entry &current = m_entries[m_index];
+  if (index != m_index && !keepsState(current)) {
+    current.state.reset();
+  }
+  m_index = index;
+  m_entries[m_index].state = state;
+
+  updateReplacedTilesAround(previous);
+  updateReplacedTilesAround(m_index);
+  enforceLimit();
+}
+
+std::vector<EditCommand> UndoStack::commands() const {
+  std::vector<EditCommand> commands = m_droppedCommands;
+  for (int i = 0; i <= m_index; ++i) {
+    if (m_entries[i].command) {
+      commands.push_back(*m_entries[i].command);
+    }
+  }
+  return commands;
+}
+
+UndoStack::Step UndoStack::stepTo(int index) const {
+  // The first entry always holds a state, so the walk back terminates.
+  int base = index;
+  while (!m_entries[base].state) {
+    --base;
+  }
+
+  Step step;
+  step.index = index;
+  step.base = *m_entries[base].state;
+  for (int i = base + 1; i <= index; ++i) {
+    step.commands.push_back(*m_entries[i].command);
+  }
+  return step;
+}
+
+bool UndoStack::keepsState(const Entry &entry) {
+  return !entry.command || entry.checkpoint;
+}
+
+void UndoStack::updateReplacedTiles(int index) {
+  Entry &entry = m_entries[index];
+  entry.replacedTiles.clear();
+  entry.bytes = 0;
+  entry.eviction = 0;
+  if (!entry.state) {
+    return;
+  }
+
+  int next = index + 1;
+  while (next < static_cast<int>(m_entries.size()) &&
+         !m_entries[next].state) {
+    ++next;
+  }
+  if (next == static_cast<int>(m_entries.size())) {
+    return;
+  }
+
+  std::unordered_set<const Tile *> kept;
+  for (const Layer &layer : m_entries[next].state->layers) {
+    for (const auto &tile : layer.tiles().tileStorage()) {
+      kept.insert(tile.get());
+    }
+  }
+
+  for (const Layer &layer : entry.state->layers) {
+    for (const auto &tile : layer.tiles().tileStorage()) {
+      if (tile && !kept.count(tile.get())) {
+        entry.replacedTiles.push_back(tile.get());
+        entry.bytes += qsizetype(tile->size().width()) *
+                       tile->size().height() * 4;
+      }
+    }
+  }
+}
+
+void UndoStack::updateReplacedTilesAround(int index) {
+  updateReplacedTiles(index);
+  int previous = index - 1;
+  while (previous >= 0 && !m_entries[previous].state) {
+    --previous;
+  }
+  if (previous >= 0) {
+    updateReplacedTiles(previous);
+  }
+}
+
+void UndoStack::enforceLimit() {
+  // Walking back from the newest entry, the first quarter of the limit
+  // stays as it is, the rest up to half is compressed, the rest up to the
+  // limit is spilled to disk, and anything older is dropped.
+  qsizetype total = 0;
+  int keep = 0;
+  for (int i = static_cast<int>(m_entries.size()) - 1; i >= 0; --i) {
+    Entry &entry = m_entries[i];
+    total += entry.bytes;
+    if (m_limit > 0 && total > m_limit && i < m_index) {
+      keep = i + 1;
+      break;
+    }
+    // Entries already pushed out this far are skipped, so a step only
+    // costs the entries that crossed a threshold.
+    if (m_limit > 0 && total > m_limit / 4) {
+      const int eviction = total > m_limit / 2 ? 2 : 1;
+      if (entry.eviction < eviction) {
+        for (Tile *tile : entry.replacedTiles) {
+          TileCache::instance().evict(tile, eviction == 2);
+        }
+        entry.eviction = eviction;
+      }
+    }
+  }
+
+  // The oldest remaining entry must hold a state for replay to start from.
+  while (keep < m_index && !m_entries[keep].state) {
+    ++keep;
+  }
+
+  for (int i = 0; i < keep; ++i) {
+    if (m_entries[i].command) {
+      m_droppedCommands.push_back(*m_entries[i].command);
+    }
+  }
+  m_entries.erase(m_entries.begin(), m_entries.begin() + keep);
+  m_index -= keep;
+}
@@ -0,0 +1,93 @@
+#ifndef UNDOSTACK_H
+#define UNDOSTACK_H
+
+#include "EditCommand.h"
+
+#include <QString>
+#include <deque>
+#include <optional>
+#include <vector>
+
+class Tile;
+
+// Linear history of document states. States share tiles with each other
+// and with the live document, so each entry only costs the tiles its
+// operation replaced. Whole-image operations replace every tile, so they
+// are recorded as commands instead, with a full checkpoint every few
+// steps. Past the memory limit, older entries are compressed, then
+// spilled to the swap file, then dropped.
+class UndoStack {
+public:
+  UndoStack();
+
+  void setMemoryLimit(qsizetype bytes);
+  qsizetype memoryLimit() const;
+  qsizetype memoryUsage() const;
+
+  void reset(const DocumentState &state);
+  void clear();
+
+  // Records the state an operation produced. A mergeable push replaces
+  // the newest entry when it has the same text, so slider drags collapse
+  // into one step.
+  void push(const QString &text, const DocumentState &state,
+            bool mergeable = false);
+  // Records the state a command produced. The state is only kept while it
+  // is current or when the entry is a checkpoint.
+  void push(const QString &text, const DocumentState &state,
+            const EditCommand &command);
+
+  bool canUndo() const;
+  bool canRedo() const;
+  QString undoText() const;
+  QString redoText() const;
+
+  // How to rebuild the state one step back or forward: a stored state and
+  // the commands, possibly none, to replay on top of it in order.
+  struct Step {
+    int index = -1;
+    DocumentState base;
+    std::vector<EditCommand> commands;
+  };
+  Step undoStep() const;
+  Step redoStep() const;
+  // Makes the entry at index current once its state has been rebuilt.
+  void moveTo(int index, const DocumentState &state);
+
+  // Commands of the entries up to the current one, oldest first,
+  // including those of entries dropped past the memory limit.
+  std::vector<EditCommand> commands() const;
+
+private:
+  struct Entry {
+    QString text;
+    std::optional<DocumentState> state;
+    std::optional<EditCommand> command;
+    bool checkpoint = false;
+    // Tiles this state holds that the next stored state no longer does.
+    std::vector<Tile *> replacedTiles;
+    qsizetype bytes = 0;
+    // How far enforceLimit() has pushed replacedTiles out: 0 not at all,
+    // 1 compressed, 2 spilled to disk.
+    int eviction = 0;
+  };
+
+  void append(Entry entry, bool mergeable);
+  Step stepTo(int index) const;
+  static bool keepsState(const Entry &entry);
+  void updateReplacedTiles(int index);
+  // Updates the entry at index and the stored state before it, the only
+  // ones whose replaced tiles change when that entry gains or loses its
+  // state.
+  void updateReplacedTilesAround(int index);
+  void enforceLimit();
+
+  std::deque<Entry> m_entries;
+  // Commands of entries dropped past the memory limit, oldest first. They
+  // are a few bytes each and keep recipes complete.
+  std::vector<EditCommand> m_droppedCommands;
+  int m_index;
+  qsizetype m_limit;
+};
+
+#endif
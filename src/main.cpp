@@ -1,8 +1,21 @@
 #include <QApplication>
+#include "BatchProcessor.h"
 #include "MainWindow.h"
 
 int main(int argc, char* argv[])
 {
+    if (BatchProcessor::isRequested(argc, argv)) {
+        QCoreApplication app(argc, argv);
+        app.setApplicationName("Picture");
+        app.setOrganizationName("Picture");
+        app.setApplicationVersion("0.1.0");
+        return BatchProcessor::run(app.arguments());
+    }
+
+    // Keep every pointer sample; ImageCanvas batches them itself.
+    QApplication::setAttribute(Qt::AA_CompressHighFrequencyEvents, false);
+    QApplication::setAttribute(Qt::AA_CompressTabletEvents, false);
+
     QApplication app(argc, argv);
 
     app.setApplicationName("Picture");